@@ -0,0 +1,570 @@
+/*
+ * android.c
+ * Detection and layered data sources for Android image formats.
+ *
+ * Copyright (c) 2026 The disktype contributors
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "global.h"
+
+/* sparse image chunk types */
+#define CHUNK_RAW       (0xCAC1)
+#define CHUNK_FILL      (0xCAC2)
+#define CHUNK_DONT_CARE (0xCAC3)
+#define CHUNK_CRC32     (0xCAC4)
+
+/* liblp metadata for dynamic partitions */
+#define LP_GEOMETRY_MAGIC (0x616c4467)
+#define LP_HEADER_MAGIC   (0x414C5030)
+#define LP_RESERVED_BYTES (4096)
+#define LP_GEOMETRY_SIZE  (4096)
+#define LP_SECTOR_SIZE    (512)
+#define LP_TARGET_LINEAR  (0)
+#define LP_TARGET_ZERO    (1)
+#define LP_ATTR_READONLY  (1)
+
+/* extent types of the mapping source */
+#define MAP_DATA (0)
+#define MAP_FILL (1)
+#define MAP_ZERO (2)
+
+/*
+ * types
+ */
+
+typedef struct map_extent {
+  u8 start, len;     /* in the mapped image */
+  int type;
+  u8 off;            /* data in the foundation */
+  u1 fill[4];
+} MAP_EXTENT;
+
+typedef struct lp_table {
+  unsigned char *base;
+  u4 count, size;
+} LP_TABLE;
+
+typedef struct map_source {
+  SOURCE c;
+  u4 count, alloc;
+  MAP_EXTENT *extents;
+  u4 last;           /* where the previous lookup ended up */
+} MAP_SOURCE;
+
+/*
+ * helper functions
+ */
+
+static MAP_SOURCE *init_map_source(SOURCE *foundation, char *name,
+                                   u4 max_extents);
+static MAP_EXTENT *add_map_extent(MAP_SOURCE *ms);
+static u8 read_map(SOURCE *s, u8 pos, u8 len, void *buf);
+static u8 locate_map(SOURCE *s, u8 pos, u8 len, u8 *found_pos);
+static u4 find_map_extent(MAP_SOURCE *ms, u8 pos);
+static void close_map(SOURCE *s);
+
+static SOURCE *init_sparse_source(SECTION *section, int level,
+                                  unsigned char *header);
+static void analyze_lp_partition(SECTION *section, int level,
+                                 LP_TABLE *t, u4 index);
+
+/*
+ * Android sparse image detection
+ */
+
+void detect_android_sparse(SECTION *section, int level)
+{
+  unsigned char *buf;
+  u4 block_size, block_count, chunk_count;
+  char s[256];
+  SOURCE *src;
+
+  if (get_buffer(section, 0, 28, (void **)&buf) < 28)
+    return;
+  if (get_le_long(buf) != 0xed26ff3a)
+    return;
+
+  block_size = get_le_long(buf + 12);
+  block_count = get_le_long(buf + 16);
+  chunk_count = get_le_long(buf + 20);
+
+  print_line(level, "Android sparse image, version %d.%d",
+             (int)get_le_short(buf + 4), (int)get_le_short(buf + 6));
+  format_blocky_size(s, block_count, block_size, "blocks", NULL);
+  print_line(level + 1, "Image size %s", s);
+  print_line(level + 1, "%lu chunks", chunk_count);
+
+  if (get_le_short(buf + 4) != 1) {
+    print_line(level + 1, "Error: Unknown major version");
+    return;
+  }
+
+  src = init_sparse_source(section, level, buf);
+  if (src != NULL) {
+    analyze_source(src, level);
+    close_source(src);
+  }
+
+  stop_detect();
+}
+
+/*
+ * initialize the mapping source: read all chunk headers into an index
+ */
+
+static SOURCE *init_sparse_source(SECTION *section, int level,
+                                  unsigned char *header)
+{
+  MAP_SOURCE *ms;
+  MAP_EXTENT *c;
+  unsigned char *buf;
+  u4 header_size, chunk_header_size, block_size, block_count;
+  u4 chunk_count, i, raw, fill, dont_care;
+  u4 chunk_blocks, chunk_bytes;
+  u8 pos, start;
+  int type;
+
+  header_size = get_le_short(header + 8);
+  chunk_header_size = get_le_short(header + 10);
+  block_size = get_le_long(header + 12);
+  block_count = get_le_long(header + 16);
+  chunk_count = get_le_long(header + 20);
+
+  if (header_size < 28 || chunk_header_size < 12 ||
+      block_size == 0 || (block_size & 3) != 0) {
+    print_line(level + 1, "Error: Invalid sparse image header");
+    return NULL;
+  }
+  /* the chunk headers alone must fit; the table grows as chunks are
+     read, so a bogus count with no size to check runs out of data */
+  if (section->size > 0 && (section->size < header_size ||
+                            (u8)chunk_count * chunk_header_size >
+                            section->size - header_size)) {
+    print_line(level + 1, "Error: Chunk count exceeds the image file");
+    return NULL;
+  }
+
+  ms = init_map_source(section->source, "sparse", 0);
+  ms->c.size = (u8)block_count * block_size;
+
+  /* walk the chunks; they come in image order */
+  pos = header_size;
+  start = 0;
+  raw = fill = dont_care = 0;
+  for (i = 0; i < chunk_count; i++) {
+    if (get_buffer(section, pos, chunk_header_size,
+                   (void **)&buf) < chunk_header_size) {
+      print_line(level + 1, "Error reading chunk header %lu", i);
+      goto errorexit;
+    }
+    type = get_le_short(buf);
+    chunk_blocks = get_le_long(buf + 4);
+    chunk_bytes = get_le_long(buf + 8);
+    if (chunk_bytes < chunk_header_size) {
+      print_line(level + 1, "Error: Invalid size for chunk %lu", i);
+      goto errorexit;
+    }
+
+    c = add_map_extent(ms);
+    c->start = start;
+    c->len = (u8)chunk_blocks * block_size;
+    c->type = MAP_ZERO;
+    c->off = section->pos + pos + chunk_header_size;
+
+    if (type == CHUNK_RAW) {
+      c->type = MAP_DATA;
+      if (chunk_bytes - chunk_header_size != c->len) {
+        print_line(level + 1, "Error: Raw chunk %lu has the wrong size", i);
+        goto errorexit;
+      }
+      raw++;
+    } else if (type == CHUNK_FILL) {
+      if (get_buffer(section, pos + chunk_header_size, 4,
+                     (void **)&buf) < 4) {
+        print_line(level + 1, "Error reading fill chunk %lu", i);
+        goto errorexit;
+      }
+      memcpy(c->fill, buf, 4);
+      c->type = MAP_FILL;
+      fill++;
+    } else if (type == CHUNK_DONT_CARE) {
+      dont_care++;
+    } else if (type != CHUNK_CRC32) {
+      print_line(level + 1, "Error: Unknown type %04X for chunk %lu",
+                 type, i);
+      goto errorexit;
+    }
+
+    /* checksum chunks don't stand for any data */
+    if (c->len > 0 && type != CHUNK_CRC32)
+      ms->count++;
+    start += c->len;
+    pos += chunk_bytes;
+  }
+
+  print_line(level + 1, "Chunks: %lu raw, %lu fill, %lu don't care",
+             raw, fill, dont_care);
+  if (start != ms->c.size) {
+    print_line(level + 1, "Error: Chunks don't add up to the image size");
+    goto errorexit;
+  }
+
+  return (SOURCE *)ms;
+
+errorexit:
+  close_map((SOURCE *)ms);
+  free(ms);
+  return NULL;
+}
+
+/*
+ * Android dynamic partitions ("super" partition, liblp metadata)
+ */
+
+void detect_android_super(SECTION *section, int level)
+{
+  unsigned char *buf, *tables;
+  u4 max_size, slot_count, header_size, tables_size;
+  u4 table_offset[4], table_count[4], table_size[4];
+  LP_TABLE t[4];
+  u4 i;
+  char s[256];
+
+  /* check the primary geometry */
+  if (get_buffer(section, LP_RESERVED_BYTES, 52, (void **)&buf) < 52)
+    return;
+  if (get_le_long(buf) != LP_GEOMETRY_MAGIC || get_le_long(buf + 4) < 52)
+    return;
+  max_size = get_le_long(buf + 40);
+  slot_count = get_le_long(buf + 44);
+
+  /* primary metadata of the first slot */
+  if (get_buffer(section, LP_RESERVED_BYTES + 2 * LP_GEOMETRY_SIZE, 128,
+                 (void **)&buf) < 128)
+    return;
+  if (get_le_long(buf) != LP_HEADER_MAGIC)
+    return;
+
+  print_line(level, "Android dynamic partition metadata, version %d.%d",
+             (int)get_le_short(buf + 4), (int)get_le_short(buf + 6));
+  format_size(s, max_size);
+  print_line(level + 1, "%lu metadata slots of %s", slot_count, s);
+
+  if (get_le_short(buf + 4) != 10) {
+    print_line(level + 1, "Error: Unknown major version");
+    return;
+  }
+
+  header_size = get_le_long(buf + 8);
+  tables_size = get_le_long(buf + 44);
+  /* partitions, extents, groups, block devices */
+  for (i = 0; i < 4; i++) {
+    table_offset[i] = get_le_long(buf + 80 + i * 12);
+    table_count[i] = get_le_long(buf + 84 + i * 12);
+    table_size[i] = get_le_long(buf + 88 + i * 12);
+    if (table_offset[i] > tables_size ||
+        (u8)table_count[i] * table_size[i] >
+        tables_size - table_offset[i]) {
+      print_line(level + 1, "Error: Metadata table %lu out of bounds", i);
+      return;
+    }
+  }
+  if (header_size < 128 || (u8)header_size + tables_size > max_size ||
+      table_size[0] < 52 || table_size[1] < 24 ||
+      table_size[2] < 48 || table_size[3] < 64) {
+    print_line(level + 1, "Error: Invalid metadata header");
+    return;
+  }
+
+  /* keep a copy of the tables, get_buffer may reuse its memory */
+  if (get_buffer(section, LP_RESERVED_BYTES + 2 * LP_GEOMETRY_SIZE +
+                 header_size, tables_size, (void **)&buf) < tables_size) {
+    print_line(level + 1, "Error reading metadata tables");
+    return;
+  }
+  tables = (unsigned char *)malloc(tables_size + 1);
+  if (tables == NULL)
+    bailout("Out of memory");
+  memcpy(tables, buf, tables_size);
+  for (i = 0; i < 4; i++) {
+    t[i].base = tables + table_offset[i];
+    t[i].count = table_count[i];
+    t[i].size = table_size[i];
+  }
+
+  /* the super device itself comes first */
+  if (t[3].count > 0) {
+    get_string(t[3].base + 24, 36, s);
+    print_line(level + 1, "Block device \"%s\"", s);
+    format_size_verbose(s, get_le_quad(t[3].base + 16));
+    print_line(level + 2, "Size %s", s);
+  }
+
+  for (i = 0; i < t[0].count; i++)
+    analyze_lp_partition(section, level, t, i);
+
+  free(tables);
+}
+
+/*
+ * describe one logical partition and analyze its contents through a
+ * mapping source built from its extents
+ */
+
+static void analyze_lp_partition(SECTION *section, int level,
+                                 LP_TABLE *t, u4 index)
+{
+  unsigned char *part, *ext;
+  u4 attributes, first, count, group, i;
+  u8 size, sectors, pos;
+  int other_device;
+  char s[256], name[40];
+  MAP_SOURCE *ms;
+  MAP_EXTENT *c;
+
+  part = t[0].base + index * t[0].size;
+  get_string(part, 36, name);
+  attributes = get_le_long(part + 36);
+  first = get_le_long(part + 40);
+  count = get_le_long(part + 44);
+  group = get_le_long(part + 48);
+
+  if (first > t[1].count || count > t[1].count - first) {
+    print_line(level, "Logical partition %lu: invalid extent list",
+               index + 1);
+    return;
+  }
+
+  /* sum up the extents */
+  size = 0;
+  other_device = 0;
+  for (i = first; i < first + count; i++) {
+    ext = t[1].base + i * t[1].size;
+    size += get_le_quad(ext);
+    if (get_le_long(ext + 8) == LP_TARGET_LINEAR &&
+        get_le_long(ext + 20) != 0)
+      other_device = 1;
+  }
+
+  if (count == 0) {
+    print_line(level, "Logical partition %lu: empty", index + 1);
+  } else {
+    format_blocky_size(s, size, LP_SECTOR_SIZE, "sectors", NULL);
+    print_line(level, "Logical partition %lu: %s", index + 1, s);
+  }
+  print_line(level + 1, "Name \"%s\"", name);
+  if (group < t[2].count) {
+    get_string(t[2].base + group * t[2].size, 36, s);
+    print_line(level + 1, "Group \"%s\"", s);
+  }
+  if (attributes & LP_ATTR_READONLY)
+    print_line(level + 1, "Read-only");
+  if (count > 1)
+    print_line(level + 1, "%lu extents", count);
+
+  if (count == 0)
+    return;
+  if (other_device) {
+    print_line(level + 1, "Data on other block devices, not analyzed");
+    return;
+  }
+
+  /* build the extent table; the partition's contents are read in place */
+  ms = init_map_source(section->source, "lp", count);
+  ms->c.size = size * LP_SECTOR_SIZE;
+  pos = 0;
+  for (i = first; i < first + count; i++) {
+    ext = t[1].base + i * t[1].size;
+    sectors = get_le_quad(ext);
+    if (sectors == 0)
+      continue;
+    c = &ms->extents[ms->count++];
+    c->start = pos;
+    c->len = sectors * LP_SECTOR_SIZE;
+    c->type = MAP_ZERO;
+    if (get_le_long(ext + 8) == LP_TARGET_LINEAR) {
+      c->type = MAP_DATA;
+      c->off = section->pos + get_le_quad(ext + 12) * LP_SECTOR_SIZE;
+    }
+    pos += c->len;
+  }
+
+  analyze_source((SOURCE *)ms, level + 1);
+  close_source((SOURCE *)ms);
+}
+
+/*
+ * mapping source: a table of extents sorted by position in the image
+ */
+
+static MAP_SOURCE *init_map_source(SOURCE *foundation, char *name,
+                                   u4 max_extents)
+{
+  MAP_SOURCE *ms;
+
+  /* allocate and init source structure */
+  ms = (MAP_SOURCE *)malloc(sizeof(MAP_SOURCE));
+  if (ms == NULL)
+    bailout("Out of memory");
+  memset(ms, 0, sizeof(MAP_SOURCE));
+
+  ms->c.size_known = 1;
+  ms->c.name = name;
+  ms->c.foundation = foundation;
+  ms->c.read_bytes = read_map;
+  ms->c.locate = locate_map;
+  ms->c.close = close_map;
+
+  ms->alloc = max_extents + 1;
+  ms->extents = (MAP_EXTENT *)malloc(ms->alloc * sizeof(MAP_EXTENT));
+  if (ms->extents == NULL)
+    bailout("Out of memory");
+
+  return ms;
+}
+
+/*
+ * make room for one more extent after the last one; it only counts once
+ * the caller increments count
+ */
+
+static MAP_EXTENT *add_map_extent(MAP_SOURCE *ms)
+{
+  if (ms->count >= ms->alloc) {
+    ms->alloc *= 2;
+    ms->extents = (MAP_EXTENT *)realloc(ms->extents,
+                                        ms->alloc * sizeof(MAP_EXTENT));
+    if (ms->extents == NULL)
+      bailout("Out of memory");
+  }
+  return &ms->extents[ms->count];
+}
+
+/*
+ * mapping read
+ */
+
+static u8 read_map(SOURCE *s, u8 pos, u8 len, void *buf)
+{
+  MAP_SOURCE *ms = (MAP_SOURCE *)s;
+  MAP_EXTENT *c;
+  unsigned char *p;
+  u8 got, rel, n, result, i;
+  u4 index;
+
+  p = (unsigned char *)buf;
+  got = 0;
+  index = find_map_extent(ms, pos);
+  for (; got < len && index < ms->count; index++) {
+    c = &ms->extents[index];
+    rel = pos + got - c->start;
+    n = c->len - rel;
+    if (n > len - got)
+      n = len - got;
+
+    if (c->type == MAP_DATA) {
+      /* straight from the foundation into the caller's buffer */
+      result = get_buffer_real(s->foundation, c->off + rel, n,
+                               p + got, NULL);
+      got += result;
+      if (result < n)
+        break;
+    } else if (c->type == MAP_FILL) {
+      for (i = 0; i < n; i++)
+        p[got + i] = c->fill[(rel + i) & 3];
+      got += n;
+    } else {
+      memset(p + got, 0, n);
+      got += n;
+    }
+  }
+
+  ms->last = index > 0 ? index - 1 : 0;
+  return got;
+}
+
+/*
+ * requests within one data extent are passed on to the foundation, so
+ * raw data isn't copied into a cache of its own
+ */
+
+static u8 locate_map(SOURCE *s, u8 pos, u8 len, u8 *found_pos)
+{
+  MAP_SOURCE *ms = (MAP_SOURCE *)s;
+  MAP_EXTENT *c;
+  u4 index;
+
+  index = find_map_extent(ms, pos);
+  if (index >= ms->count)
+    return 0;
+  c = &ms->extents[index];
+  if (c->type != MAP_DATA)
+    return 0;
+  ms->last = index;
+  *found_pos = c->off + (pos - c->start);
+  return c->start + c->len - pos;
+}
+
+/*
+ * find the extent holding pos; reads tend to follow each other, so the
+ * last one is tried before the binary search
+ */
+
+static u4 find_map_extent(MAP_SOURCE *ms, u8 pos)
+{
+  MAP_EXTENT *c;
+  u4 lo, hi, mid;
+
+  if (ms->count == 0)
+    return 0;
+  c = &ms->extents[ms->last];
+  if (pos >= c->start && pos < c->start + c->len)
+    return ms->last;
+
+  lo = 0;
+  hi = ms->count - 1;
+  while (lo < hi) {
+    mid = lo + (hi - lo + 1) / 2;
+    if (ms->extents[mid].start <= pos)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  if (pos >= ms->extents[lo].start + ms->extents[lo].len)
+    return ms->count;  /* past the end */
+  return lo;
+}
+
+/*
+ * cleanup
+ */
+
+static void close_map(SOURCE *s)
+{
+  MAP_SOURCE *ms = (MAP_SOURCE *)s;
+
+  if (ms->extents != NULL)
+    free(ms->extents);
+}
+
+/* EOF */
@@ -27,6 +27,81 @@
 
 #include "global.h"
 
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef USE_BZIP2
+#include <bzlib.h>
+#endif
+#ifdef USE_LZMA
+#include <lzma.h>
+#endif
+
+/* UDIF run types */
+#define UDIF_ZERO    (0x00000000)
+#define UDIF_RAW     (0x00000001)
+#define UDIF_IGNORE  (0x00000002)
+#define UDIF_ADC     (0x80000004)
+#define UDIF_ZLIB    (0x80000005)
+#define UDIF_BZIP2   (0x80000006)
+#define UDIF_LZFSE   (0x80000007)
+#define UDIF_LZMA    (0x80000008)
+#define UDIF_COMMENT (0x7ffffffe)
+#define UDIF_END     (0xffffffff)
+
+/* number of decompressed runs kept in memory */
+#define RUN_CACHE_SIZE (8)
+/* largest run or property list we load */
+#define UDIF_MAX_LOAD (64*1024*1024)
+
+/*
+ * types
+ */
+
+typedef struct udif_run {
+  u8 start, size;    /* in the disk */
+  u8 off, len;       /* in the foundation */
+  u4 type;
+} UDIF_RUN;
+
+typedef struct run_slot {
+  u4 run;            /* valid if used != 0 */
+  u4 used;           /* for LRU replacement */
+  u8 alloc;
+  unsigned char *data;
+} RUN_SLOT;
+
+typedef struct udif_source {
+  SOURCE c;
+  u4 run_count;
+  UDIF_RUN *runs;    /* sorted by start */
+  RUN_SLOT slots[RUN_CACHE_SIZE];
+  u4 clock;
+  u8 inbuf_alloc;
+  unsigned char *inbuf;
+} UDIF_SOURCE;
+
+/*
+ * helper functions
+ */
+
+static SOURCE *init_udif_source(SECTION *section, int level,
+                                unsigned char *koly);
+static int add_blkx(UDIF_SOURCE *us, unsigned char *blkx, u4 len,
+                    u8 base, u4 *alloc);
+static u4 decode_base64(const char *from, const char *end,
+                        unsigned char *to);
+static int compare_runs(const void *a, const void *b);
+static const char *udif_method_name(u4 type);
+static int udif_method_supported(u4 type);
+static u8 read_udif(SOURCE *s, u8 pos, u8 len, void *buf);
+static unsigned char *get_run_data(UDIF_SOURCE *us, u4 index);
+static int decompress_run(UDIF_SOURCE *us, UDIF_RUN *run,
+                          unsigned char *out);
+static int decompress_adc(unsigned char *in, u8 in_len,
+                          unsigned char *out, u8 out_len);
+static void close_udif(SOURCE *s);
+
 /*
  * Apple partition map detection
  */
@@ -209,18 +284,550 @@ void detect_apple_volume(SECTION *section, int level)
 void detect_udif(SECTION *section, int level)
 {
   u8 pos;
-  unsigned char *buf;
+  unsigned char *buf, koly[512];
+  char s[256];
+  SOURCE *src;
 
   if (section->size < 1024 || section->source->sequential)
     return;
 
   pos = section->size - 512;
-  if (get_buffer(section, pos, 512, (void **)&buf) < 512)
+  if (get_buffer(section, pos, 512, (void **)&buf) < 512) {
+    if (beyond_budget(section, pos, 512))
+      print_line(level, "UDIF trailer not checked, beyond "
+                 "decompression budget");
+    return;
+  }
+  if (memcmp(buf, "koly", 4) != 0)
     return;
+  memcpy(koly, buf, 512);
+
+  print_line(level, "Apple UDIF disk image, version %lu",
+             get_be_long(koly + 4));
+  format_size_verbose(s, get_be_quad(koly + 492) * 512);
+  print_line(level + 1, "Disk size %s", s);
+
+  /* old-style images without a property list are left to the other
+     detectors, as before; uncompressed ones are recognized that way */
+  src = init_udif_source(section, level, koly);
+  if (src == NULL) {
+    print_line(level + 1, "Content detection on the raw data may or may "
+               "not work...");
+    return;
+  }
+  analyze_source(src, level);
+  close_source(src);
+
+  stop_detect();
+}
+
+/*
+ * initialize the mapping source from the blkx tables in the XML
+ * property list
+ */
+
+static SOURCE *init_udif_source(SECTION *section, int level,
+                                unsigned char *koly)
+{
+  UDIF_SOURCE *us;
+  char *xml, *p, *end, *data_end;
+  unsigned char *blkx;
+  u8 xml_off, xml_len, base;
+  u4 alloc, len, i, methods;
+  int bad;
+  char s[512];
+
+  xml_off = get_be_quad(koly + 216);
+  xml_len = get_be_quad(koly + 224);
+  if (xml_len == 0) {
+    print_line(level + 1, "Error: No XML property list (old-style image)");
+    return NULL;
+  }
+  if (xml_len > UDIF_MAX_LOAD) {
+    print_line(level + 1, "Error: XML property list too large");
+    return NULL;
+  }
+
+  /* allocate and init source structure */
+  us = (UDIF_SOURCE *)malloc(sizeof(UDIF_SOURCE));
+  if (us == NULL)
+    bailout("Out of memory");
+  memset(us, 0, sizeof(UDIF_SOURCE));
+
+  us->c.size_known = 1;
+  us->c.size = get_be_quad(koly + 492) * 512;
+  us->c.name = "udif";
+  us->c.foundation = section->source;
+  us->c.read_bytes = read_udif;
+  us->c.close = close_udif;
+
+  /* load the property list as a string */
+  xml = (char *)malloc(xml_len + 1);
+  if (xml == NULL)
+    bailout("Out of memory");
+  if (get_buffer_real(section->source, section->pos + xml_off, xml_len,
+                      xml, NULL) < xml_len) {
+    print_line(level + 1, "Error reading the XML property list");
+    free(xml);
+    goto errorexit;
+  }
+  xml[xml_len] = 0;
+
+  /* each dict in the blkx array holds one table as base64 data */
+  p = strstr(xml, "<key>blkx</key>");
+  end = (p != NULL) ? strstr(p, "</array>") : NULL;
+  if (end == NULL) {
+    print_line(level + 1, "Error: No blkx tables in the property list");
+    free(xml);
+    goto errorexit;
+  }
+  base = section->pos + get_be_quad(koly + 24);
+  alloc = 0;
+  bad = 0;
+  while ((p = strstr(p, "<data>")) != NULL && p < end) {
+    p += 6;
+    data_end = strstr(p, "</data>");
+    if (data_end == NULL || data_end > end)
+      break;
+    blkx = (unsigned char *)malloc((data_end - p) / 4 * 3 + 3);
+    if (blkx == NULL)
+      bailout("Out of memory");
+    len = decode_base64(p, data_end, blkx);
+    if (!add_blkx(us, blkx, len, base, &alloc))
+      bad++;
+    free(blkx);
+    p = data_end;
+  }
+  free(xml);
+  if (bad)
+    print_line(level + 1, "Error: %d invalid blkx tables skipped", bad);
+  if (us->run_count == 0) {
+    print_line(level + 1, "Error: No runs found in the blkx tables");
+    goto errorexit;
+  }
+  qsort(us->runs, us->run_count, sizeof(UDIF_RUN), compare_runs);
+
+  /* the disk size from the runs if the trailer lacks it */
+  if (us->c.size == 0)
+    us->c.size = us->runs[us->run_count - 1].start +
+      us->runs[us->run_count - 1].size;
+
+  /* list the compression methods in use */
+  methods = 0;
+  bad = 0;
+  s[0] = 0;
+  for (i = 0; i < us->run_count; i++) {
+    if ((us->runs[i].type & 0x80000000) == 0)
+      continue;
+    if (methods & (1 << (us->runs[i].type & 15)))
+      continue;
+    methods |= 1 << (us->runs[i].type & 15);
+    if (s[0] != 0)
+      strcat(s, ", ");
+    strcat(s, udif_method_name(us->runs[i].type));
+    if (!udif_method_supported(us->runs[i].type)) {
+      strcat(s, " (unsupported)");
+      bad = 1;
+    }
+  }
+  print_line(level + 1, "%lu runs%s%s", us->run_count,
+             s[0] != 0 ? ", compressed with " : "", s);
+  if (bad)
+    print_line(level + 1, "Error: Some runs can't be decompressed");
+
+  return (SOURCE *)us;
+
+errorexit:
+  close_udif((SOURCE *)us);
+  free(us);
+  return NULL;
+}
+
+/*
+ * append the runs of one blkx table ("mish" block)
+ */
+
+static int add_blkx(UDIF_SOURCE *us, unsigned char *blkx, u4 len,
+                    u8 base, u4 *alloc)
+{
+  unsigned char *chunk;
+  UDIF_RUN *run;
+  u8 first, data_off;
+  u4 count, i, type;
+
+  if (len < 204 || memcmp(blkx, "mish", 4) != 0)
+    return 0;
+  first = get_be_quad(blkx + 8);
+  data_off = get_be_quad(blkx + 24);
+  count = get_be_long(blkx + 200);
+  if (count > (len - 204) / 40)
+    return 0;
+
+  for (i = 0; i < count; i++) {
+    chunk = blkx + 204 + i * 40;
+    type = get_be_long(chunk);
+    if (type == UDIF_END)
+      break;
+    if (type == UDIF_COMMENT || get_be_quad(chunk + 16) == 0)
+      continue;
+
+    if (us->run_count >= *alloc) {
+      *alloc = *alloc ? *alloc * 2 : 256;
+      us->runs = (UDIF_RUN *)realloc(us->runs, *alloc * sizeof(UDIF_RUN));
+      if (us->runs == NULL)
+        bailout("Out of memory");
+    }
+    run = &us->runs[us->run_count++];
+    run->type = type;
+    run->start = (first + get_be_quad(chunk + 8)) * 512;
+    run->size = get_be_quad(chunk + 16) * 512;
+    run->off = base + data_off + get_be_quad(chunk + 24);
+    run->len = get_be_quad(chunk + 32);
+  }
+  return 1;
+}
+
+/*
+ * decode base64 text, skipping white space; returns the byte count
+ */
+
+static u4 decode_base64(const char *from, const char *end,
+                        unsigned char *to)
+{
+  u4 bits, nbits, len;
+  int c;
+
+  bits = 0;
+  nbits = 0;
+  len = 0;
+  for (; from < end; from++) {
+    c = *from;
+    if (c >= 'A' && c <= 'Z')
+      c = c - 'A';
+    else if (c >= 'a' && c <= 'z')
+      c = c - 'a' + 26;
+    else if (c >= '0' && c <= '9')
+      c = c - '0' + 52;
+    else if (c == '+')
+      c = 62;
+    else if (c == '/')
+      c = 63;
+    else if (c == '=')
+      break;
+    else
+      continue;
+    bits = (bits << 6) | c;
+    nbits += 6;
+    if (nbits >= 8) {
+      nbits -= 8;
+      to[len++] = (unsigned char)(bits >> nbits);
+    }
+  }
+  return len;
+}
+
+static int compare_runs(const void *a, const void *b)
+{
+  const UDIF_RUN *ra = (const UDIF_RUN *)a;
+  const UDIF_RUN *rb = (const UDIF_RUN *)b;
+
+  if (ra->start < rb->start)
+    return -1;
+  if (ra->start > rb->start)
+    return 1;
+  return 0;
+}
+
+static const char *udif_method_name(u4 type)
+{
+  switch (type) {
+  case UDIF_ADC:
+    return "ADC";
+  case UDIF_ZLIB:
+    return "zlib";
+  case UDIF_BZIP2:
+    return "bzip2";
+  case UDIF_LZFSE:
+    return "LZFSE";
+  case UDIF_LZMA:
+    return "LZMA";
+  }
+  return "unknown method";
+}
+
+/*
+ * whether decompress_run() can handle a run type; there is no LZFSE
+ * decoder
+ */
+
+static int udif_method_supported(u4 type)
+{
+  switch (type) {
+  case UDIF_ADC:
+#ifdef USE_ZLIB
+  case UDIF_ZLIB:
+#endif
+#ifdef USE_BZIP2
+  case UDIF_BZIP2:
+#endif
+#ifdef USE_LZMA
+  case UDIF_LZMA:
+#endif
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * mapping read: runs are looked up by binary search; zero-fill,
+ * ignored runs and gaps between runs need no I/O
+ */
+
+static u8 read_udif(SOURCE *s, u8 pos, u8 len, void *buf)
+{
+  UDIF_SOURCE *us = (UDIF_SOURCE *)s;
+  UDIF_RUN *run;
+  unsigned char *p, *data;
+  u8 got, cur, n, result;
+  u4 lo, hi, mid;
+  int found;
+
+  p = (unsigned char *)buf;
+  got = 0;
+  while (got < len) {
+    cur = pos + got;
+
+    /* find the last run starting at or before cur */
+    lo = 0;
+    hi = us->run_count;
+    while (lo < hi) {
+      mid = lo + (hi - lo) / 2;
+      if (us->runs[mid].start <= cur)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    found = (lo > 0 &&
+             cur < us->runs[lo - 1].start + us->runs[lo - 1].size);
+
+    if (!found) {
+      /* gap up to the next run */
+      n = len - got;
+      if (lo < us->run_count && us->runs[lo].start - cur < n)
+        n = us->runs[lo].start - cur;
+      memset(p + got, 0, n);
+      got += n;
+      continue;
+    }
+
+    run = &us->runs[lo - 1];
+    n = run->start + run->size - cur;
+    if (n > len - got)
+      n = len - got;
+
+    if (run->type == UDIF_ZERO || run->type == UDIF_IGNORE) {
+      memset(p + got, 0, n);
+    } else if (run->type == UDIF_RAW) {
+      result = get_buffer_real(s->foundation, run->off + (cur - run->start),
+                               n, p + got, NULL);
+      got += result;
+      if (result < n)
+        break;
+      continue;
+    } else {
+      data = get_run_data(us, lo - 1);
+      if (data == NULL)
+        break;
+      memcpy(p + got, data + (cur - run->start), n);
+    }
+    got += n;
+  }
+
+  return got;
+}
+
+/*
+ * get the decompressed data of a run, from the LRU cache or freshly
+ * decoded
+ */
+
+static unsigned char *get_run_data(UDIF_SOURCE *us, u4 index)
+{
+  UDIF_RUN *run = &us->runs[index];
+  RUN_SLOT *slot;
+  int i;
+
+  slot = &us->slots[0];
+  for (i = 0; i < RUN_CACHE_SIZE; i++) {
+    if (us->slots[i].used != 0 && us->slots[i].run == index) {
+      us->slots[i].used = ++us->clock;
+      return us->slots[i].data;
+    }
+    if (us->slots[i].used < slot->used)
+      slot = &us->slots[i];
+  }
+
+  if (run->size > UDIF_MAX_LOAD || run->len == 0 ||
+      run->len > UDIF_MAX_LOAD)
+    return NULL;
+
+  /* reuse the least recently used slot */
+  slot->used = 0;
+  if (slot->alloc < run->size) {
+    if (slot->data != NULL)
+      free(slot->data);
+    slot->data = (unsigned char *)malloc(run->size);
+    if (slot->data == NULL)
+      bailout("Out of memory");
+    slot->alloc = run->size;
+  }
+  if (us->inbuf_alloc < run->len) {
+    if (us->inbuf != NULL)
+      free(us->inbuf);
+    us->inbuf = (unsigned char *)malloc(run->len);
+    if (us->inbuf == NULL)
+      bailout("Out of memory");
+    us->inbuf_alloc = run->len;
+  }
+  if (get_buffer_real(us->c.foundation, run->off, run->len,
+                      us->inbuf, NULL) < run->len)
+    return NULL;
+  if (!decompress_run(us, run, slot->data))
+    return NULL;
+
+  slot->run = index;
+  slot->used = ++us->clock;
+  return slot->data;
+}
+
+/*
+ * decompress a run from the input buffer; returns 0 on failure
+ */
+
+static int decompress_run(UDIF_SOURCE *us, UDIF_RUN *run,
+                          unsigned char *out)
+{
+#ifdef USE_ZLIB
+  z_stream zs;
+#endif
+#ifdef USE_BZIP2
+  unsigned int out_len;
+#endif
+#ifdef USE_LZMA
+  lzma_stream ls = LZMA_STREAM_INIT;
+#endif
+#if defined(USE_ZLIB) || defined(USE_BZIP2) || defined(USE_LZMA)
+  int ret;
+#endif
+
+  switch (run->type) {
+  case UDIF_ADC:
+    return decompress_adc(us->inbuf, run->len, out, run->size);
+#ifdef USE_ZLIB
+  case UDIF_ZLIB:
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit(&zs) != Z_OK)
+      return 0;
+    zs.next_in = us->inbuf;
+    zs.avail_in = (uInt)run->len;
+    zs.next_out = out;
+    zs.avail_out = (uInt)run->size;
+    ret = inflate(&zs, Z_FINISH);
+    inflateEnd(&zs);
+    return (ret == Z_STREAM_END || ret == Z_BUF_ERROR) && zs.avail_out == 0;
+#endif
+#ifdef USE_BZIP2
+  case UDIF_BZIP2:
+    out_len = (unsigned int)run->size;
+    ret = BZ2_bzBuffToBuffDecompress((char *)out, &out_len,
+                                     (char *)us->inbuf,
+                                     (unsigned int)run->len, 0, 0);
+    return (ret == BZ_OK || ret == BZ_OUTBUFF_FULL) && out_len == run->size;
+#endif
+#ifdef USE_LZMA
+  case UDIF_LZMA:
+    if (lzma_auto_decoder(&ls, UINT64_MAX, 0) != LZMA_OK)
+      return 0;
+    ls.next_in = us->inbuf;
+    ls.avail_in = run->len;
+    ls.next_out = out;
+    ls.avail_out = run->size;
+    ret = lzma_code(&ls, LZMA_FINISH);
+    lzma_end(&ls);
+    return (ret == LZMA_STREAM_END || ret == LZMA_OK) && ls.avail_out == 0;
+#endif
+  }
+
+  /* LZFSE and methods we weren't built with */
+  return 0;
+}
+
+/*
+ * Apple Data Compression, a simple LZ77 variant; the output must come
+ * out complete
+ */
+
+static int decompress_adc(unsigned char *in, u8 in_len,
+                          unsigned char *out, u8 out_len)
+{
+  u8 ip, op, n, dist;
+  unsigned char c;
+
+  ip = 0;
+  op = 0;
+  while (ip < in_len && op < out_len) {
+    c = in[ip];
+    if (c & 0x80) {
+      /* literal bytes */
+      n = (c & 0x7f) + 1;
+      if (ip + 1 + n > in_len || op + n > out_len)
+        return 0;
+      memcpy(out + op, in + ip + 1, n);
+      ip += 1 + n;
+      op += n;
+      continue;
+    }
+    if (c & 0x40) {
+      /* three byte code, 16-bit distance */
+      if (ip + 3 > in_len)
+        return 0;
+      n = (c & 0x3f) + 4;
+      dist = ((u8)in[ip + 1] << 8) | in[ip + 2];
+      ip += 3;
+    } else {
+      /* two byte code, 10-bit distance */
+      if (ip + 2 > in_len)
+        return 0;
+      n = ((c >> 2) & 0x0f) + 3;
+      dist = ((u8)(c & 3) << 8) | in[ip + 1];
+      ip += 2;
+    }
+    if (dist + 1 > op || op + n > out_len)
+      return 0;
+    /* byte by byte, the copy may overlap itself */
+    for (; n > 0; n--, op++)
+      out[op] = out[op - dist - 1];
+  }
+  return op == out_len;
+}
+
+/*
+ * cleanup
+ */
+
+static void close_udif(SOURCE *s)
+{
+  UDIF_SOURCE *us = (UDIF_SOURCE *)s;
+  int i;
 
-  if (memcmp(buf, "koly", 4) == 0) {
-    print_line(level, "Apple UDIF disk image, content detection may or may not work...");
+  for (i = 0; i < RUN_CACHE_SIZE; i++) {
+    if (us->slots[i].data != NULL)
+      free(us->slots[i].data);
   }
+  if (us->inbuf != NULL)
+    free(us->inbuf);
+  if (us->runs != NULL)
+    free(us->runs);
 }
 
 /* EOF */
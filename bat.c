@@ -0,0 +1,176 @@
+/*
+ * bat.c
+ * Block allocation table engine shared by the VHD, VHDX and VDI
+ * image sources.
+ *
+ * Copyright (c) 2026 The disktype contributors
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE. 
+ */
+
+#include "global.h"
+
+/*
+ * helper functions
+ */
+
+static u8 read_bat(SOURCE *s, u8 pos, u8 len, void *buf);
+static u8 map_bat_piece(BAT_SOURCE *bs, u8 pos, u8 len,
+                        SOURCE **from, u8 *from_pos);
+static void close_bat(SOURCE *s);
+
+/*
+ * set up a mapping source; the format parser fills in the block
+ * table (or a map function) afterwards
+ */
+
+BAT_SOURCE *init_bat_source(SOURCE *foundation, const char *name,
+                            size_t struct_size, u8 size,
+                            u4 block_size, u4 block_count)
+{
+  BAT_SOURCE *bs;
+
+  /* allocate and init source structure */
+  bs = (BAT_SOURCE *)malloc(struct_size);
+  if (bs == NULL)
+    bailout("Out of memory");
+  memset(bs, 0, struct_size);
+
+  bs->c.size_known = 1;
+  bs->c.size = size;
+  bs->c.name = name;
+  bs->c.foundation = foundation;
+  bs->c.read_bytes = read_bat;
+  bs->c.close = close_bat;
+
+  bs->block_size = block_size;
+  bs->block_count = block_count;
+
+  /* all blocks start out absent */
+  bs->blocks = (u8 *)malloc((block_count ? block_count : 1) * sizeof(u8));
+  if (bs->blocks == NULL)
+    bailout("Out of memory");
+  memset(bs->blocks, 0, block_count * sizeof(u8));
+
+  return bs;
+}
+
+/*
+ * mapping read: pieces that continue each other (adjacent data in the
+ * same source, or zeros) are merged into one run, which is then read
+ * or zero-filled in one go
+ */
+
+static u8 read_bat(SOURCE *s, u8 pos, u8 len, void *buf)
+{
+  BAT_SOURCE *bs = (BAT_SOURCE *)s;
+  unsigned char *p;
+  SOURCE *from, *next_from;
+  u8 got, n, m, from_pos, next_pos, result;
+  int pending;
+
+  p = (unsigned char *)buf;
+  got = 0;
+  pending = 0;
+  while (got < len) {
+    if (pending) {
+      /* the piece that ended the previous run */
+      from = next_from;
+      from_pos = next_pos;
+      n = m;
+      pending = 0;
+    } else {
+      n = map_bat_piece(bs, pos + got, len - got, &from, &from_pos);
+      if (n == 0)
+        break;
+    }
+    while (got + n < len) {
+      m = map_bat_piece(bs, pos + got + n, len - got - n,
+                        &next_from, &next_pos);
+      if (m == 0)
+        break;
+      if (next_from != from || (from != NULL && next_pos != from_pos + n)) {
+        pending = 1;
+        break;
+      }
+      n += m;
+    }
+
+    if (from != NULL) {
+      result = get_buffer_real(from, from_pos, n, p + got, NULL);
+      got += result;
+      if (result < n)
+        break;
+    } else {
+      memset(p + got, 0, n);
+      got += n;
+    }
+  }
+
+  return got;
+}
+
+/*
+ * find where the data at pos comes from and how far that goes, at
+ * most to the end of its block; returns 0 past the last block
+ */
+
+static u8 map_bat_piece(BAT_SOURCE *bs, u8 pos, u8 len,
+                        SOURCE **from, u8 *from_pos)
+{
+  u4 block, rel;
+  u8 n;
+
+  block = (u4)(pos / bs->block_size);
+  if (block >= bs->block_count)
+    return 0;
+  rel = (u4)(pos - (u8)block * bs->block_size);
+  n = bs->block_size - rel;
+  if (n > len)
+    n = len;
+
+  if (bs->map != NULL)
+    return bs->map(bs, block, rel, n, from, from_pos);
+
+  if (bs->blocks[block] == BAT_ABSENT || bs->blocks[block] == BAT_ZERO) {
+    *from = NULL;
+  } else {
+    *from = bs->c.foundation;
+    *from_pos = bs->blocks[block] + rel;
+  }
+  return n;
+}
+
+/*
+ * cleanup
+ */
+
+static void close_bat(SOURCE *s)
+{
+  BAT_SOURCE *bs = (BAT_SOURCE *)s;
+
+  if (bs->cleanup != NULL)
+    bs->cleanup(bs);
+  if (bs->blocks != NULL)
+    free(bs->blocks);
+}
+
+/* EOF */
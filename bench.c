@@ -0,0 +1,132 @@
+/*
+ * bench.c
+ * Microbenchmark for the chunk cache's get_buffer_real() paths.
+ *
+ * Copyright (c) 2026 The disktype contributors
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "global.h"
+
+/*
+ * A synthetic source of N chunks is read once in scattered order, so
+ * every request misses and allocates a chunk, and then again in the
+ * same order, so every request is a hit on a cache holding N chunks.
+ * Each chunk is 4 KiB, the largest run takes about 4 GiB of memory.
+ * Build with "make bench", run as "./bench [chunks...]".
+ */
+
+#define CHUNKSIZE (4096)
+
+/* visiting order: a stride that is prime, so every chunk comes up */
+#define STRIDE (7919)
+
+/*
+ * helper functions
+ */
+
+static u8 read_synthetic(SOURCE *s, u8 pos, u8 len, void *buf);
+static void run(u8 chunks);
+static double now(void);
+
+/*
+ * main entry point
+ */
+
+int main(int argc, char *argv[])
+{
+  int i;
+
+  printf("%10s %12s %12s\n", "chunks", "miss ns", "hit ns");
+  if (argc < 2) {
+    run(1000);
+    run(100000);
+    run(1000000);
+  } else {
+    for (i = 1; i < argc; i++)
+      run(strtoull(argv[i], NULL, 10));
+  }
+  return 0;
+}
+
+/*
+ * one round: a pass of misses, then a pass of hits
+ */
+
+static void run(u8 chunks)
+{
+  SOURCE *s;
+  unsigned char *buf;
+  double start, miss, hit;
+  u8 i, chunk;
+
+  if (chunks == 0 || chunks % STRIDE == 0)
+    return;
+
+  s = (SOURCE *)malloc(sizeof(SOURCE));
+  if (s == NULL)
+    bailout("Out of memory");
+  memset(s, 0, sizeof(SOURCE));
+  s->name = "bench";
+  s->size_known = 1;
+  s->size = chunks * CHUNKSIZE;
+  s->read_bytes = read_synthetic;
+
+  start = now();
+  for (i = 0; i < chunks; i++) {
+    chunk = (i * STRIDE) % chunks;
+    get_buffer_real(s, chunk * CHUNKSIZE + 100, 512, NULL, (void **)&buf);
+  }
+  miss = now() - start;
+
+  start = now();
+  for (i = 0; i < chunks; i++) {
+    chunk = (i * STRIDE) % chunks;
+    get_buffer_real(s, chunk * CHUNKSIZE + 100, 512, NULL, (void **)&buf);
+  }
+  hit = now() - start;
+
+  printf("%10llu %12.0f %12.0f\n", chunks,
+         miss * 1e9 / chunks, hit * 1e9 / chunks);
+
+  close_source(s);
+}
+
+/*
+ * the data: cheap to make, so the cache dominates the timing
+ */
+
+static u8 read_synthetic(SOURCE *s, u8 pos, u8 len, void *buf)
+{
+  memset(buf, (int)(pos >> 12), len);
+  return len;
+}
+
+static double now(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+/* EOF */
@@ -27,8 +27,6 @@
 
 #include "global.h"
 
-#define PROFILE 0
-
 /*
  * constants
  */
@@ -42,9 +40,34 @@
    chunk size */
 #define MINBLOCKSIZE (256)
 
-/* a simple hash function */
-#define HASHSIZE (13)
-#define HASHFUNC(start) (((start)>>CHUNKBITS) % HASHSIZE)
+/* the chunk index is an open-addressing hash table keyed by chunk
+   number; it starts out with 2^INDEXBITS slots and doubles in size
+   whenever it becomes three quarters full */
+#define INDEXBITS (6)
+#define INDEXFULL(count, bits) ((u8)(count) * 4 >= ((u8)3 << (bits)))
+
+/* a multiplicative hash function (Fibonacci hashing) */
+#define HASHFUNC(start, bits) \
+  ((u4)((((start) >> CHUNKBITS) * 0x9E3779B97F4A7C15ULL) >> (64 - (bits))))
+
+/* the first part of a sequential source is never evicted from the
+   cache because it can't be read again; it holds the metadata that
+   most detectors look at */
+#define PINSIZE (2*1024*1024)
+
+/* chunks are carved out of per-cache slabs; the first slab holds
+   SLABMIN chunks, each further one twice as many up to SLABMAX */
+#define SLABMIN (16)
+#define SLABMAX (256)
+
+/* the longest run of missing chunks filled with one read */
+#define MAXRUN (64)
+
+/* the most reads queued per cache for sources with read_batch() */
+#define MAXPENDING (32)
+
+/* nesting limit for detection scopes */
+#define MAXSCOPES (64)
 
 /* convenience */
 #define MINIMUM(a,b) (((a) < (b)) ? (a) : (b))
@@ -62,23 +85,164 @@ typedef struct chunk {
   */
   u8 start, end, len;
   void *buf;
-  /* links within a hash bucket, organized as a ring list */
-  struct chunk *next, *prev;
+  /* eviction state
+     scope is the outermost detection scope that was handed a pointer
+     into buf, the chunk must stay while that scope is active
+     referenced is the CLOCK reference bit
+     busy is set while data is being read into the chunk
+  */
+  u4 scope;
+  int referenced, busy;
+  /* the slab the chunk lives in, and the link in its free list */
+  struct slab *slab;
+  struct chunk *next_free;
 } CHUNK;
 
+typedef struct slab {
+  /* links in the partial or full list of the cache */
+  struct slab *next, *prev;
+  /* chunk headers, and their buffers in one CHUNKSIZE-aligned block */
+  CHUNK *chunks;
+  void *mem;
+  u4 count;
+  /* used counts headers ever handed out, live those handed out now */
+  u4 used, live;
+  CHUNK *free;
+} SLAB;
+
+typedef struct batch {
+  /* queued reads, and the chunks each of them fills */
+  IOREQ reqs[MAXPENDING];
+  CHUNK *chunks[MAXPENDING][MAXRUN];
+  int counts[MAXPENDING];
+  int count;
+} BATCH;
+
+typedef struct stats {
+  /* get_buffer_real() calls and bytes asked for; a request is a hit
+     when it didn't cause any reads */
+  u8 requests, requested, hits, misses;
+  /* calls to the source's read methods, and bytes they returned */
+  u8 reads, read;
+  /* multi-chunk requests copied to a temporary buffer or served in
+     place, and their bytes */
+  u8 tempbufs, tempbuf_bytes, inplace, inplace_bytes;
+  /* the most chunks resident at one time */
+  u8 peak_chunks;
+} STATS;
+
 typedef struct cache {
-  /* chunks stored as a hash table of ring lists */
-  CHUNK *hashtab[HASHSIZE];
+  SOURCE *source;
+  STATS stats;
+  /* chunks stored in an open-addressing hash table, linear probing */
+  CHUNK **index;
+  int index_bits;
+  u4 chunk_count;
+  /* CLOCK hand for eviction, an index slot number */
+  u4 clock_hand;
+  /* slabs with free chunks, and those without */
+  SLAB *partial_slabs, *full_slabs;
+  u4 next_slab_size;
   /* temporary buffer for requests involving several chunks */
   void *tempbuf;
+  /* reads not submitted yet */
+  BATCH *batch;
+  /* links in the list of all caches */
+  struct cache *next, *prev;
 } CACHE;
 
+/*
+ * global state
+ */
+
+/* cache budget in chunks (zero means unlimited) and current usage */
+static u8 cache_limit = 0;
+static u8 resident_chunks = 0;
+
+/* statistics collection, totals over closed sources */
+static int stats_enabled = 0;
+static u8 stats_sources = 0;
+static STATS total_stats;
+
+/* all live caches, eviction may take chunks from any of them */
+static CACHE *all_caches = NULL;
+
+/* stack of active detection scopes, the bottom one never ends */
+static u4 scope_stack[MAXSCOPES] = { 1 };
+static int scope_depth = 1;
+static u4 scope_serial = 1;
+
+/* times a decompression budget refused to decode, see beyond_budget() */
+static u8 budget_refusals = 0;
+
 /*
  * helper functions
  */
 
+static CACHE * get_cache(SOURCE *s);
+static u8 get_from_cache(SOURCE *s, CACHE *cache, u8 pos, u8 len,
+                         void *inbuf, void **outbuf);
+static int get_in_place(SOURCE *s, CACHE *cache, u8 pos, u8 len,
+                        u8 *got, void **outbuf);
+static void fill_chunks(SOURCE *s, CACHE *cache,
+                        u8 first_chunk, u8 last_chunk);
+static void read_run(SOURCE *s, CACHE *cache, CHUNK **run, int count);
+static void queue_read(SOURCE *s, CACHE *cache, CHUNK **run, int count);
+static void flush_reads(SOURCE *s, CACHE *cache);
+static void finish_run(SOURCE *s, CHUNK **run, int count,
+                       u8 start, u8 toread, u8 result, int refused);
+static void note_cutoff(SOURCE *s, u8 pos);
 static CHUNK * ensure_chunk(SOURCE *s, CACHE *cache, u8 start);
 static CHUNK * get_chunk_alloc(CACHE *cache, u8 start);
+static void alloc_run(CACHE *cache, u8 start, u4 count);
+static void insert_chunk(CACHE *cache, CHUNK *c, u8 start);
+static u4 find_slot(CACHE *cache, u8 start);
+static void grow_index(CACHE *cache);
+static void remove_slot(CACHE *cache, u4 hpos);
+
+static CHUNK * alloc_chunk(CACHE *cache);
+static CHUNK * alloc_chunk_run(CACHE *cache, u4 count);
+static SLAB * new_slab(CACHE *cache, u4 count);
+static void free_chunk(CACHE *cache, CHUNK *c);
+static void free_slab(SLAB *slab);
+static void link_slab(SLAB **list, SLAB *slab);
+static void unlink_slab(SLAB **list, SLAB *slab);
+
+static void protect_chunk(CHUNK *c);
+static int scope_active(u4 scope);
+static void make_room(CACHE *cache, u4 count);
+static int evict_chunk(CACHE *cache);
+
+static void print_stats(const char *what, STATS *st);
+static void add_stats(STATS *to, STATS *from);
+
+/*
+ * configure the cache budget, in bytes (zero means unlimited)
+ */
+
+void set_cache_limit(u8 bytes)
+{
+  cache_limit = (bytes + CHUNKMASK) >> CHUNKBITS;
+}
+
+/*
+ * detection scopes: chunks handed out by pointer stay in the cache
+ * while the detector that asked for them is running
+ */
+
+void cache_enter_scope(void)
+{
+  scope_serial++;
+  if (scope_depth < MAXSCOPES)
+    scope_stack[scope_depth] = scope_serial;
+  scope_depth++;
+}
+
+void cache_leave_scope(void)
+{
+  if (scope_depth > 1)
+    scope_depth--;
+}
 
 /*
  * retrieve a piece of the source, entry point for detection
@@ -102,8 +266,7 @@ u8 get_buffer(SECTION *section, u8 pos, u8 len, void **buf)
 u8 get_buffer_real(SOURCE *s, u8 pos, u8 len, void *inbuf, void **outbuf)
 {
   CACHE *cache;
-  CHUNK *c;
-  u8 end, first_chunk, last_chunk, curr_chunk, got, tocopy;
+  u8 end, reads, got, found_pos, refusals;
   void *mybuf;
 
   /* sanity check */
@@ -122,16 +285,52 @@ u8 get_buffer_real(SOURCE *s, u8 pos, u8 len, void *inbuf, void **outbuf)
     len = end - pos;
   }
 
-  /* get cache head */
-  cache = (CACHE *)s->cache_head;
-  if (cache == NULL) {
-    /* allocate and initialize new cache head */
-    cache = (CACHE *)malloc(sizeof(CACHE));
-    if (cache == NULL)
-      bailout("Out of memory");
-    memset(cache, 0, sizeof(CACHE));
-    s->cache_head = (void *)cache;
+  cache = get_cache(s);
+  cache->stats.requests++;
+  cache->stats.requested += len;
+
+  /* mapped sources are served straight from memory */
+  if (s->map != NULL) {
+    mybuf = (char *)s->map + pos;
+    if (inbuf)
+      memcpy(inbuf, mybuf, len);
+    if (outbuf)
+      *outbuf = mybuf;
+    cache->stats.hits++;
+    return len;
+  }
+
+  /* data that sits in the foundation in one piece is served from
+     there, without a copy in this cache */
+  if (s->locate != NULL && s->locate(s, pos, len, &found_pos) >= len) {
+    cache->stats.inplace++;
+    cache->stats.inplace_bytes += len;
+    refusals = budget_refusals;
+    got = get_buffer_real(s->foundation, found_pos, len, inbuf, outbuf);
+    if (got < len && budget_refusals != refusals)
+      note_cutoff(s, pos + got);
+    return got;
   }
+
+  reads = cache->stats.reads;
+  got = get_from_cache(s, cache, pos, len, inbuf, outbuf);
+  if (cache->stats.reads == reads)
+    cache->stats.hits++;
+  else
+    cache->stats.misses++;
+  return got;
+}
+
+static u8 get_from_cache(SOURCE *s, CACHE *cache, u8 pos, u8 len,
+                         void *inbuf, void **outbuf)
+{
+  CHUNK *c;
+  u8 end, first_chunk, last_chunk, curr_chunk, got, tocopy;
+  void *mybuf;
+
+  /* complete any prefetching */
+  end = pos + len;
+  flush_reads(s, cache);
   /* free old temp buffer if present */
   if (cache->tempbuf != NULL) {
     free(cache->tempbuf);
@@ -155,22 +354,26 @@ u8 get_buffer_real(SOURCE *s, u8 pos, u8 len, void *inbuf, void **outbuf)
     mybuf = c->buf + (pos - c->start);
     if (inbuf)
       memcpy(inbuf, mybuf, len);
-    if (outbuf)
+    if (outbuf) {
       *outbuf = mybuf;
+      protect_chunk(c);
+    }
 
     return len;
 
   } else {
 
+    /* hand out the chunks directly if they lie side by side in memory */
+    if (inbuf == NULL && get_in_place(s, cache, pos, len, &got, outbuf)) {
+      cache->stats.inplace++;
+      cache->stats.inplace_bytes += got;
+      return got;
+    }
+
     /* prepare a buffer for concatenation */
     if (inbuf) {
       mybuf = inbuf;
     } else {
-
-#if PROFILE
-      printf("Temporary buffer for request %llu:%llu\n", pos, len);
-#endif
-
       /* allocate one temporarily, will be free()'d at the next call */
       cache->tempbuf = malloc(len);
       if (cache->tempbuf == NULL) {
@@ -178,9 +381,12 @@ u8 get_buffer_real(SOURCE *s, u8 pos, u8 len, void *inbuf, void **outbuf)
         return 0;
       }
       mybuf = cache->tempbuf;
+      cache->stats.tempbufs++;
     }
 
     /* draw data from all covered chunks */
+    fill_chunks(s, cache, first_chunk, last_chunk);
+    flush_reads(s, cache);
     got = 0;
     for (curr_chunk = first_chunk; curr_chunk <= last_chunk;
          curr_chunk += CHUNKSIZE) {
@@ -219,6 +425,8 @@ u8 get_buffer_real(SOURCE *s, u8 pos, u8 len, void *inbuf, void **outbuf)
 
     /* calculate return data */
     len = MINIMUM(len, got);  /* may be zero */
+    if (inbuf == NULL)
+      cache->stats.tempbuf_bytes += len;
     if (outbuf)
       *outbuf = mybuf;
     return len;
@@ -226,42 +434,391 @@ u8 get_buffer_real(SOURCE *s, u8 pos, u8 len, void *inbuf, void **outbuf)
   }
 }
 
+/*
+ * tell whether a read from a section came back short because a
+ * decompression budget stopped the data before pos + len, rather than
+ * because the data ends there
+ */
+
+int beyond_budget(SECTION *section, u8 pos, u8 len)
+{
+  SOURCE *s;
+
+  s = section->source;
+  pos += section->pos;
+  if (!s->truncated || (s->size_known && pos + len > s->size))
+    return 0;
+  return pos + len > s->cutoff;
+}
+
+/*
+ * called by the decompressing layers each time the budget keeps them
+ * from decoding; a read during which this happened came back short
+ * because of it, in that layer and every layer stacked on it
+ */
+
+void note_budget_refusal(void)
+{
+  budget_refusals++;
+}
+
+static void note_cutoff(SOURCE *s, u8 pos)
+{
+  if (!s->truncated || s->cutoff > pos) {
+    s->truncated = 1;
+    s->cutoff = pos;
+  }
+}
+
+/*
+ * read a piece of the source into the cache ahead of time, in as few
+ * reads as possible; only done for seekable byte-oriented sources
+ * (sources with read_batch() get the reads queued, they are issued
+ * together at the next get_buffer_real() call)
+ */
+
+void prefetch_buffer(SOURCE *s, u8 pos, u8 len)
+{
+  CACHE *cache;
+  u8 end, first_chunk, last_chunk, run_end;
+
+  if (len == 0)
+    return;
+  if (s->prefetch != NULL) {
+    /* the source knows better, e.g. it's mapped */
+    (*s->prefetch)(s, pos, len);
+    return;
+  }
+  if (s->sequential || s->read_block != NULL)
+    return;
+  end = pos + len;
+  if (s->size_known) {
+    if (pos >= s->size)
+      return;
+    end = MINIMUM(end, s->size);
+  }
+
+  cache = get_cache(s);
+  first_chunk = pos & ~CHUNKMASK;
+  last_chunk = (end - 1) & ~CHUNKMASK;
+  for (; first_chunk <= last_chunk; first_chunk = run_end + CHUNKSIZE) {
+    run_end = MINIMUM(last_chunk,
+                      first_chunk + ((u8)(MAXRUN - 1) << CHUNKBITS));
+    alloc_run(cache, first_chunk,
+              (u4)((run_end - first_chunk) >> CHUNKBITS) + 1);
+    fill_chunks(s, cache, first_chunk, run_end);
+  }
+}
+
+/*
+ * get the cache head of a source, creating it on first use
+ */
+
+static CACHE * get_cache(SOURCE *s)
+{
+  CACHE *cache;
+
+  cache = (CACHE *)s->cache_head;
+  if (cache == NULL) {
+    /* allocate and initialize new cache head */
+    cache = (CACHE *)malloc(sizeof(CACHE));
+    if (cache == NULL)
+      bailout("Out of memory");
+    memset(cache, 0, sizeof(CACHE));
+    cache->source = s;
+    /* link into the list of caches */
+    cache->next = all_caches;
+    if (all_caches != NULL)
+      all_caches->prev = cache;
+    all_caches = cache;
+    s->cache_head = (void *)cache;
+  }
+  return cache;
+}
+
+/*
+ * serve a multi-chunk request without copying; works when the chunks
+ * were allocated as one run, which is arranged for runs that are not
+ * in the cache yet
+ */
+
+static int get_in_place(SOURCE *s, CACHE *cache, u8 pos, u8 len,
+                        u8 *got, void **outbuf)
+{
+  u8 first_chunk, last_chunk, curr_chunk;
+  u4 count;
+  CHUNK *c;
+  void *base;
+
+  first_chunk = pos & ~CHUNKMASK;
+  last_chunk = (pos + len - 1) & ~CHUNKMASK;
+  count = (u4)((last_chunk - first_chunk) >> CHUNKBITS) + 1;
+  if (count > SLABMAX)
+    return 0;
+  alloc_run(cache, first_chunk, count);
+  fill_chunks(s, cache, first_chunk, last_chunk);
+  flush_reads(s, cache);
+
+  base = NULL;
+  *got = 0;
+  for (curr_chunk = first_chunk; curr_chunk <= last_chunk;
+       curr_chunk += CHUNKSIZE) {
+    c = ensure_chunk(s, cache, curr_chunk);
+    if (base == NULL)
+      base = c->buf;
+    else if (c->buf != (char *)base + (curr_chunk - first_chunk))
+      return 0;  /* not contiguous, use a temporary buffer */
+    /* keep it until the caller is done with the pointer */
+    protect_chunk(c);
+
+    /* same accounting as the copying code path */
+    if (pos > curr_chunk)
+      *got += (c->end > pos) ? c->end - pos : 0;
+    else
+      *got += MINIMUM(c->len, len - *got);
+    if (c->len < CHUNKSIZE)
+      break;
+  }
+
+  *got = MINIMUM(len, *got);
+  *outbuf = (char *)base + (pos & CHUNKMASK);
+  return 1;
+}
+
+/*
+ * read runs of adjacent missing chunks with one call each, instead of
+ * leaving them to ensure_chunk() one by one; for sources with
+ * read_batch() the reads are only queued, see flush_reads()
+ */
+
+static void fill_chunks(SOURCE *s, CACHE *cache,
+                        u8 first_chunk, u8 last_chunk)
+{
+  CHUNK *run[MAXRUN], *c;
+  u8 curr_chunk;
+  int count;
+
+  /* block sources read from their foundation, which is cached itself;
+     sequential sources only take runs that start where they are, see
+     read_run() */
+  if (s->read_block != NULL)
+    return;
+
+  count = 0;
+  for (curr_chunk = first_chunk; curr_chunk <= last_chunk;
+       curr_chunk += CHUNKSIZE) {
+    if (s->size_known && curr_chunk >= s->size)
+      break;
+
+    c = get_chunk_alloc(cache, curr_chunk);
+    if (c->len > 0 || c->busy) {
+      /* already there (at least partly), this ends the run */
+      read_run(s, cache, run, count);
+      count = 0;
+      continue;
+    }
+    /* keep it while the run is collected and read */
+    c->busy = 1;
+    c->referenced = 1;
+    run[count++] = c;
+    if (count >= MAXRUN) {
+      read_run(s, cache, run, count);
+      count = 0;
+    }
+  }
+  read_run(s, cache, run, count);
+}
+
+static void read_run(SOURCE *s, CACHE *cache, CHUNK **run, int count)
+{
+  void *bufs[MAXRUN];
+  u8 start, toread, result, refusals;
+  int i, j, contiguous;
+
+  if (s->read_batch != NULL) {
+    /* queue one read per piece with adjacent buffers */
+    for (i = 0; i < count; i = j) {
+      for (j = i + 1; j < count; j++) {
+        if (run[j]->buf !=
+            (char *)run[i]->buf + ((size_t)(j - i) << CHUNKBITS))
+          break;
+      }
+      queue_read(s, cache, run + i, j - i);
+    }
+    return;
+  }
+
+  if (count >= 2) {
+    start = run[0]->start;
+    toread = (u8)count << CHUNKBITS;
+    if (s->size_known && s->size < start + toread)
+      toread = s->size - start;
+
+    contiguous = 1;
+    for (i = 0; i < count; i++) {
+      bufs[i] = run[i]->buf;
+      if (run[i]->buf != (char *)run[0]->buf + ((size_t)i << CHUNKBITS))
+        contiguous = 0;
+    }
+
+    /* one read straight into the chunk buffers; if that can't be
+       done, the chunks are left to ensure_chunk() below */
+    if ((!s->sequential || (contiguous && start == s->seq_pos)) &&
+        (contiguous || s->read_scatter != NULL)) {
+      refusals = budget_refusals;
+      if (contiguous)
+        result = s->read_bytes(s, start, toread, run[0]->buf);
+      else
+        result = s->read_scatter(s, start, toread, bufs, CHUNKSIZE);
+      cache->stats.reads++;
+      cache->stats.read += result;
+      if (s->sequential)
+        s->seq_pos += result;
+      finish_run(s, run, count, start, toread, result,
+                 budget_refusals != refusals);
+      return;
+    }
+  }
+
+  /* not read here, release every chunk of the run */
+  for (i = 0; i < count; i++)
+    run[i]->busy = 0;
+}
+
+static void queue_read(SOURCE *s, CACHE *cache, CHUNK **run, int count)
+{
+  BATCH *batch;
+  IOREQ *req;
+  int i;
+
+  if (cache->batch == NULL) {
+    cache->batch = (BATCH *)malloc(sizeof(BATCH));
+    if (cache->batch == NULL)
+      bailout("Out of memory");
+    cache->batch->count = 0;
+  } else if (cache->batch->count >= MAXPENDING) {
+    flush_reads(s, cache);
+  }
+  batch = cache->batch;
+
+  i = batch->count++;
+  req = &batch->reqs[i];
+  req->pos = run[0]->start;
+  req->len = (u8)count << CHUNKBITS;
+  if (s->size_known && s->size < req->pos + req->len)
+    req->len = s->size - req->pos;
+  req->buf = run[0]->buf;
+  req->got = 0;
+  memcpy(batch->chunks[i], run, count * sizeof(CHUNK *));
+  batch->counts[i] = count;
+}
+
+/*
+ * issue all queued reads at once
+ */
+
+static void flush_reads(SOURCE *s, CACHE *cache)
+{
+  BATCH *batch;
+  u8 refusals;
+  int i;
+
+  batch = cache->batch;
+  if (batch == NULL || batch->count == 0)
+    return;
+
+  refusals = budget_refusals;
+  s->read_batch(s, batch->reqs, batch->count);
+  for (i = 0; i < batch->count; i++) {
+    finish_run(s, batch->chunks[i], batch->counts[i],
+               batch->reqs[i].pos, batch->reqs[i].len, batch->reqs[i].got,
+               budget_refusals != refusals);
+    cache->stats.read += batch->reqs[i].got;
+  }
+  cache->stats.reads += batch->count;
+  batch->count = 0;
+}
+
+/*
+ * distribute the result of a read over the chunks of its run
+ */
+
+static void finish_run(SOURCE *s, CHUNK **run, int count,
+                       u8 start, u8 toread, u8 result, int refused)
+{
+  u8 offset;
+  int i;
+  CHUNK *c;
+
+  for (i = 0; i < count; i++) {
+    c = run[i];
+    offset = (u8)i << CHUNKBITS;
+    c->len = (result > offset) ? MINIMUM(CHUNKSIZE, result - offset) : 0;
+    c->end = c->start + c->len;
+    c->busy = 0;
+  }
+  if (result < toread && refused) {
+    /* the budget stopped it, there is more data after this */
+    note_cutoff(s, start + result);
+  } else if (result < toread) {
+    /* we fell short, so it must have been an error or end-of-file */
+    if (!s->size_known || s->size > start + result) {
+      s->size_known = 1;
+      s->size = start + result;
+    }
+  }
+}
+
 static CHUNK * ensure_chunk(SOURCE *s, CACHE *cache, u8 start)
 {
   CHUNK *c;
   u8 pos, rel_start, rel_end;
-  u8 toread, result, curr_chunk;
+  u8 toread, result, curr_chunk, run_end, refusals;
+
+  if (s->sequential && s->seq_pos < start &&
+      !(s->size_known && start >= s->size)) {
+    /* sequential source: ensure all data before this chunk was read,
+       done before getting our chunk so it can't be evicted meanwhile */
+
+    /* first in large runs, as long as seq_pos is on a chunk boundary */
+    curr_chunk = s->seq_pos;
+    while ((curr_chunk & CHUNKMASK) == 0 && curr_chunk + CHUNKSIZE < start) {
+      run_end = MINIMUM(start - CHUNKSIZE,
+                        curr_chunk + ((u8)(MAXRUN - 1) << CHUNKBITS));
+      alloc_run(cache, curr_chunk,
+                (u4)((run_end - curr_chunk) >> CHUNKBITS) + 1);
+      fill_chunks(s, cache, curr_chunk, run_end);
+      if (s->seq_pos <= run_end)
+        break;  /* end of data, or the run was in the way */
+      curr_chunk = s->seq_pos;
+    }
+
+    /* then the rest chunk by chunk */
+    curr_chunk = s->seq_pos & ~CHUNKMASK;
+    while (curr_chunk < start) {
+      ensure_chunk(s, cache, curr_chunk);
+      curr_chunk += CHUNKSIZE;
+      if (s->seq_pos < curr_chunk)
+        break;  /* it didn't work out... */
+    }
+  }
 
   c = get_chunk_alloc(cache, start);
+  c->referenced = 1;
   if (c->len >= CHUNKSIZE || (s->size_known && c->end >= s->size)) {
-    /* chunk is complete  or  complete until EOF */
+    /* chunk is complete  or  complete until EOF
+       (s->size may have changed while catching up) */
     return c;
   }
 
   if (s->sequential) {
-    /* sequential source: ensure all data before this chunk was read */
-
-    if (s->seq_pos < start) {
-      /* try to read data between seq_pos and start */
-      curr_chunk = s->seq_pos & ~CHUNKMASK;
-      while (curr_chunk < start) {  /* runs at least once, due to the if()
-                                       and the formula of curr_chunk */
-        ensure_chunk(s, cache, curr_chunk);
-        curr_chunk += CHUNKSIZE;
-        if (s->seq_pos < curr_chunk)
-          break;  /* it didn't work out... */
-      }
-
-      /* re-check precondition since s->size may have changed */
-      if (s->size_known && c->end >= s->size)
-        return c;  /* there is no more data to read */
-    }
-
     if (s->seq_pos != c->end)   /* c->end is where we'll continue reading */
       return c;  /* we're not in a sane state, give up */
   }
 
-  /* try to read the missing piece */
+  /* try to read the missing piece; reading may recurse into other
+     layers, which must not evict this chunk */
+  c->busy = 1;
   if (s->read_block != NULL) {
     /* use block-oriented read_block() method */
 
@@ -280,8 +837,11 @@ static CHUNK * ensure_chunk(SOURCE *s, CACHE *cache, u8 start)
         break;     /* whole block is past end of file */
 
       /* read it */
+      cache->stats.reads++;
+      refusals = budget_refusals;
       if (s->read_block(s, pos, c->buf + rel_start)) {
         /* success */
+        cache->stats.read += s->blocksize;
         c->len = rel_end;
         c->end = c->start + c->len;
       } else {
@@ -289,7 +849,9 @@ static CHUNK * ensure_chunk(SOURCE *s, CACHE *cache, u8 start)
         c->len = rel_start;  /* this is safe as it can only mean a shrink */
         c->end = c->start + c->len;
         /* note the new end of file if necessary */
-        if (!s->size_known || s->size > c->end) {
+        if (budget_refusals != refusals) {
+          note_cutoff(s, c->end);
+        } else if (!s->size_known || s->size > c->end) {
           s->size_known = 1;
           s->size = c->end;
         }
@@ -307,8 +869,11 @@ static CHUNK * ensure_chunk(SOURCE *s, CACHE *cache, u8 start)
     } else {
       toread = CHUNKSIZE - c->len;
     }
+    refusals = budget_refusals;
     result = s->read_bytes(s, c->start + c->len, toread,
                            c->buf + c->len);
+    cache->stats.reads++;
+    cache->stats.read += result;
     if (result > 0) {
       /* adjust offsets */
       c->len += result;
@@ -316,7 +881,10 @@ static CHUNK * ensure_chunk(SOURCE *s, CACHE *cache, u8 start)
       if (s->sequential)
         s->seq_pos += result;
     }
-    if (result < toread) {
+    if (result < toread && budget_refusals != refusals) {
+      /* the budget stopped it, there is more data after this */
+      note_cutoff(s, c->end);
+    } else if (result < toread) {
       /* we fell short, so it must have been an error or end-of-file */
       /* make sure we don't try again */
       if (!s->size_known || s->size > c->end) {
@@ -325,63 +893,426 @@ static CHUNK * ensure_chunk(SOURCE *s, CACHE *cache, u8 start)
       }
     }
   }
+  c->busy = 0;
 
   return c;
 }
 
 static CHUNK * get_chunk_alloc(CACHE *cache, u8 start)
 {
-  int hpos;
-  CHUNK *chain, *trav, *c;
+  u4 hpos;
+  CHUNK *c;
 
-  /* get hash bucket (chain) */
-  hpos = HASHFUNC(start);
-  chain = cache->hashtab[hpos];
+  /* look for an existing chunk */
+  if (cache->index != NULL) {
+    hpos = find_slot(cache, start);
+    if (cache->index[hpos] != NULL)  /* found existing chunk */
+      return cache->index[hpos];
+  }
 
-  if (chain == NULL) {
-    /* bucket is empty, allocate new chunk */
-    c = (CHUNK *)malloc(sizeof(CHUNK));
-    if (c == NULL)
-      bailout("Out of memory");
-    c->buf = malloc(CHUNKSIZE);
-    if (c->buf == NULL)
-      bailout("Out of memory");
-    c->start = start;
-    c->end = start;
-    c->len = 0;
-    /* create a new ring list */
-    c->prev = c->next = c;
-    cache->hashtab[hpos] = c;
-    return c;
+  /* not found, stay within the budget */
+  if (cache_limit > 0 && resident_chunks >= cache_limit)
+    make_room(cache, 1);
+
+  /* make room in the index if necessary */
+  if (cache->index == NULL ||
+      INDEXFULL(cache->chunk_count + 1, cache->index_bits)) {
+    grow_index(cache);
   }
 
-  /* travel the ring list, looking for the wanted chunk */
-  trav = chain;
-  do {
-    if (trav->start == start)  /* found existing chunk */
-      return trav;
-    trav = trav->next;
-  } while (trav != chain);
+  /* allocate new chunk */
+  c = alloc_chunk(cache);
+  insert_chunk(cache, c, start);
+  return c;
+}
 
-  /* not found, allocate new chunk */
-  c = (CHUNK *)malloc(sizeof(CHUNK));
-  if (c == NULL)
-    bailout("Out of memory");
-  c->buf = malloc(CHUNKSIZE);
-  if (c->buf == NULL)
-    bailout("Out of memory");
+/*
+ * allocate a run of chunks with adjacent buffers, if none of them is
+ * in the cache yet
+ */
+
+static void alloc_run(CACHE *cache, u8 start, u4 count)
+{
+  u4 i;
+  CHUNK *c;
+
+  if (cache->index != NULL) {
+    for (i = 0; i < count; i++) {
+      if (cache->index[find_slot(cache, start + ((u8)i << CHUNKBITS))]
+          != NULL)
+        return;
+    }
+  }
+
+  /* stay within the budget */
+  if (cache_limit > 0 && resident_chunks + count > cache_limit)
+    make_room(cache, count);
+
+  /* make room in the index if necessary */
+  while (cache->index == NULL ||
+         INDEXFULL(cache->chunk_count + count, cache->index_bits)) {
+    grow_index(cache);
+  }
+
+  c = alloc_chunk_run(cache, count);
+  for (i = 0; i < count; i++)
+    insert_chunk(cache, c + i, start + ((u8)i << CHUNKBITS));
+}
+
+static void insert_chunk(CACHE *cache, CHUNK *c, u8 start)
+{
   c->start = start;
   c->end = start;
   c->len = 0;
-  /* add to ring list before chain, becomes new head */
-  c->prev = chain->prev;
-  c->next = chain;
-  c->prev->next = c;
-  c->next->prev = c;
-  cache->hashtab[hpos] = c;
+  c->scope = 0;
+  c->referenced = 1;
+  c->busy = 0;
+  /* put it into the empty slot */
+  cache->index[find_slot(cache, start)] = c;
+  cache->chunk_count++;
+  resident_chunks++;
+  if (cache->chunk_count > cache->stats.peak_chunks)
+    cache->stats.peak_chunks = cache->chunk_count;
+}
+
+/*
+ * find the index slot for a chunk: either the slot holding it, or the
+ * empty slot where it belongs
+ */
+
+static u4 find_slot(CACHE *cache, u8 start)
+{
+  u4 hpos, mask;
+  CHUNK *c;
+
+  mask = ((u4)1 << cache->index_bits) - 1;
+  for (hpos = HASHFUNC(start, cache->index_bits); ;
+       hpos = (hpos + 1) & mask) {
+    c = cache->index[hpos];
+    if (c == NULL || c->start == start)
+      return hpos;
+  }
+  /* NOTE: the loop terminates because the index is never full */
+}
+
+/*
+ * double the size of the index and re-insert all chunks
+ */
+
+static void grow_index(CACHE *cache)
+{
+  CHUNK **oldindex;
+  u4 oldsize, i, hpos;
+
+  oldindex = cache->index;
+  oldsize = (oldindex != NULL) ? ((u4)1 << cache->index_bits) : 0;
+
+  cache->index_bits = (oldindex != NULL) ? cache->index_bits + 1 : INDEXBITS;
+  cache->index = (CHUNK **)malloc(sizeof(CHUNK *) << cache->index_bits);
+  if (cache->index == NULL)
+    bailout("Out of memory");
+  memset(cache->index, 0, sizeof(CHUNK *) << cache->index_bits);
+
+  for (i = 0; i < oldsize; i++) {
+    if (oldindex[i] != NULL) {
+      hpos = find_slot(cache, oldindex[i]->start);
+      cache->index[hpos] = oldindex[i];
+    }
+  }
+  if (oldindex != NULL)
+    free(oldindex);
+}
+
+/*
+ * take a chunk out of the index, moving later members of its probe
+ * sequence back so that lookups still find them
+ */
+
+static void remove_slot(CACHE *cache, u4 hpos)
+{
+  u4 mask, next, home;
+
+  mask = ((u4)1 << cache->index_bits) - 1;
+  for (next = (hpos + 1) & mask; cache->index[next] != NULL;
+       next = (next + 1) & mask) {
+    home = HASHFUNC(cache->index[next]->start, cache->index_bits);
+    /* leave it alone if its home slot lies cyclically in (hpos, next] */
+    if ((hpos <= next) ? (home > hpos && home <= next)
+                       : (home > hpos || home <= next))
+      continue;
+    cache->index[hpos] = cache->index[next];
+    hpos = next;
+  }
+  cache->index[hpos] = NULL;
+  cache->chunk_count--;
+}
+
+/*
+ * slab allocation of chunks: headers and buffers come in batches and
+ * are released together when the source is closed
+ */
+
+static CHUNK * alloc_chunk(CACHE *cache)
+{
+  SLAB *slab;
+  CHUNK *c;
+
+  slab = cache->partial_slabs;
+  if (slab == NULL)  /* all slabs are full, get a new one */
+    slab = new_slab(cache, 0);
+
+  /* take a chunk given back earlier, or a fresh one */
+  if (slab->free != NULL) {
+    c = slab->free;
+    slab->free = c->next_free;
+  } else {
+    c = &slab->chunks[slab->used++];
+  }
+  slab->live++;
+
+  if (slab->free == NULL && slab->used >= slab->count) {
+    /* no more room in this one */
+    unlink_slab(&cache->partial_slabs, slab);
+    link_slab(&cache->full_slabs, slab);
+  }
+  return c;
+}
+
+static CHUNK * alloc_chunk_run(CACHE *cache, u4 count)
+{
+  SLAB *slab;
+  CHUNK *c;
+
+  /* only never-used chunks are adjacent */
+  slab = cache->partial_slabs;
+  if (slab == NULL || slab->count - slab->used < count)
+    slab = new_slab(cache, count);
+
+  c = &slab->chunks[slab->used];
+  slab->used += count;
+  slab->live += count;
+
+  if (slab->free == NULL && slab->used >= slab->count) {
+    /* no more room in this one */
+    unlink_slab(&cache->partial_slabs, slab);
+    link_slab(&cache->full_slabs, slab);
+  }
   return c;
 }
 
+static SLAB * new_slab(CACHE *cache, u4 count)
+{
+  SLAB *slab;
+  u4 i;
+  char *bufs;
+
+  if (cache->next_slab_size == 0)
+    cache->next_slab_size = SLABMIN;
+  count = MAXIMUM(count, cache->next_slab_size);
+  if (cache->next_slab_size < SLABMAX)
+    cache->next_slab_size *= 2;
+
+  slab = (SLAB *)malloc(sizeof(SLAB) + count * sizeof(CHUNK));
+  if (slab == NULL)
+    bailout("Out of memory");
+  slab->count = count;
+  slab->chunks = (CHUNK *)(slab + 1);
+  slab->mem = malloc((size_t)(count + 1) << CHUNKBITS);
+  if (slab->mem == NULL)
+    bailout("Out of memory");
+  /* align the buffers to chunk (and thus page) boundaries */
+  bufs = (char *)slab->mem +
+    ((CHUNKSIZE - ((size_t)slab->mem & CHUNKMASK)) & CHUNKMASK);
+  for (i = 0; i < count; i++) {
+    slab->chunks[i].slab = slab;
+    slab->chunks[i].buf = bufs + ((size_t)i << CHUNKBITS);
+  }
+  slab->used = 0;
+  slab->live = 0;
+  slab->free = NULL;
+  link_slab(&cache->partial_slabs, slab);
+  return slab;
+}
+
+static void free_chunk(CACHE *cache, CHUNK *c)
+{
+  SLAB *slab;
+
+  slab = c->slab;
+  if (slab->free == NULL && slab->used >= slab->count) {
+    /* it has room again */
+    unlink_slab(&cache->full_slabs, slab);
+    link_slab(&cache->partial_slabs, slab);
+  }
+  c->next_free = slab->free;
+  slab->free = c;
+  slab->live--;
+
+  if (slab->live == 0 && (slab->next != NULL || slab->prev != NULL)) {
+    /* give empty slabs back, but keep the last one around */
+    unlink_slab(&cache->partial_slabs, slab);
+    free_slab(slab);
+  }
+}
+
+static void free_slab(SLAB *slab)
+{
+  free(slab->mem);
+  free(slab);
+}
+
+static void link_slab(SLAB **list, SLAB *slab)
+{
+  slab->prev = NULL;
+  slab->next = *list;
+  if (*list != NULL)
+    (*list)->prev = slab;
+  *list = slab;
+}
+
+static void unlink_slab(SLAB **list, SLAB *slab)
+{
+  if (slab->prev != NULL)
+    slab->prev->next = slab->next;
+  else
+    *list = slab->next;
+  if (slab->next != NULL)
+    slab->next->prev = slab->prev;
+}
+
+/*
+ * eviction: a CLOCK policy per cache, seekable sources are asked
+ * first because their chunks can be read again later
+ */
+
+static void protect_chunk(CHUNK *c)
+{
+  /* keep an outer scope that is still running, it's the longer one */
+  if (!scope_active(c->scope))
+    c->scope = scope_stack[MINIMUM(scope_depth, MAXSCOPES) - 1];
+}
+
+static int scope_active(u4 scope)
+{
+  int i;
+
+  if (scope == 0)
+    return 0;
+  for (i = MINIMUM(scope_depth, MAXSCOPES) - 1; i >= 0; i--) {
+    if (scope_stack[i] == scope)
+      return 1;
+    if (scope_stack[i] < scope)
+      break;  /* the stack is sorted */
+  }
+  return 0;
+}
+
+static void make_room(CACHE *cache, u4 count)
+{
+  CACHE *trav;
+  int pass;
+
+  while (resident_chunks + count > cache_limit) {
+    /* the asking cache first, then the others; seekable ones first */
+    for (pass = 0; pass < 2; pass++) {
+      if ((cache->source->sequential != 0) == pass && evict_chunk(cache))
+        break;
+      for (trav = all_caches; trav != NULL; trav = trav->next) {
+        if (trav != cache && (trav->source->sequential != 0) == pass &&
+            evict_chunk(trav))
+          break;
+      }
+      if (trav != NULL)
+        break;
+    }
+    if (pass >= 2)
+      break;  /* nothing can go, exceed the budget */
+  }
+}
+
+static int evict_chunk(CACHE *cache)
+{
+  u4 size, i, hpos;
+  CHUNK *c;
+
+  if (cache->index == NULL || cache->chunk_count == 0)
+    return 0;
+
+  /* two rounds are enough to clear all reference bits */
+  size = (u4)1 << cache->index_bits;
+  for (i = 0; i < 2 * size; i++) {
+    hpos = cache->clock_hand;
+    cache->clock_hand = (hpos + 1) & (size - 1);
+
+    c = cache->index[hpos];
+    if (c == NULL)
+      continue;
+    if (c->busy || (cache->source->sequential && c->start < PINSIZE))
+      continue;  /* in use or pinned */
+    if (scope_active(c->scope))
+      continue;  /* somebody has a pointer into it */
+    if (c->referenced) {
+      c->referenced = 0;  /* second chance */
+      continue;
+    }
+
+    /* evict it */
+    remove_slot(cache, hpos);
+    resident_chunks--;
+    free_chunk(cache, c);
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * statistics: one line per source when it is closed, and the totals
+ * at the end, all in "key=value" form on stderr
+ */
+
+void set_cache_stats(int enable)
+{
+  stats_enabled = enable;
+}
+
+void print_cache_stats(void)
+{
+  char what[64];
+
+  if (!stats_enabled)
+    return;
+  sprintf(what, "total sources=%llu", stats_sources);
+  print_stats(what, &total_stats);
+}
+
+static void print_stats(const char *what, STATS *st)
+{
+  fprintf(stderr, "%s: stats %s requests=%llu requested=%llu"
+          " hits=%llu misses=%llu reads=%llu read=%llu"
+          " tempbufs=%llu tempbuf_bytes=%llu"
+          " inplace=%llu inplace_bytes=%llu peak_chunks=%llu\n",
+          PROGNAME, what, st->requests, st->requested,
+          st->hits, st->misses, st->reads, st->read,
+          st->tempbufs, st->tempbuf_bytes,
+          st->inplace, st->inplace_bytes, st->peak_chunks);
+}
+
+static void add_stats(STATS *to, STATS *from)
+{
+  to->requests += from->requests;
+  to->requested += from->requested;
+  to->hits += from->hits;
+  to->misses += from->misses;
+  to->reads += from->reads;
+  to->read += from->read;
+  to->tempbufs += from->tempbufs;
+  to->tempbuf_bytes += from->tempbuf_bytes;
+  to->inplace += from->inplace;
+  to->inplace_bytes += from->inplace_bytes;
+  /* peaks of different sources may overlap, count them all */
+  to->peak_chunks += from->peak_chunks;
+}
+
 /*
  * dispose of a source
  */
@@ -389,44 +1320,49 @@ static CHUNK * get_chunk_alloc(CACHE *cache, u8 start)
 void close_source(SOURCE *s)
 {
   CACHE *cache;
-  int hpos;
-  CHUNK *chain, *trav, *nexttrav;
+  SLAB *slab, *next;
+  SOURCE *trav;
+  char what[64];
+  int layer;
 
   /* drop the cache */
   cache = (CACHE *)s->cache_head;
   if (cache != NULL) {
-#if PROFILE
-    printf("Cache profile:\n");
-#endif
+    if (stats_enabled) {
+      /* layer 0 is the file, each source stacked on it adds one */
+      for (layer = 0, trav = s->foundation; trav != NULL;
+           trav = trav->foundation)
+        layer++;
+      sprintf(what, "layer=%d source=%.32s", layer,
+              s->name != NULL ? s->name : "unknown");
+      print_stats(what, &cache->stats);
+      add_stats(&total_stats, &cache->stats);
+      stats_sources++;
+    }
     if (cache->tempbuf != NULL)
       free(cache->tempbuf);
-    for (hpos = 0; hpos < HASHSIZE; hpos++) {
-#if PROFILE
-      printf(" hash position %d:", hpos);
-#endif
-      chain = cache->hashtab[hpos];
-      if (chain != NULL) {
-        trav = chain;
-        do {
-#if PROFILE
-          printf(" %lluK", trav->start >> 10);
-          if (trav->len != CHUNKSIZE)
-            printf(":%llu", trav->len);
-#endif
-          nexttrav = trav->next;
-          free(trav->buf);
-          free(trav);
-          trav = nexttrav;
-        } while (trav != chain);
-#if PROFILE
-        printf("\n");
-#endif
-      }
-#if PROFILE
-      else
-        printf(" empty\n");
-#endif
+    if (cache->batch != NULL)
+      free(cache->batch);  /* queued chunks go away with their slabs */
+    if (cache->index != NULL)
+      free(cache->index);
+    /* the chunks go away with their slabs */
+    resident_chunks -= cache->chunk_count;
+    for (slab = cache->partial_slabs; slab != NULL; slab = next) {
+      next = slab->next;
+      free_slab(slab);
+    }
+    for (slab = cache->full_slabs; slab != NULL; slab = next) {
+      next = slab->next;
+      free_slab(slab);
     }
+    /* unlink from the list of caches */
+    if (cache->prev != NULL)
+      cache->prev->next = cache->next;
+    else
+      all_caches = cache->next;
+    if (cache->next != NULL)
+      cache->next->prev = cache->prev;
+    free(cache);
   }
 
   /* type-specific cleanup */
@@ -0,0 +1,654 @@
+/*
+ * bzip2.c
+ * Layered data source for bzip2 data, decoded block by block.
+ *
+ * Copyright (c) 2026 The disktype contributors
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "global.h"
+
+#ifdef USE_BZIP2
+
+#include <bzlib.h>
+#include <pthread.h>
+#include <time.h>
+
+/*
+ * A bzip2 stream is a header ("BZh" and the block size level) followed
+ * by blocks, each starting with a 48-bit magic number on any bit
+ * boundary, and an end-of-stream marker. The blocks don't depend on each
+ * other, so each one can be cut out, wrapped up as a stream of its own
+ * and decoded on a separate thread.
+ */
+
+#define BLOCKMAGIC (0x314159265359ULL)
+#define EOSMAGIC   (0x177245385090ULL)
+#define MAGICMASK  (0xFFFFFFFFFFFFULL)
+
+/* the most blocks decoded at once */
+#define MAXWORKERS (8)
+
+/* compressed data is scanned through a window of this size */
+#define SCANWINDOW (1024*1024)
+
+/* how often a block that won't decode is joined with the next one; a
+   block's data may contain the magic number by chance */
+#define MAXMERGE (4)
+
+/*
+ * types
+ */
+
+typedef struct bz_block {
+  u8 bit_start, bit_end;   /* relative to the source's offset */
+  int level, stream_start;
+  u8 out_start, out_len;   /* valid for the first sized_count blocks */
+} BZ_BLOCK;
+
+typedef struct bz_job {
+  int block;               /* -1 if the slot holds nothing */
+  int level, shift;
+  u8 bits;
+  unsigned char *raw, *out;
+  u8 raw_alloc, out_alloc, out_len;
+  int ok;
+} BZ_JOB;
+
+typedef struct bzip2_source {
+  SOURCE c;
+  u8 offset, in_max;
+  BZ_BLOCK *blocks;
+  int block_count, block_alloc, sized_count;
+  /* scanner state */
+  u8 scan_bit;
+  int scan_level, scan_header, scan_done;
+  unsigned char *window;
+  u8 window_start, window_len;
+  /* the blocks of the last batch */
+  BZ_JOB jobs[MAXWORKERS];
+  int workers, failed;
+  /* for the decompression budget */
+  u8 decoded;
+  time_t started;
+} BZIP2_SOURCE;
+
+/*
+ * helper functions
+ */
+
+static u8 read_bzip2(SOURCE *s, u8 pos, u8 len, void *buf);
+static void close_bzip2(SOURCE *s);
+static int find_block(BZIP2_SOURCE *bs, u8 pos);
+static int size_more(BZIP2_SOURCE *bs);
+static int run_batch(BZIP2_SOURCE *bs, int first, int count);
+static int gather_job(BZIP2_SOURCE *bs, BZ_JOB *job, int block);
+static void *decode_job(void *arg);
+static int scan_block(BZIP2_SOURCE *bs);
+static int find_magic(BZIP2_SOURCE *bs, u8 from_bit, u8 *found_bit,
+                      u8 *found_magic);
+static int peek_magic(BZIP2_SOURCE *bs, u8 bit, u8 *magic);
+static int window_at(BZIP2_SOURCE *bs, u8 pos, int need, unsigned char **p);
+static void put_bits(unsigned char *buf, u8 *bitpos, u8 value, int count);
+
+/*
+ * initialize the block decoding source
+ */
+
+SOURCE *init_bzip2_source(SOURCE *foundation, u8 offset, u8 size)
+{
+  BZIP2_SOURCE *bs;
+  long cpus;
+
+  /* blocks are revisited, so the compressed data must be seekable */
+  if (foundation->sequential)
+    return NULL;
+
+  bs = (BZIP2_SOURCE *)malloc(sizeof(BZIP2_SOURCE));
+  if (bs == NULL)
+    bailout("Out of memory");
+  memset(bs, 0, sizeof(BZIP2_SOURCE));
+  bs->window = (unsigned char *)malloc(SCANWINDOW);
+  if (bs->window == NULL)
+    bailout("Out of memory");
+
+  bs->c.name = "bzip2";
+  bs->c.foundation = foundation;
+  bs->c.read_bytes = read_bzip2;
+  bs->c.close = close_bzip2;
+  /* size becomes known when the last block has been decoded */
+
+  bs->offset = offset;
+  bs->in_max = size;
+  bs->scan_header = 1;
+  bs->started = time(NULL);
+
+  cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  bs->workers = (cpus < 1) ? 1 : (cpus > MAXWORKERS) ? MAXWORKERS : cpus;
+
+  return (SOURCE *)bs;
+}
+
+/*
+ * raw read: copy from the decoded blocks, decoding them as needed
+ */
+
+static u8 read_bzip2(SOURCE *s, u8 pos, u8 len, void *buf)
+{
+  BZIP2_SOURCE *bs = (BZIP2_SOURCE *)s;
+  BZ_BLOCK *b;
+  BZ_JOB *job;
+  int block, i;
+  u8 got, rel, avail;
+
+  got = 0;
+  while (got < len) {
+    block = find_block(bs, pos + got);
+    if (block < 0)
+      break;  /* past the end */
+
+    /* is it still around from the last batch? */
+    job = NULL;
+    for (i = 0; i < bs->workers; i++) {
+      if (bs->jobs[i].block == block && bs->jobs[i].ok) {
+        job = &bs->jobs[i];
+        break;
+      }
+    }
+    if (job == NULL) {
+      run_batch(bs, block, bs->workers);
+      if (bs->jobs[0].block != block || !bs->jobs[0].ok)
+        break;
+      job = &bs->jobs[0];
+    }
+
+    b = &bs->blocks[block];
+    rel = pos + got - b->out_start;
+    avail = b->out_len - rel;
+    if (avail > len - got)
+      avail = len - got;
+    memcpy((char *)buf + got, job->out + rel, avail);
+    got += avail;
+  }
+
+  return got;
+}
+
+/*
+ * close cleanup
+ */
+
+static void close_bzip2(SOURCE *s)
+{
+  BZIP2_SOURCE *bs = (BZIP2_SOURCE *)s;
+  int i;
+
+  for (i = 0; i < MAXWORKERS; i++) {
+    free(bs->jobs[i].raw);
+    free(bs->jobs[i].out);
+  }
+  free(bs->blocks);
+  free(bs->window);
+}
+
+/*
+ * find the block holding pos, decoding blocks until its offset is known
+ */
+
+static int find_block(BZIP2_SOURCE *bs, u8 pos)
+{
+  BZ_BLOCK *last;
+  int lo, hi, mid;
+
+  for (;;) {
+    if (bs->sized_count > 0) {
+      last = &bs->blocks[bs->sized_count - 1];
+      if (pos < last->out_start + last->out_len)
+        break;
+    }
+    if (!size_more(bs))
+      return -1;
+  }
+
+  lo = 0;
+  hi = bs->sized_count - 1;
+  while (lo < hi) {
+    mid = (lo + hi + 1) / 2;
+    if (bs->blocks[mid].out_start <= pos)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo;
+}
+
+/*
+ * decode the next batch of blocks to learn their sizes, returns zero when
+ * there are no more
+ */
+
+static int size_more(BZIP2_SOURCE *bs)
+{
+  BZ_BLOCK *last;
+
+  while (!bs->scan_done && bs->block_count < bs->sized_count + bs->workers)
+    scan_block(bs);
+  if (bs->failed || bs->sized_count >= bs->block_count) {
+    /* that's all, note the size for the buffer layer */
+    if (!bs->c.size_known) {
+      bs->c.size_known = 1;
+      if (bs->sized_count > 0) {
+        last = &bs->blocks[bs->sized_count - 1];
+        bs->c.size = last->out_start + last->out_len;
+      } else
+        bs->c.size = 0;
+    }
+    return 0;
+  }
+
+  if (!run_batch(bs, bs->sized_count, bs->workers))
+    return 0;
+  if (bs->scan_done && bs->sized_count == bs->block_count && !bs->failed) {
+    /* everything is accounted for */
+    last = &bs->blocks[bs->sized_count - 1];
+    bs->c.size_known = 1;
+    bs->c.size = last->out_start + last->out_len;
+  }
+  return 1;
+}
+
+/*
+ * decode up to count blocks starting at first, in parallel
+ */
+
+static int run_batch(BZIP2_SOURCE *bs, int first, int count)
+{
+  BZ_JOB *job;
+  BZ_BLOCK *b;
+  pthread_t threads[MAXWORKERS];
+  int started[MAXWORKERS];
+  int i, merges, progress;
+
+  if (count > bs->block_count - first)
+    count = bs->block_count - first;
+  if (over_budget(&bs->c, bs->decoded, bs->started))
+    count = 0;
+
+  /* the compressed data is gathered here, the layers below aren't
+     thread-safe */
+  for (i = 0; i < bs->workers; i++) {
+    job = &bs->jobs[i];
+    job->block = -1;
+    job->ok = 0;
+    if (i < count && !gather_job(bs, job, first + i))
+      count = i;
+  }
+
+  /* decode; the first one on this thread */
+  for (i = 1; i < count; i++)
+    started[i] = (pthread_create(&threads[i], NULL, decode_job,
+                                 &bs->jobs[i]) == 0);
+  if (count > 0)
+    decode_job(&bs->jobs[0]);
+  for (i = 1; i < count; i++) {
+    if (started[i])
+      pthread_join(threads[i], NULL);
+    else
+      decode_job(&bs->jobs[i]);
+  }
+
+  /* take note of the sizes, in order */
+  progress = 0;
+  for (i = 0; i < count; i++) {
+    job = &bs->jobs[i];
+    bs->decoded += job->out_len;
+
+    /* a false block start splits a block in two that both fail to
+       decode; join them up and try again */
+    for (merges = 0; !job->ok && merges < MAXMERGE &&
+           job->block + 1 < bs->block_count &&
+           !bs->blocks[job->block + 1].stream_start; merges++) {
+      b = &bs->blocks[job->block];
+      b->bit_end = bs->blocks[job->block + 1].bit_end;
+      memmove(b + 1, b + 2,
+              (bs->block_count - job->block - 2) * sizeof(BZ_BLOCK));
+      bs->block_count--;
+      if (gather_job(bs, job, job->block))
+        decode_job(job);
+      count = i + 1;  /* the others now refer to the wrong blocks */
+    }
+    if (!job->ok) {
+      if (!bs->failed)
+        error("bzip2 data error in block %d", job->block);
+      bs->failed = 1;
+      bs->block_count = job->block;
+      if (bs->sized_count > bs->block_count)
+        bs->sized_count = bs->block_count;
+      bs->scan_done = 1;
+      break;
+    }
+
+    if (job->block == bs->sized_count) {
+      b = &bs->blocks[job->block];
+      b->out_start = 0;
+      if (job->block > 0)
+        b->out_start = b[-1].out_start + b[-1].out_len;
+      b->out_len = job->out_len;
+      bs->sized_count++;
+      progress = 1;
+    }
+  }
+  for (; i < bs->workers; i++)
+    bs->jobs[i].block = -1;
+
+  return progress || count > 0;
+}
+
+/*
+ * copy a block's compressed data into a job slot
+ */
+
+static int gather_job(BZIP2_SOURCE *bs, BZ_JOB *job, int block)
+{
+  BZ_BLOCK *b = &bs->blocks[block];
+  u8 start, len;
+
+  start = b->bit_start >> 3;
+  len = ((b->bit_end + 7) >> 3) - start;
+  if (job->raw_alloc < len + 1) {
+    free(job->raw);
+    job->raw_alloc = len + 1;
+    job->raw = (unsigned char *)malloc(job->raw_alloc);
+    if (job->raw == NULL)
+      bailout("Out of memory");
+  }
+  if (get_buffer_real(bs->c.foundation, bs->offset + start, len,
+                      job->raw, NULL) < len)
+    return 0;
+  job->raw[len] = 0;
+
+  job->block = block;
+  job->level = b->level;
+  job->shift = (int)(b->bit_start & 7);
+  job->bits = b->bit_end - b->bit_start;
+  job->ok = 0;
+  return 1;
+}
+
+/*
+ * wrap one block up as a stream and decode it; runs on worker threads
+ */
+
+static void *decode_job(void *arg)
+{
+  BZ_JOB *job = (BZ_JOB *)arg;
+  bz_stream strm;
+  unsigned char *stream;
+  u8 nbytes, i, bitpos, crc;
+  int result;
+
+  /* header, the block shifted to a byte boundary, end-of-stream marker;
+     the stream's CRC is the block's CRC when there's only one block */
+  if (job->bits < 48 + 32)
+    return NULL;
+  nbytes = (job->bits + 7) >> 3;
+  stream = (unsigned char *)malloc(4 + nbytes + 11);
+  if (stream == NULL)
+    return NULL;
+  memcpy(stream, "BZh", 3);
+  stream[3] = '0' + job->level;
+  for (i = 0; i < nbytes; i++) {
+    stream[4 + i] = job->raw[i] << job->shift;
+    if (job->shift)
+      stream[4 + i] |= job->raw[i + 1] >> (8 - job->shift);
+  }
+  if (job->bits & 7)
+    stream[4 + nbytes - 1] &= 0xff << (8 - (job->bits & 7));
+  crc = ((u8)stream[10] << 24) | ((u8)stream[11] << 16) |
+    ((u8)stream[12] << 8) | (u8)stream[13];
+  bitpos = 32 + job->bits;
+  put_bits(stream, &bitpos, EOSMAGIC, 48);
+  put_bits(stream, &bitpos, crc, 32);
+
+  if (job->out_alloc == 0) {
+    job->out_alloc = (u8)job->level * 100000 * 2;
+    job->out = (unsigned char *)malloc(job->out_alloc);
+    if (job->out == NULL) {
+      job->out_alloc = 0;
+      free(stream);
+      return NULL;
+    }
+  }
+
+  memset(&strm, 0, sizeof(strm));
+  if (BZ2_bzDecompressInit(&strm, 0, 0) != BZ_OK) {
+    free(stream);
+    return NULL;
+  }
+  strm.next_in = (char *)stream;
+  strm.avail_in = (unsigned int)((bitpos + 7) >> 3);
+  job->out_len = 0;
+  for (;;) {
+    if (job->out_len == job->out_alloc) {
+      /* long runs make for blocks of up to 45 MiB */
+      unsigned char *grown = (unsigned char *)realloc(job->out,
+                                                      job->out_alloc * 2);
+      if (grown == NULL)
+        break;
+      job->out = grown;
+      job->out_alloc *= 2;
+    }
+    strm.next_out = (char *)job->out + job->out_len;
+    strm.avail_out = (unsigned int)(job->out_alloc - job->out_len);
+    result = BZ2_bzDecompress(&strm);
+    job->out_len = job->out_alloc - strm.avail_out;
+    if (result == BZ_STREAM_END) {
+      job->ok = 1;
+      break;
+    }
+    if (result != BZ_OK || (strm.avail_in == 0 && strm.avail_out > 0))
+      break;
+  }
+  BZ2_bzDecompressEnd(&strm);
+  free(stream);
+
+  return NULL;
+}
+
+/*
+ * find the next block in the compressed data, returns zero at its end
+ */
+
+static int scan_block(BZIP2_SOURCE *bs)
+{
+  unsigned char *p;
+  BZ_BLOCK *b;
+  u8 magic, found_bit;
+  int stream_start;
+
+  stream_start = 0;
+  for (;;) {
+    if (bs->scan_header) {
+      /* a stream header must be next, else that's the end */
+      if (window_at(bs, bs->scan_bit >> 3, 4, &p) < 4 ||
+          memcmp(p, "BZh", 3) != 0 || p[3] < '1' || p[3] > '9') {
+        bs->scan_done = 1;
+        return 0;
+      }
+      bs->scan_level = p[3] - '0';
+      bs->scan_bit += 32;
+      bs->scan_header = 0;
+      stream_start = 1;
+    }
+
+    /* a block or the end of the stream must be next */
+    if (!peek_magic(bs, bs->scan_bit, &magic)) {
+      bs->scan_done = 1;
+      return 0;
+    }
+    if (magic == BLOCKMAGIC)
+      break;
+
+    /* end of stream: skip the CRC, another one may follow */
+    bs->scan_bit = ((bs->scan_bit + 48 + 32 + 7) >> 3) << 3;
+    bs->scan_header = 1;
+  }
+
+  /* note the block; it ends where the next magic number shows up */
+  if (bs->block_count >= bs->block_alloc) {
+    bs->block_alloc = bs->block_alloc ? bs->block_alloc * 2 : 64;
+    bs->blocks = (BZ_BLOCK *)realloc(bs->blocks,
+                                     bs->block_alloc * sizeof(BZ_BLOCK));
+    if (bs->blocks == NULL)
+      bailout("Out of memory");
+  }
+  b = &bs->blocks[bs->block_count++];
+  memset(b, 0, sizeof(BZ_BLOCK));
+  b->bit_start = bs->scan_bit;
+  b->level = bs->scan_level;
+  b->stream_start = stream_start;
+
+  if (find_magic(bs, bs->scan_bit + 48 + 32, &found_bit, &magic)) {
+    b->bit_end = found_bit;
+    bs->scan_bit = found_bit;
+  } else {
+    /* truncated; let the decoder find out */
+    b->bit_end = (bs->window_start + bs->window_len) << 3;
+    bs->scan_done = 1;
+  }
+  return 1;
+}
+
+/*
+ * look for either magic number at or after a bit position
+ */
+
+static int find_magic(BZIP2_SOURCE *bs, u8 from_bit, u8 *found_bit,
+                      u8 *found_magic)
+{
+  unsigned char *p;
+  u8 pos, reg, cand, start;
+  int avail, i, shift, loaded;
+
+  pos = from_bit >> 3;
+  reg = 0;
+  loaded = 0;
+  for (;;) {
+    avail = window_at(bs, pos, 1, &p);
+    if (avail <= 0)
+      return 0;
+
+    for (i = 0; i < avail; i++) {
+      reg = (reg << 8) | p[i];
+      if (++loaded < 6)
+        continue;
+
+      /* the register now ends at bit (pos + i + 1) * 8; earlier
+         starting positions first */
+      for (shift = 7; shift >= 0; shift--) {
+        cand = (reg >> shift) & MAGICMASK;
+        if (cand != BLOCKMAGIC && cand != EOSMAGIC)
+          continue;
+        start = ((pos + i + 1) << 3) - shift - 48;
+        if (start < from_bit)
+          continue;  /* before where we were told to look */
+        *found_bit = start;
+        *found_magic = cand;
+        return 1;
+      }
+    }
+    pos += avail;
+  }
+}
+
+/*
+ * read the 48 bits at a bit position, if they're one of the magic numbers
+ */
+
+static int peek_magic(BZIP2_SOURCE *bs, u8 bit, u8 *magic)
+{
+  unsigned char *p;
+  u8 reg;
+  int i;
+
+  if (window_at(bs, bit >> 3, 7, &p) < 7)
+    return 0;
+  reg = 0;
+  for (i = 0; i < 7; i++)
+    reg = (reg << 8) | p[i];
+  *magic = (reg >> (8 - (bit & 7))) & MAGICMASK;
+  return (*magic == BLOCKMAGIC || *magic == EOSMAGIC);
+}
+
+/*
+ * map a byte position of the compressed data to the scan window, moving
+ * it if fewer than need bytes are there; returns the number of bytes
+ * available
+ */
+
+static int window_at(BZIP2_SOURCE *bs, u8 pos, int need, unsigned char **p)
+{
+  u8 len;
+
+  if (pos < bs->window_start ||
+      pos + need > bs->window_start + bs->window_len) {
+    len = SCANWINDOW;
+    if (bs->in_max) {
+      if (pos >= bs->in_max)
+        return 0;
+      if (pos + len > bs->in_max)
+        len = bs->in_max - pos;
+    }
+    bs->window_start = pos;
+    bs->window_len = get_buffer_real(bs->c.foundation, bs->offset + pos, len,
+                                     bs->window, NULL);
+    if (bs->window_len == 0)
+      return 0;
+  }
+
+  *p = bs->window + (pos - bs->window_start);
+  return (int)(bs->window_start + bs->window_len - pos);
+}
+
+/*
+ * append bits to a buffer, most significant first
+ */
+
+static void put_bits(unsigned char *buf, u8 *bitpos, u8 value, int count)
+{
+  int i, bit;
+  u8 pos;
+
+  for (i = count - 1; i >= 0; i--) {
+    bit = (int)((value >> i) & 1);
+    pos = *bitpos;
+    if ((pos & 7) == 0)
+      buf[pos >> 3] = 0;
+    if (bit)
+      buf[pos >> 3] |= 0x80 >> (pos & 7);
+    (*bitpos)++;
+  }
+}
+
+#endif /* USE_BZIP2 */
+
+/* EOF */
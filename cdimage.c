@@ -105,6 +105,7 @@ static SOURCE *init_cdimage_source(SOURCE *foundation, u8 offset)
     /* TODO: pass the size in from the SECTION record and use it */
   }
   src->c.blocksize = 2048;
+  src->c.name = "cdimage";
   src->c.foundation = foundation;
   src->c.read_block = read_block_cdimage;
   src->c.close = NULL;
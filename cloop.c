@@ -27,6 +27,68 @@
 
 #include "global.h"
 
+#ifdef USE_ZLIB
+
+#include <zlib.h>
+#include <pthread.h>
+
+/*
+ * A V2.0 image starts with a shell script header, followed by the
+ * block size, the block count and a table of block_count + 1 offsets
+ * into the file. Each block is a zlib stream of its own, so blocks can
+ * be decoded in any order and on separate threads.
+ */
+
+/* number of decoded blocks kept in memory */
+#define CLOOP_CACHE_SIZE (16)
+/* the most blocks decoded at once */
+#define MAXWORKERS (8)
+
+/*
+ * types
+ */
+
+typedef struct cloop_slot {
+  u4 block;          /* valid if used != 0 */
+  u4 used;           /* for LRU replacement */
+  unsigned char *out;
+} CLOOP_SLOT;
+
+typedef struct cloop_job {
+  CLOOP_SLOT *slot;
+  unsigned char *raw;
+  u8 raw_alloc, raw_len;
+  u4 block_size;
+  int ok;
+} CLOOP_JOB;
+
+typedef struct cloop_source {
+  SOURCE c;
+  u4 block_size;
+  u4 block_count;
+  u8 *offsets;       /* block_count + 1 entries, in the foundation */
+  CLOOP_SLOT slots[CLOOP_CACHE_SIZE];
+  u4 clock;
+  CLOOP_JOB jobs[MAXWORKERS];
+  int workers;
+} CLOOP_SOURCE;
+
+/*
+ * helper functions
+ */
+
+static SOURCE *init_cloop_source(SECTION *section, int level,
+                                 u4 blocksize, u4 blockcount);
+static u8 read_cloop(SOURCE *s, u8 pos, u8 len, void *buf);
+static void prefetch_cloop(SOURCE *s, u8 pos, u8 len);
+static CLOOP_SLOT *find_slot(CLOOP_SOURCE *cs, u4 block);
+static u4 decode_blocks(CLOOP_SOURCE *cs, u4 first, u4 last);
+static int gather_job(CLOOP_SOURCE *cs, CLOOP_JOB *job, u4 block);
+static void *decode_job(void *arg);
+static void close_cloop(SOURCE *s);
+
+#endif /* USE_ZLIB */
+
 /*
  * image file detection
  */
@@ -37,6 +99,9 @@ void detect_cloop(SECTION *section, int level)
   u4 blocksize, blockcount;
   char s[256];
   const char *sig_20 = "#!/bin/sh\n#V2.0 Format\nmodprobe cloop";
+#ifdef USE_ZLIB
+  SOURCE *src;
+#endif
 
   /* check for signature */
   if (get_buffer(section, 0, 256, (void **)&buf) < 256)
@@ -50,6 +115,314 @@ void detect_cloop(SECTION *section, int level)
   blockcount = get_be_long(buf + 132);
   format_blocky_size(s, blockcount, blocksize, "blocks", NULL);
   print_line(level + 1, "Volume size %s", s);
+
+#ifdef USE_ZLIB
+  src = init_cloop_source(section, level, blocksize, blockcount);
+  if (src != NULL) {
+    analyze_source(src, level);
+    close_source(src);
+    stop_detect();
+  }
+#endif
+}
+
+#ifdef USE_ZLIB
+
+/*
+ * initialize the block decoding source from the offset table
+ */
+
+static SOURCE *init_cloop_source(SECTION *section, int level,
+                                 u4 blocksize, u4 blockcount)
+{
+  CLOOP_SOURCE *cs;
+  unsigned char *raw;
+  u8 table_len;
+  u4 i;
+  long cpus;
+
+  if (blocksize < 512 || blocksize > 16*1024*1024 ||
+      (blocksize & 511) != 0) {
+    print_line(level + 1, "Error: Invalid block size");
+    return NULL;
+  }
+  table_len = ((u8)blockcount + 1) * 8;
+  if (blockcount == 0 || 136 + table_len > section->size) {
+    print_line(level + 1, "Error: Block count doesn't fit the file size");
+    return NULL;
+  }
+
+  /* allocate and init source structure */
+  cs = (CLOOP_SOURCE *)malloc(sizeof(CLOOP_SOURCE));
+  if (cs == NULL)
+    bailout("Out of memory");
+  memset(cs, 0, sizeof(CLOOP_SOURCE));
+
+  cs->c.size_known = 1;
+  cs->c.size = (u8)blockcount * blocksize;
+  cs->c.name = "cloop";
+  cs->c.foundation = section->source;
+  cs->c.read_bytes = read_cloop;
+  cs->c.prefetch = prefetch_cloop;
+  cs->c.close = close_cloop;
+
+  cs->block_size = blocksize;
+  cs->block_count = blockcount;
+
+  cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  cs->workers = (cpus < 1) ? 1 : (cpus > MAXWORKERS) ? MAXWORKERS : cpus;
+
+  /* read the offset table and decode it once */
+  raw = (unsigned char *)malloc(table_len);
+  if (raw == NULL)
+    bailout("Out of memory");
+  cs->offsets = (u8 *)malloc(((u8)blockcount + 1) * sizeof(u8));
+  if (cs->offsets == NULL)
+    bailout("Out of memory");
+  if (get_buffer_real(section->source, section->pos + 136, table_len,
+                      raw, NULL) < table_len) {
+    print_line(level + 1, "Error reading the block offset table");
+    free(raw);
+    goto errorexit;
+  }
+  for (i = 0; i <= blockcount; i++) {
+    cs->offsets[i] = get_be_quad(raw + (u8)i * 8);
+    if (cs->offsets[i] > section->size ||
+        (i > 0 && cs->offsets[i] < cs->offsets[i - 1])) {
+      print_line(level + 1, "Error: Invalid block offset table");
+      free(raw);
+      goto errorexit;
+    }
+    cs->offsets[i] += section->pos;
+  }
+  free(raw);
+
+  return (SOURCE *)cs;
+
+errorexit:
+  close_cloop((SOURCE *)cs);
+  free(cs);
+  return NULL;
+}
+
+/*
+ * raw read: copy from the decoded blocks, decoding the ones missing
+ * in batches
+ */
+
+static u8 read_cloop(SOURCE *s, u8 pos, u8 len, void *buf)
+{
+  CLOOP_SOURCE *cs = (CLOOP_SOURCE *)s;
+  CLOOP_SLOT *slot;
+  u4 block, last;
+  u8 got, rel, n;
+
+  got = 0;
+  while (got < len) {
+    block = (u4)((pos + got) / cs->block_size);
+    if (block >= cs->block_count)
+      break;
+
+    slot = find_slot(cs, block);
+    if (slot == NULL) {
+      /* decode this one and the next ones the read needs */
+      last = (u4)((pos + len - 1) / cs->block_size);
+      if (last >= cs->block_count)
+        last = cs->block_count - 1;
+      decode_blocks(cs, block, last);
+      slot = find_slot(cs, block);
+      if (slot == NULL)
+        break;
+    }
+
+    rel = pos + got - (u8)block * cs->block_size;
+    n = cs->block_size - rel;
+    if (n > len - got)
+      n = len - got;
+    memcpy((char *)buf + got, slot->out + rel, n);
+    got += n;
+  }
+
+  return got;
+}
+
+/*
+ * prefetch: decode the blocks of a range ahead of time, a batch at a
+ * time; at most a cache full
+ */
+
+static void prefetch_cloop(SOURCE *s, u8 pos, u8 len)
+{
+  CLOOP_SOURCE *cs = (CLOOP_SOURCE *)s;
+  u4 block, last;
+
+  block = (u4)(pos / cs->block_size);
+  if (block >= cs->block_count)
+    return;
+  last = (u4)((pos + len - 1) / cs->block_size);
+  if (last >= cs->block_count)
+    last = cs->block_count - 1;
+  if (last - block >= CLOOP_CACHE_SIZE)
+    last = block + CLOOP_CACHE_SIZE - 1;
+
+  while (block <= last)
+    block = decode_blocks(cs, block, last);
+}
+
+/*
+ * look up a decoded block in the cache
+ */
+
+static CLOOP_SLOT *find_slot(CLOOP_SOURCE *cs, u4 block)
+{
+  int i;
+
+  for (i = 0; i < CLOOP_CACHE_SIZE; i++) {
+    if (cs->slots[i].used != 0 && cs->slots[i].block == block) {
+      cs->slots[i].used = ++cs->clock;
+      return &cs->slots[i];
+    }
+  }
+  return NULL;
+}
+
+/*
+ * decode up to one batch of the blocks from first to last that aren't
+ * cached yet, in parallel; returns the block to continue with
+ */
+
+static u4 decode_blocks(CLOOP_SOURCE *cs, u4 first, u4 last)
+{
+  CLOOP_JOB *job;
+  CLOOP_SLOT *slot;
+  pthread_t threads[MAXWORKERS];
+  int started[MAXWORKERS];
+  int count, i, j;
+  u4 block;
+
+  /* blocks looked at stay within half the cache, so that the batch
+     doesn't evict its own blocks */
+  if (last - first >= CLOOP_CACHE_SIZE / 2)
+    last = first + CLOOP_CACHE_SIZE / 2 - 1;
+
+  /* the compressed data is gathered here, the layers below aren't
+     thread-safe */
+  count = 0;
+  for (block = first; block <= last && count < cs->workers; block++) {
+    if (find_slot(cs, block) != NULL)
+      continue;
+
+    /* take the least recently used slot; the ones taken for this
+       batch are the most recently used */
+    slot = &cs->slots[0];
+    for (j = 1; j < CLOOP_CACHE_SIZE; j++) {
+      if (cs->slots[j].used < slot->used)
+        slot = &cs->slots[j];
+    }
+    job = &cs->jobs[count];
+    if (!gather_job(cs, job, block)) {
+      block = last + 1;
+      break;
+    }
+    if (slot->out == NULL) {
+      slot->out = (unsigned char *)malloc(cs->block_size);
+      if (slot->out == NULL)
+        bailout("Out of memory");
+    }
+    slot->block = block;
+    slot->used = ++cs->clock;
+    job->slot = slot;
+    count++;
+  }
+
+  /* decode; the first one on this thread */
+  for (i = 1; i < count; i++)
+    started[i] = (pthread_create(&threads[i], NULL, decode_job,
+                                 &cs->jobs[i]) == 0);
+  if (count > 0)
+    decode_job(&cs->jobs[0]);
+  for (i = 1; i < count; i++) {
+    if (started[i])
+      pthread_join(threads[i], NULL);
+    else
+      decode_job(&cs->jobs[i]);
+  }
+
+  /* blocks that won't decode aren't cached */
+  for (i = 0; i < count; i++) {
+    if (!cs->jobs[i].ok) {
+      error("cloop data error in block %lu", cs->jobs[i].slot->block);
+      cs->jobs[i].slot->used = 0;
+    }
+  }
+
+  return block;
 }
 
+/*
+ * copy a block's compressed data into a job slot
+ */
+
+static int gather_job(CLOOP_SOURCE *cs, CLOOP_JOB *job, u4 block)
+{
+  u8 start, len;
+
+  start = cs->offsets[block];
+  len = cs->offsets[block + 1] - start;
+  if (len == 0 || len > (u8)cs->block_size * 2 + 1024)
+    return 0;
+  if (job->raw_alloc < len) {
+    free(job->raw);
+    job->raw_alloc = len;
+    job->raw = (unsigned char *)malloc(job->raw_alloc);
+    if (job->raw == NULL)
+      bailout("Out of memory");
+  }
+  if (get_buffer_real(cs->c.foundation, start, len, job->raw, NULL) < len)
+    return 0;
+
+  job->raw_len = len;
+  job->block_size = cs->block_size;
+  job->ok = 0;
+  return 1;
+}
+
+/*
+ * decode one block; runs on worker threads
+ */
+
+static void *decode_job(void *arg)
+{
+  CLOOP_JOB *job = (CLOOP_JOB *)arg;
+  uLongf out_len;
+
+  out_len = job->block_size;
+  if (uncompress(job->slot->out, &out_len, job->raw,
+                 (uLong)job->raw_len) != Z_OK)
+    return NULL;
+  /* a short last block reads as zeros beyond its end */
+  if (out_len < job->block_size)
+    memset(job->slot->out + out_len, 0, job->block_size - out_len);
+  job->ok = 1;
+  return NULL;
+}
+
+/*
+ * cleanup
+ */
+
+static void close_cloop(SOURCE *s)
+{
+  CLOOP_SOURCE *cs = (CLOOP_SOURCE *)s;
+  int i;
+
+  for (i = 0; i < CLOOP_CACHE_SIZE; i++)
+    free(cs->slots[i].out);
+  for (i = 0; i < MAXWORKERS; i++)
+    free(cs->jobs[i].raw);
+  free(cs->offsets);
+}
+
+#endif /* USE_ZLIB */
+
 /* EOF */
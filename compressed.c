@@ -28,10 +28,52 @@
 #include "global.h"
 
 #include <signal.h>
+#include <time.h>
 #include <sys/wait.h>
 
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef USE_BZIP2
+#include <bzlib.h>
+#endif
+#ifdef USE_LZMA
+#include <lzma.h>
+/* the file info and threaded decoders are there from 5.4 on */
+#if LZMA_VERSION < 50040002
+#undef USE_LZMA
+#endif
+#endif
+
+/* random access into gzip data needs inflateGetDictionary() */
+#if defined(USE_ZLIB) && ZLIB_VERNUM >= 0x1280
+#define GZINDEX 1
+#else
+#define GZINDEX 0
+#endif
+
 #define DEBUG 0
 
+/* compression methods */
+#define METHOD_COMPRESS (0)
+#define METHOD_GZIP     (1)
+#define METHOD_BZIP2    (2)
+#define METHOD_XZ       (3)
+#define METHOD_ZSTD     (4)
+#define METHOD_LZ4      (5)
+
+/* how much compressed data the native decoders take in at a time */
+#define INWINDOW (65536)
+
+/* distance between gzip checkpoints, in uncompressed bytes; each one
+   holds a copy of the 32 KiB deflate window */
+#define SPAN (1024*1024)
+#define WINSIZE (32768)
+
+/* sidecar index files */
+#define INDEXMAGIC "DTGZIDX2"
+#define INDEXORDER (0x0102030405060708ULL)
+
 #if !defined(FD_ZERO)
 #define DECOMPRESS 0
 #warning Transparent decompression disabled, select() macros not defined
@@ -52,15 +94,75 @@ typedef struct compressed_source {
   u8 offset, write_pos, write_max;
   int write_pipe, read_pipe, nfds;
   pid_t pid;
+  time_t started;
 } COMPRESSED_SOURCE;
 #endif
 
+#if defined(USE_ZLIB) || defined(USE_BZIP2) || defined(USE_LZMA)
+#define NATIVE 1
+
+/* a place in gzip data where decoding can start over: the uncompressed
+   and compressed positions, the bits of the byte before the latter,
+   and the deflate window at that point */
+typedef struct checkpoint {
+  u8 out, in;
+  int bits, members;
+  unsigned int window_len;
+  unsigned char *window;
+} CHECKPOINT;
+
+typedef struct native_source {
+  SOURCE c;
+  int method;
+  /* compressed input: position and limit relative to offset, and the
+     window currently being decoded */
+  u8 offset, in_pos, in_max;
+  unsigned char *inbuf;
+  /* decoder state; out_pos is where the decoder is in the output,
+     decoded counts all output including what was skipped */
+  u8 out_pos, decoded;
+  time_t started;
+  int active, finished, failed, members;
+  int raw, skip;
+#ifdef USE_ZLIB
+  z_stream zs;
+#endif
+#ifdef USE_BZIP2
+  bz_stream bs;
+#endif
+#ifdef USE_LZMA
+  lzma_stream xs;
+#endif
+  /* gzip checkpoint index */
+  CHECKPOINT *points;
+  int point_count, point_alloc, point_loaded;
+  int size_loaded;
+  unsigned char *scratch;
+  char *index_path;
+  u8 fingerprint, fingerprint_len, tail_fingerprint, trailer;
+} NATIVE_SOURCE;
+
+typedef struct index_header {
+  char magic[8];
+  u8 byteorder;
+  u8 fingerprint, fingerprint_len, compressed_size;
+  u8 tail_fingerprint, trailer;   /* last 64 KiB, last CRC32 and ISIZE */
+  u8 span, count, size;   /* uncompressed size, zero if not known */
+} INDEX_HEADER;
+
+typedef struct index_entry {
+  u8 out, in, bits, members, window_len;
+} INDEX_ENTRY;
+#else
+#define NATIVE 0
+#endif
+
 /*
  * helper functions
  */
 
 static void handle_compressed(SECTION *section, int level,
-                              int off, const char *program);
+                              int off, int method, const char *program);
 
 #if DECOMPRESS
 static SOURCE *init_compressed_source(SOURCE *foundation, u8 offset, u8 size,
@@ -69,6 +171,68 @@ static u8 read_compressed(SOURCE *s, u8 pos, u8 len, void *buf);
 static void close_compressed(SOURCE *s);
 #endif
 
+#if NATIVE
+static SOURCE *init_native_source(SOURCE *foundation, u8 offset, u8 size,
+                                  int method);
+static u8 read_native(SOURCE *s, u8 pos, u8 len, void *buf);
+static u8 decode_native(NATIVE_SOURCE *ns, u8 len, unsigned char *p);
+static void skip_native(NATIVE_SOURCE *ns, u8 pos);
+static int fill_native(NATIVE_SOURCE *ns);
+static int start_native(NATIVE_SOURCE *ns);
+static void end_native(NATIVE_SOURCE *ns);
+static void close_native(SOURCE *s);
+#endif
+
+#if GZINDEX
+static void seek_gzip(NATIVE_SOURCE *ns, u8 pos);
+static int restart_gzip(NATIVE_SOURCE *ns, CHECKPOINT *cp);
+static void add_checkpoint(NATIVE_SOURCE *ns);
+static void open_index(NATIVE_SOURCE *ns);
+static void load_index(NATIVE_SOURCE *ns);
+static void save_index(NATIVE_SOURCE *ns);
+#endif
+
+/* directory for gzip index files, NULL to not keep them */
+static const char *index_dir = NULL;
+
+/* how much a compressed layer may decode, zero for no limit */
+static u8 budget_bytes = 0;
+static int budget_seconds = 0;
+
+/*
+ * option setting
+ */
+
+void set_gzip_index(const char *dir)
+{
+  index_dir = dir;
+}
+
+void set_decompress_budget(u8 bytes, int seconds)
+{
+  if (bytes > 0)
+    budget_bytes = bytes;
+  if (seconds > 0)
+    budget_seconds = seconds;
+}
+
+/*
+ * check a compressed layer against the budget; once it may not decode
+ * any more, the buffer layer is told so it can mark where the data was
+ * cut short
+ */
+
+int over_budget(SOURCE *s, u8 decoded, time_t started)
+{
+  if (s->truncated ||
+      (budget_bytes > 0 && decoded >= budget_bytes) ||
+      (budget_seconds > 0 && time(NULL) - started >= budget_seconds)) {
+    note_budget_refusal();
+    return 1;
+  }
+  return 0;
+}
+
 /*
  * compressed file detection
  */
@@ -91,7 +255,7 @@ void detect_compressed(SECTION *section, int level)
       else
         print_line(level, "compress-compressed data");
 
-      handle_compressed(section, level, off, "gzip");
+      handle_compressed(section, level, off, METHOD_COMPRESS, "gzip");
 
       break;
     }
@@ -103,7 +267,7 @@ void detect_compressed(SECTION *section, int level)
       else
         print_line(level, "gzip-compressed data");
 
-      handle_compressed(section, level, off, "gzip");
+      handle_compressed(section, level, off, METHOD_GZIP, "gzip");
 
       break;
     }
@@ -115,7 +279,43 @@ void detect_compressed(SECTION *section, int level)
       else
         print_line(level, "bzip2-compressed data");
 
-      handle_compressed(section, level, off, "bzip2");
+      handle_compressed(section, level, off, METHOD_BZIP2, "bzip2");
+
+      break;
+    }
+
+    /* xz */
+    if (memcmp(buf + off, "\xfd" "7zXZ\0", 6) == 0) {
+      if (sector > 0)
+        print_line(level, "xz-compressed data at sector %d", sector);
+      else
+        print_line(level, "xz-compressed data");
+
+      handle_compressed(section, level, off, METHOD_XZ, "xz");
+
+      break;
+    }
+
+    /* zstd */
+    if (memcmp(buf + off, "\x28\xb5\x2f\xfd", 4) == 0) {
+      if (sector > 0)
+        print_line(level, "zstd-compressed data at sector %d", sector);
+      else
+        print_line(level, "zstd-compressed data");
+
+      handle_compressed(section, level, off, METHOD_ZSTD, "zstd");
+
+      break;
+    }
+
+    /* lz4 (frame format) */
+    if (memcmp(buf + off, "\x04\x22\x4d\x18", 4) == 0) {
+      if (sector > 0)
+        print_line(level, "lz4-compressed data at sector %d", sector);
+      else
+        print_line(level, "lz4-compressed data");
+
+      handle_compressed(section, level, off, METHOD_LZ4, "lz4");
 
       break;
     }
@@ -123,23 +323,46 @@ void detect_compressed(SECTION *section, int level)
 }
 
 static void handle_compressed(SECTION *section, int level,
-                              int off, const char *program)
+                              int off, int method, const char *program)
 {
-#if DECOMPRESS
   SOURCE *s;
   u8 size;
 
-  /* create decompression data source */
+  /* create decompression data source: in-process if the library is
+     there, else through the external program */
   size = section->size;
   if (size > 0)
     size -= off;
-  s = init_compressed_source(section->source,
-                             section->pos + off, size, program);
+  s = NULL;
+#ifdef USE_BZIP2
+  /* seekable bzip2 data is decoded block by block, in parallel */
+  if (method == METHOD_BZIP2)
+    s = init_bzip2_source(section->source, section->pos + off, size);
+#endif
+#ifdef USE_LZMA
+  /* so is xz data with an index and blocks of reasonable size */
+  if (method == METHOD_XZ)
+    s = init_xz_source(section->source, section->pos + off, size);
+#endif
+#if NATIVE
+  if (s == NULL)
+    s = init_native_source(section->source, section->pos + off, size,
+                           method);
+#endif
+#if DECOMPRESS
+  if (s == NULL)
+    s = init_compressed_source(section->source,
+                               section->pos + off, size, program);
+#endif
+  if (s == NULL) {
+    print_line(level + 1, "Decompression disabled on this system");
+    return;
+  }
+
   analyze_source(s, level + 1);
+  if (s->truncated)
+    print_line(level + 1, "Analysis truncated, decompression budget used up");
   close_source(s);
-#else
-  print_line(level + 1, "Decompression disabled on this system");
-#endif
 }
 
 /*
@@ -161,6 +384,7 @@ static SOURCE *init_compressed_source(SOURCE *foundation, u8 offset, u8 size,
 
   cs->c.sequential = 1;
   cs->c.seq_pos = 0;
+  cs->c.name = "compressed";
   cs->c.foundation = foundation;
   cs->c.read_bytes = read_compressed;
   cs->c.close = close_compressed;
@@ -169,6 +393,7 @@ static SOURCE *init_compressed_source(SOURCE *foundation, u8 offset, u8 size,
   cs->offset = offset;
   cs->write_pos = 0;
   cs->write_max = size;
+  cs->started = time(NULL);
 
   /* open "gzip -dc" in a dual pipe */
   if (pipe(write_pipe) < 0)
@@ -240,6 +465,8 @@ static u8 read_compressed(SOURCE *s, u8 pos, u8 len, void *buf)
 
   if (cs->read_pipe < 0)  /* closed for reading */
     return got;
+  if (over_budget(s, s->seq_pos, cs->started))
+    return got;
 
   while (got < len) {
     result = read(cs->read_pipe, p, len - got);
@@ -373,4 +600,683 @@ static void close_compressed(SOURCE *s)
 
 #endif /* DECOMPRESS */
 
+/*
+ * in-process decompression with zlib and libbz2
+ */
+
+#if NATIVE
+
+static SOURCE *init_native_source(SOURCE *foundation, u8 offset, u8 size,
+                                  int method)
+{
+  NATIVE_SOURCE *ns;
+
+#ifndef USE_ZLIB
+  if (method == METHOD_GZIP)
+    return NULL;
+#endif
+#ifndef USE_BZIP2
+  if (method == METHOD_BZIP2)
+    return NULL;
+#endif
+#ifndef USE_LZMA
+  if (method == METHOD_XZ)
+    return NULL;
+#endif
+  if (method != METHOD_GZIP && method != METHOD_BZIP2 &&
+      method != METHOD_XZ)
+    return NULL;  /* the rest is left to the external programs */
+
+  ns = (NATIVE_SOURCE *)malloc(sizeof(NATIVE_SOURCE));
+  if (ns == NULL)
+    bailout("Out of memory");
+  memset(ns, 0, sizeof(NATIVE_SOURCE));
+  ns->inbuf = (unsigned char *)malloc(INWINDOW);
+  if (ns->inbuf == NULL)
+    bailout("Out of memory");
+
+  /* gzip data can be re-entered at checkpoints, bzip2 only read once */
+  ns->c.sequential = (method != METHOD_GZIP || !GZINDEX);
+  ns->c.seq_pos = 0;
+  if (method == METHOD_GZIP)
+    ns->c.name = "gzip";
+  else if (method == METHOD_BZIP2)
+    ns->c.name = "bzip2";
+  else
+    ns->c.name = "xz";
+  ns->c.foundation = foundation;
+  ns->c.read_bytes = read_native;
+  ns->c.close = close_native;
+  /* size is not known in advance by definition */
+
+  ns->method = method;
+  ns->offset = offset;
+  ns->in_pos = 0;
+  ns->in_max = size;
+  ns->started = time(NULL);
+
+#if GZINDEX
+  if (method == METHOD_GZIP && index_dir != NULL)
+    open_index(ns);
+#endif
+
+  return (SOURCE *)ns;
+}
+
+/*
+ * raw read: decode straight into the caller's buffer
+ */
+
+static u8 read_native(SOURCE *s, u8 pos, u8 len, void *buf)
+{
+  NATIVE_SOURCE *ns = (NATIVE_SOURCE *)s;
+
+#if GZINDEX
+  if (ns->method == METHOD_GZIP && pos != ns->out_pos)
+    seek_gzip(ns, pos);
+#endif
+  if (pos != ns->out_pos)
+    return 0;  /* past the end of the data */
+
+  return decode_native(ns, len, (unsigned char *)buf);
+}
+
+/*
+ * decode the next len bytes of output
+ */
+
+static u8 decode_native(NATIVE_SOURCE *ns, u8 len, unsigned char *p)
+{
+  unsigned int avail, before;
+  u8 got;
+  int result;
+
+  got = 0;
+  while (got < len && !ns->finished) {
+    if (over_budget(&ns->c, ns->decoded + got, ns->started))
+      break;
+    if (!ns->active && !start_native(ns))
+      break;
+    if (!fill_native(ns))
+      break;  /* no more input */
+
+    avail = (len - got > 0x40000000) ? 0x40000000 : (unsigned int)(len - got);
+    before = avail;
+#ifdef USE_ZLIB
+    if (ns->method == METHOD_GZIP) {
+      ns->zs.next_out = p + got;
+      ns->zs.avail_out = avail;
+      /* stop at block boundaries, checkpoints can only go there */
+      result = inflate(&ns->zs, GZINDEX ? Z_BLOCK : Z_NO_FLUSH);
+      got += before - ns->zs.avail_out;
+      ns->out_pos += before - ns->zs.avail_out;
+      if (result == Z_STREAM_END) {
+        /* gzip files may have several members; a restart from a
+           checkpoint has to skip this one's trailer by itself */
+        if (ns->raw)
+          ns->skip = 8;
+        end_native(ns);
+        ns->members++;
+      } else if (result != Z_OK && result != Z_BUF_ERROR) {
+        if (ns->members == 0 && !ns->failed)
+          error("gzip data error: %s",
+                ns->zs.msg != NULL ? ns->zs.msg : "unknown");
+        /* else: trailing garbage after a member, like gzip ignores it */
+        ns->finished = 1;
+        ns->failed = 1;
+      }
+#if GZINDEX
+      else if ((ns->zs.data_type & 128) && !(ns->zs.data_type & 64))
+        add_checkpoint(ns);
+#endif
+    }
+#endif
+#ifdef USE_BZIP2
+    if (ns->method == METHOD_BZIP2) {
+      ns->bs.next_out = (char *)p + got;
+      ns->bs.avail_out = avail;
+      result = BZ2_bzDecompress(&ns->bs);
+      got += before - ns->bs.avail_out;
+      ns->out_pos += before - ns->bs.avail_out;
+      if (result == BZ_STREAM_END) {
+        /* concatenated streams, as written by pbzip2 */
+        end_native(ns);
+        ns->members++;
+      } else if (result != BZ_OK) {
+        if (ns->members == 0)
+          error("bzip2 data error %d", result);
+        ns->finished = 1;
+        ns->failed = 1;
+      }
+    }
+#endif
+#ifdef USE_LZMA
+    if (ns->method == METHOD_XZ) {
+      ns->xs.next_out = p + got;
+      ns->xs.avail_out = avail;
+      result = lzma_code(&ns->xs, LZMA_RUN);
+      got += before - ns->xs.avail_out;
+      ns->out_pos += before - ns->xs.avail_out;
+      if (result == LZMA_STREAM_END) {
+        end_native(ns);
+        ns->finished = 1;
+      } else if (result != LZMA_OK) {
+        if (!ns->failed)
+          error("xz data error %d", (int)result);
+        ns->finished = 1;
+        ns->failed = 1;
+      }
+    }
+#endif
+  }
+
+  ns->decoded += got;
+  if (ns->finished && got < len) {
+    /* remember size for buffer layer */
+    ns->c.size_known = 1;
+    ns->c.size = ns->out_pos;
+  }
+  return got;
+}
+
+/*
+ * make sure there is compressed input to decode, returns zero at its end
+ */
+
+static int fill_native(NATIVE_SOURCE *ns)
+{
+  u8 askfor, fill;
+
+#ifdef USE_ZLIB
+  if (ns->method == METHOD_GZIP && ns->zs.avail_in > 0)
+    return 1;
+#endif
+#ifdef USE_BZIP2
+  if (ns->method == METHOD_BZIP2 && ns->bs.avail_in > 0)
+    return 1;
+#endif
+#ifdef USE_LZMA
+  if (ns->method == METHOD_XZ && ns->xs.avail_in > 0)
+    return 1;
+#endif
+
+  /* get data from lower layer, copied because the decoder keeps
+     pointing into it across calls */
+  askfor = INWINDOW;
+  if (ns->in_max && ns->in_pos + askfor > ns->in_max)
+    askfor = ns->in_max - ns->in_pos;
+  fill = 0;
+  if (askfor > 0)
+    fill = get_buffer_real(ns->c.foundation, ns->offset + ns->in_pos, askfor,
+                           ns->inbuf, NULL);
+  if (fill == 0) {
+    /* end of compressed input */
+    ns->finished = 1;
+    return 0;
+  }
+  ns->in_pos += fill;
+#ifdef USE_ZLIB
+  if (ns->method == METHOD_GZIP) {
+    ns->zs.next_in = ns->inbuf;
+    ns->zs.avail_in = (unsigned int)fill;
+  }
+#endif
+#ifdef USE_BZIP2
+  if (ns->method == METHOD_BZIP2) {
+    ns->bs.next_in = (char *)ns->inbuf;
+    ns->bs.avail_in = (unsigned int)fill;
+  }
+#endif
+#ifdef USE_LZMA
+  if (ns->method == METHOD_XZ) {
+    ns->xs.next_in = ns->inbuf;
+    ns->xs.avail_in = (size_t)fill;
+  }
+#endif
+  return 1;
+}
+
+/*
+ * start decoding a (new) stream, keeping any input left over
+ */
+
+static int start_native(NATIVE_SOURCE *ns)
+{
+  int result = -1;
+
+#ifdef USE_ZLIB
+  if (ns->method == METHOD_GZIP) {
+    /* drop the trailer of a member entered at a checkpoint */
+    while (ns->skip > 0) {
+      if (!fill_native(ns))
+        return 0;
+      if ((unsigned int)ns->skip > ns->zs.avail_in) {
+        ns->skip -= ns->zs.avail_in;
+        ns->zs.avail_in = 0;
+      } else {
+        ns->zs.next_in += ns->skip;
+        ns->zs.avail_in -= ns->skip;
+        ns->skip = 0;
+      }
+    }
+
+    ns->zs.zalloc = Z_NULL;
+    ns->zs.zfree = Z_NULL;
+    ns->zs.opaque = Z_NULL;
+    /* 16: gzip header and trailer */
+    result = (inflateInit2(&ns->zs, 15 + 16) == Z_OK) ? 0 : -1;
+    ns->raw = 0;
+  }
+#endif
+#ifdef USE_BZIP2
+  if (ns->method == METHOD_BZIP2) {
+    ns->bs.bzalloc = NULL;
+    ns->bs.bzfree = NULL;
+    ns->bs.opaque = NULL;
+    result = (BZ2_bzDecompressInit(&ns->bs, 0, 0) == BZ_OK) ? 0 : -1;
+  }
+#endif
+#ifdef USE_LZMA
+  if (ns->method == METHOD_XZ) {
+    lzma_mt mt;
+
+    /* streamed data, so let liblzma's threads decode the blocks in
+       parallel as they go by */
+    memset(&mt, 0, sizeof(mt));
+    mt.flags = LZMA_CONCATENATED;
+    mt.threads = lzma_cputhreads();
+    if (mt.threads == 0)
+      mt.threads = 1;
+    mt.memlimit_threading = 256 * 1024 * 1024;
+    mt.memlimit_stop = UINT64_MAX;
+    memset(&ns->xs, 0, sizeof(ns->xs));
+    result = (lzma_stream_decoder_mt(&ns->xs, &mt) == LZMA_OK) ? 0 : -1;
+  }
+#endif
+
+  if (result < 0) {
+    error("Can't initialize decompression");
+    ns->finished = 1;
+    return 0;
+  }
+  ns->active = 1;
+  return 1;
+}
+
+static void end_native(NATIVE_SOURCE *ns)
+{
+  unsigned char *next_in = NULL;
+  unsigned int avail_in = 0;
+
+  if (!ns->active)
+    return;
+#ifdef USE_ZLIB
+  if (ns->method == METHOD_GZIP) {
+    next_in = ns->zs.next_in;
+    avail_in = ns->zs.avail_in;
+    inflateEnd(&ns->zs);
+    /* the next stream starts with the input that's left */
+    ns->zs.next_in = next_in;
+    ns->zs.avail_in = avail_in;
+  }
+#endif
+#ifdef USE_BZIP2
+  if (ns->method == METHOD_BZIP2) {
+    next_in = (unsigned char *)ns->bs.next_in;
+    avail_in = ns->bs.avail_in;
+    BZ2_bzDecompressEnd(&ns->bs);
+    ns->bs.next_in = (char *)next_in;
+    ns->bs.avail_in = avail_in;
+  }
+#endif
+#ifdef USE_LZMA
+  if (ns->method == METHOD_XZ) {
+    lzma_end(&ns->xs);
+  }
+#endif
+  ns->active = 0;
+}
+
+/*
+ * close cleanup
+ */
+
+static void close_native(SOURCE *s)
+{
+  NATIVE_SOURCE *ns = (NATIVE_SOURCE *)s;
+  int i;
+
+#if GZINDEX
+  if (ns->index_path != NULL)
+    save_index(ns);
+#endif
+
+  end_native(ns);
+  for (i = 0; i < ns->point_count; i++)
+    free(ns->points[i].window);
+  free(ns->points);
+  free(ns->scratch);
+  free(ns->index_path);
+  free(ns->inbuf);
+}
+
+/*
+ * decode up to pos, into the scratch buffer
+ */
+
+static void skip_native(NATIVE_SOURCE *ns, u8 pos)
+{
+  u8 toskip;
+
+  if (ns->out_pos < pos && ns->scratch == NULL) {
+    ns->scratch = (unsigned char *)malloc(INWINDOW);
+    if (ns->scratch == NULL)
+      bailout("Out of memory");
+  }
+  while (ns->out_pos < pos) {
+    toskip = pos - ns->out_pos;
+    if (toskip > INWINDOW)
+      toskip = INWINDOW;
+    if (decode_native(ns, toskip, ns->scratch) < toskip)
+      break;
+  }
+}
+
+#endif /* NATIVE */
+
+/*
+ * random access into gzip data
+ */
+
+#if GZINDEX
+
+/*
+ * move the decoder to pos, from the best checkpoint if that helps
+ */
+
+static void seek_gzip(NATIVE_SOURCE *ns, u8 pos)
+{
+  CHECKPOINT *cp;
+  int lo, hi, mid;
+
+  /* find the last checkpoint at or before pos */
+  cp = NULL;
+  lo = 0;
+  hi = ns->point_count;
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (ns->points[mid].out <= pos)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo > 0)
+    cp = &ns->points[lo - 1];
+
+  /* go back, or jump ahead if that's shorter than decoding on */
+  if (pos < ns->out_pos || (cp != NULL && cp->out > ns->out_pos)) {
+    if (!restart_gzip(ns, cp))
+      return;
+  }
+
+  skip_native(ns, pos);
+}
+
+/*
+ * reset the decoder to a checkpoint, or to the start if there's none
+ */
+
+static int restart_gzip(NATIVE_SOURCE *ns, CHECKPOINT *cp)
+{
+  unsigned char byte;
+
+  end_native(ns);
+  ns->zs.avail_in = 0;
+  ns->finished = 0;
+  ns->skip = 0;
+
+  if (cp == NULL) {
+    ns->in_pos = 0;
+    ns->out_pos = 0;
+    ns->members = 0;
+    return 1;  /* the next read starts a fresh member */
+  }
+
+  ns->in_pos = cp->in;
+  ns->out_pos = cp->out;
+  ns->members = cp->members;
+
+  ns->zs.zalloc = Z_NULL;
+  ns->zs.zfree = Z_NULL;
+  ns->zs.opaque = Z_NULL;
+  if (inflateInit2(&ns->zs, -15) != Z_OK) {
+    error("Can't initialize decompression");
+    ns->finished = 1;
+    return 0;
+  }
+  ns->active = 1;
+  ns->raw = 1;
+
+  /* the checkpoint may be in the middle of a byte */
+  if (cp->bits) {
+    if (get_buffer_real(ns->c.foundation, ns->offset + cp->in - 1, 1,
+                        &byte, NULL) < 1) {
+      ns->finished = 1;
+      return 0;
+    }
+    inflatePrime(&ns->zs, cp->bits, byte >> (8 - cp->bits));
+  }
+  if (cp->window_len > 0)
+    inflateSetDictionary(&ns->zs, cp->window, cp->window_len);
+
+  return 1;
+}
+
+/*
+ * remember the decoder's state at a block boundary, at most every SPAN
+ */
+
+static void add_checkpoint(NATIVE_SOURCE *ns)
+{
+  CHECKPOINT *cp;
+  u8 last;
+
+  last = (ns->point_count > 0) ? ns->points[ns->point_count - 1].out : 0;
+  if (ns->out_pos < last + SPAN)
+    return;
+
+  if (ns->point_count >= ns->point_alloc) {
+    ns->point_alloc = ns->point_alloc ? ns->point_alloc * 2 : 16;
+    ns->points = (CHECKPOINT *)realloc(ns->points,
+                                       ns->point_alloc * sizeof(CHECKPOINT));
+    if (ns->points == NULL)
+      bailout("Out of memory");
+  }
+  cp = &ns->points[ns->point_count];
+  cp->window = (unsigned char *)malloc(WINSIZE);
+  if (cp->window == NULL)
+    bailout("Out of memory");
+  cp->window_len = WINSIZE;
+  if (inflateGetDictionary(&ns->zs, cp->window, &cp->window_len) != Z_OK) {
+    free(cp->window);
+    return;
+  }
+
+  cp->out = ns->out_pos;
+  cp->in = ns->in_pos - ns->zs.avail_in;
+  cp->bits = ns->zs.data_type & 7;
+  cp->members = ns->members;
+  ns->point_count++;
+}
+
+/*
+ * sidecar index files, named after checksums of the compressed data's
+ * start and end so they're found again wherever the data sits; the end
+ * holds the gzip trailer, which covers all of the data
+ */
+
+static void open_index(NATIVE_SOURCE *ns)
+{
+  u8 fill, tail;
+  size_t len;
+
+  /* without the size there's no trailer to go by */
+  if (ns->in_max < 8)
+    return;
+
+  fill = INWINDOW;
+  if (fill > ns->in_max)
+    fill = ns->in_max;
+  if (get_buffer_real(ns->c.foundation, ns->offset, fill, ns->inbuf,
+                      NULL) < fill)
+    return;
+  ns->fingerprint = crc32(0L, ns->inbuf, (uInt)fill);
+  ns->fingerprint_len = fill;
+
+  tail = ns->in_max - fill;
+  if (get_buffer_real(ns->c.foundation, ns->offset + tail, fill, ns->inbuf,
+                      NULL) < fill)
+    return;
+  ns->tail_fingerprint = crc32(0L, ns->inbuf, (uInt)fill);
+  ns->trailer = ((u8)get_le_long(ns->inbuf + fill - 8) << 32) |
+    get_le_long(ns->inbuf + fill - 4);
+
+  len = strlen(index_dir) + 64;
+  ns->index_path = (char *)malloc(len);
+  if (ns->index_path == NULL)
+    bailout("Out of memory");
+  sprintf(ns->index_path, "%s/%08llx-%08llx-%llx.gzidx", index_dir,
+          ns->fingerprint, ns->tail_fingerprint, ns->in_max);
+
+  load_index(ns);
+}
+
+static void load_index(NATIVE_SOURCE *ns)
+{
+  FILE *f;
+  INDEX_HEADER header;
+  INDEX_ENTRY entry;
+  CHECKPOINT *cp;
+  u8 i, last;
+
+  f = fopen(ns->index_path, "rb");
+  if (f == NULL)
+    return;  /* not there yet */
+
+  if (fread(&header, sizeof(header), 1, f) != 1 ||
+      memcmp(header.magic, INDEXMAGIC, 8) != 0 ||
+      header.byteorder != INDEXORDER ||
+      header.fingerprint != ns->fingerprint ||
+      header.fingerprint_len != ns->fingerprint_len ||
+      header.compressed_size != ns->in_max ||
+      header.tail_fingerprint != ns->tail_fingerprint ||
+      header.trailer != ns->trailer ||
+      header.count > 0x1000000) {
+    fclose(f);
+    return;  /* not ours, will be overwritten */
+  }
+
+  ns->points = (CHECKPOINT *)malloc((header.count + 1) * sizeof(CHECKPOINT));
+  if (ns->points == NULL)
+    bailout("Out of memory");
+  ns->point_alloc = (int)header.count + 1;
+
+  last = 0;
+  for (i = 0; i < header.count; i++) {
+    if (fread(&entry, sizeof(entry), 1, f) != 1 ||
+        entry.out <= last || entry.bits > 7 || entry.window_len > WINSIZE)
+      break;
+    cp = &ns->points[ns->point_count];
+    cp->out = entry.out;
+    cp->in = entry.in;
+    cp->bits = (int)entry.bits;
+    cp->members = (int)entry.members;
+    cp->window_len = (unsigned int)entry.window_len;
+    cp->window = (unsigned char *)malloc(WINSIZE);
+    if (cp->window == NULL)
+      bailout("Out of memory");
+    if (cp->window_len > 0 &&
+        fread(cp->window, cp->window_len, 1, f) != 1) {
+      free(cp->window);
+      break;
+    }
+    ns->point_count++;
+    last = entry.out;
+  }
+  ns->point_loaded = ns->point_count;
+
+  if (i == header.count && header.size > 0) {
+    /* complete file, so we know the size up front */
+    ns->c.size_known = 1;
+    ns->c.size = header.size;
+    ns->size_loaded = 1;
+  }
+
+  fclose(f);
+}
+
+static void save_index(NATIVE_SOURCE *ns)
+{
+  FILE *f;
+  INDEX_HEADER header;
+  INDEX_ENTRY entry;
+  CHECKPOINT *cp;
+  char *tmp_path;
+  int i, size_known;
+
+  /* only write when we learned something new */
+  size_known = (ns->c.size_known && ns->finished && !ns->failed);
+  if (ns->point_count == ns->point_loaded &&
+      (ns->size_loaded || !size_known))
+    return;
+
+  tmp_path = (char *)malloc(strlen(ns->index_path) + 5);
+  if (tmp_path == NULL)
+    bailout("Out of memory");
+  sprintf(tmp_path, "%s.tmp", ns->index_path);
+
+  f = fopen(tmp_path, "wb");
+  if (f == NULL) {
+    errore("Can't write %.300s", tmp_path);
+    free(tmp_path);
+    return;
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, INDEXMAGIC, 8);
+  header.byteorder = INDEXORDER;
+  header.fingerprint = ns->fingerprint;
+  header.fingerprint_len = ns->fingerprint_len;
+  header.compressed_size = ns->in_max;
+  header.tail_fingerprint = ns->tail_fingerprint;
+  header.trailer = ns->trailer;
+  header.span = SPAN;
+  header.count = ns->point_count;
+  header.size = (size_known || ns->size_loaded) ? ns->c.size : 0;
+  fwrite(&header, sizeof(header), 1, f);
+
+  for (i = 0; i < ns->point_count; i++) {
+    cp = &ns->points[i];
+    entry.out = cp->out;
+    entry.in = cp->in;
+    entry.bits = cp->bits;
+    entry.members = cp->members;
+    entry.window_len = cp->window_len;
+    fwrite(&entry, sizeof(entry), 1, f);
+    if (cp->window_len > 0)
+      fwrite(cp->window, cp->window_len, 1, f);
+  }
+
+  if (ferror(f) | fclose(f)) {
+    errore("Can't write %.300s", tmp_path);
+    unlink(tmp_path);
+  } else if (rename(tmp_path, ns->index_path) < 0) {
+    errore("Can't rename %.300s", tmp_path);
+    unlink(tmp_path);
+  }
+  free(tmp_path);
+}
+
+#endif /* GZINDEX */
+
 /* EOF */
@@ -95,9 +95,25 @@ void detect_cdimage(SECTION *section, int level);
 /* in vpc.c */
 void detect_vhd(SECTION *section, int level);
 
+/* in vhdx.c */
+void detect_vhdx(SECTION *section, int level);
+
+/* in vdi.c */
+void detect_vdi(SECTION *section, int level);
+
+/* in qcow.c */
+void detect_qcow(SECTION *section, int level);
+
+/* in vmdk.c */
+void detect_vmdk(SECTION *section, int level);
+
 /* in cloop.c */
 void detect_cloop(SECTION *section, int level);
 
+/* in android.c */
+void detect_android_sparse(SECTION *section, int level);
+void detect_android_super(SECTION *section, int level);
+
 /* in archives.c */
 void detect_archive(SECTION *section, int level);
 
@@ -111,8 +127,13 @@ void detect_blank(SECTION *section, int level);
 DETECTOR detectors[] = {
   /* 1: disk image formats */
   detect_vhd,               /* may stop */
+  detect_vhdx,              /* may stop */
+  detect_vdi,               /* may stop */
+  detect_qcow,              /* may stop */
+  detect_vmdk,              /* may stop */
   detect_cdimage,           /* may stop */
-  detect_cloop,
+  detect_android_sparse,    /* may stop */
+  detect_cloop,             /* may stop */
   detect_udif,
   /* 2: boot code */
   detect_linux_loader,
@@ -128,6 +149,7 @@ DETECTOR detectors[] = {
   detect_atari_partmap,
   detect_dos_partmap,
   detect_gpt_partmap,
+  detect_android_super,
   /* 4: file systems */
   detect_amiga_fs,
   detect_apple_volume,
@@ -162,11 +184,43 @@ DETECTOR detectors[] = {
  NULL };
 
 
+/*
+ * probe plan: the fixed places the detectors above look at first,
+ * relative to the start of the section (negative: to its end)
+ */
+
+typedef struct probe {
+  s8 pos;
+  u8 len;
+} PROBE;
+
+static PROBE probes[] = {
+  /* vhd, vhdx, vdi, qcow, vmdk, cdimage, sparse, cloop, boot codes,
+     partition tables, most file system superblocks, swap, lvm, archives,
+     compressed */
+  {  0, 8192 },
+  /* reiser (old), ufs, hfs, sysv, vxfs */
+  {  8192, 1536 },
+  /* iso, udf, jfs */
+  {  32768, 16384 },
+  /* cdrom misc, btrfs, reiser (new), reiser4, ufs */
+  {  65536, 8192 },
+  /* ufs */
+  {  262144, 1536 },
+  /* vhd, udif, linux raid */
+  { -131072, 131072 },
+ { 0, 0 } };
+
+/* probes closer than this are read as one piece */
+#define MERGEGAP (32768)
+
 /*
  * internal stuff
  */
 
 static void detect(SECTION *section, int level);
+static void prefetch_probes(SECTION *section);
+static int compare_ranges(const void *a, const void *b);
 
 static int stop_flag = 0;
 
@@ -241,14 +295,95 @@ void analyze_recursive(SECTION *section, int level,
 
 static void detect(SECTION *section, int level)
 {
+  unsigned char *buf;
+  u8 len, got;
   int i;
 
-  /* run the modularized detectors */
-  for (i = 0; detectors[i] && !stop_flag; i++)
+  /* read what the detectors will look at in one go */
+  prefetch_probes(section);
+
+  /* a section the decompression budget didn't reach would look empty */
+  len = (section->size > 0 && section->size < 4096) ? section->size : 4096;
+  got = get_buffer(section, 0, len, (void **)&buf);
+  if (got < len && beyond_budget(section, 0, len)) {
+    if (got == 0) {
+      print_line(level, "Not analyzed, beyond decompression budget");
+      return;
+    }
+    print_line(level, "Partly beyond decompression budget");
+  }
+
+  /* run the modularized detectors, each in its own cache scope */
+  for (i = 0; detectors[i] && !stop_flag; i++) {
+    cache_enter_scope();
     (*detectors[i])(section, level);
+    cache_leave_scope();
+  }
   stop_flag = 0;
 }
 
+/*
+ * read the probe plan for a section, merging nearby probes
+ */
+
+static void prefetch_probes(SECTION *section)
+{
+  u8 ranges[sizeof(probes) / sizeof(PROBE)][2];
+  u8 start, end;
+  int i, count;
+
+  if (section->source->sequential)
+    return;
+
+  /* resolve the probes against the section */
+  count = 0;
+  for (i = 0; probes[i].len; i++) {
+    if (probes[i].pos >= 0) {
+      start = probes[i].pos;
+    } else {
+      /* the size must be known, and exceed the probe area */
+      if (section->size < (u8)-probes[i].pos)
+        continue;
+      start = section->size + probes[i].pos;
+    }
+    end = start + probes[i].len;
+    if (section->size) {
+      if (start >= section->size)
+        continue;
+      if (end > section->size)
+        end = section->size;
+    }
+    ranges[count][0] = start;
+    ranges[count][1] = end;
+    count++;
+  }
+  if (count == 0)
+    return;
+
+  /* sort and merge */
+  qsort(ranges, count, sizeof(ranges[0]), compare_ranges);
+  start = ranges[0][0];
+  end = ranges[0][1];
+  for (i = 1; i < count; i++) {
+    if (ranges[i][0] <= end + MERGEGAP) {
+      if (ranges[i][1] > end)
+        end = ranges[i][1];
+      continue;
+    }
+    prefetch_buffer(section->source, section->pos + start, end - start);
+    start = ranges[i][0];
+    end = ranges[i][1];
+  }
+  prefetch_buffer(section->source, section->pos + start, end - start);
+}
+
+static int compare_ranges(const void *a, const void *b)
+{
+  u8 pa = ((const u8 *)a)[0], pb = ((const u8 *)b)[0];
+
+  return (pa < pb) ? -1 : (pa > pb) ? 1 : 0;
+}
+
 /*
  * break the detection loop
  */
@@ -401,8 +401,12 @@ void detect_gpt_partmap(SECTION *section, int level)
     /* get entries */
     last_unused = 0;
     for (i = 0; i < partmap_count; i++) {
-      if (get_buffer(section, (partmap_start * blocksize) + i * partmap_entry_size, partmap_entry_size, (void **)&buf) < partmap_entry_size)
+      if (get_buffer(section, (partmap_start * blocksize) + i * partmap_entry_size, partmap_entry_size, (void **)&buf) < partmap_entry_size) {
+        if (beyond_budget(section, (partmap_start * blocksize) + i * partmap_entry_size, partmap_entry_size))
+          print_line(level, "Partition %d: beyond decompression budget",
+                     i+1);
         return;
+      }
 
       if (memcmp(buf, "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", 16) == 0) {
         if (last_unused == 0)
@@ -25,14 +25,38 @@
  * SOFTWARE. 
  */
 
+#ifdef USE_IOCTL_LINUX
+#define _GNU_SOURCE  /* for O_DIRECT */
+#endif
+
 #include "global.h"
 
 #define USE_BINARY_SEARCH 0
 #define DEBUG_SIZE 0
 
+#if defined(USE_MMAP) || defined(USE_IO_URING)
+#include <sys/mman.h>
+#endif
+
+#ifdef USE_PREADV
+#include <sys/uio.h>
+/* the number of buffers handed to one preadv() call */
+#define MAXIOV (64)
+#endif
+
+#ifdef USE_IO_URING
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+/* the size of the submission queue, i.e. reads in flight */
+#define URING_ENTRIES (64)
+#endif
+
 #ifdef USE_IOCTL_LINUX
 #include <sys/ioctl.h>
 #include <linux/fs.h>
+#ifdef O_DIRECT
+#define USE_DIRECT_IO
+#endif
 #endif
 
 #ifdef USE_IOCTL_FREEBSD
@@ -48,11 +72,41 @@
  * types
  */
 
+#ifdef USE_IO_URING
+typedef struct uring {
+  int fd;
+  unsigned entries;
+  /* the mapped rings */
+  void *sq_ptr, *cq_ptr;
+  size_t sq_size, cq_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  /* pointers into the rings */
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+} URING;
+#endif
+
 typedef struct file_source {
   SOURCE c;
   int fd;
+  /* in direct mode: the alignment the device requires (logical sector
+     size), and the unit unaligned requests are read in (physical
+     sector size); both zero otherwise */
+  u4 align, blocksize;
+#ifdef USE_IO_URING
+  URING *ring;
+#endif
 } FILE_SOURCE;
 
+typedef struct split_source {
+  SOURCE c;
+  int count;
+  int *fds;
+  u8 *starts;        /* count + 1 entries, the last is the total size */
+} SPLIT_SOURCE;
+
 /*
  * helper functions
  */
@@ -61,12 +115,76 @@ static void determine_file_size(FILE_SOURCE *fs, int filekind);
 
 static int analyze_file(SOURCE *s, int level);
 static u8 read_file(SOURCE *s, u8 pos, u8 len, void *buf);
+static u8 read_file_raw(SOURCE *s, u8 pos, u8 len, void *buf);
+static u8 read_fd(int fd, int seek, u8 pos, u8 len, void *buf);
+#ifdef USE_DIRECT_IO
+static void enable_direct(FILE_SOURCE *fs);
+static u8 read_file_bounce(SOURCE *s, u8 pos, u8 len, void *buf);
+#endif
+#ifdef USE_PREADV
+static u8 read_file_scatter(SOURCE *s, u8 pos, u8 len,
+                            void **bufs, int bufsize);
+#endif
 static void close_file(SOURCE *s);
+static u8 read_split(SOURCE *s, u8 pos, u8 len, void *buf);
+static void close_split(SOURCE *s);
+
+#ifdef USE_MMAP
+static void map_file(FILE_SOURCE *fs);
+static void prefetch_mapped(SOURCE *s, u8 pos, u8 len);
+#endif
+
+#ifdef USE_IO_URING
+static void read_file_batch(SOURCE *s, IOREQ *reqs, int count);
+static URING * uring_setup(unsigned entries);
+static void uring_close(URING *ring);
+#endif
 
 #if USE_BINARY_SEARCH
 static int check_position(int fd, u8 pos);
 #endif
 
+/*
+ * global state
+ */
+
+#ifdef USE_IO_URING
+static int use_uring = 0;
+#endif
+static int use_mmap = 0;
+#ifdef USE_DIRECT_IO
+static int use_direct = 0;
+#endif
+
+/*
+ * select the I/O backend for seekable files
+ */
+
+void set_file_uring(int enable)
+{
+#ifdef USE_IO_URING
+  use_uring = enable;
+#else
+  if (enable)
+    error("io_uring support is not compiled in, using normal reads");
+#endif
+}
+
+void set_file_mmap(int enable)
+{
+  use_mmap = enable;
+}
+
+void set_file_direct(int enable)
+{
+#ifdef USE_DIRECT_IO
+  use_direct = enable;
+#else
+  if (enable)
+    error("Direct I/O is not supported here, using normal reads");
+#endif
+}
+
 /*
  * initialize the file source
  */
@@ -84,13 +202,41 @@ SOURCE *init_file_source(int fd, int filekind)
     fs->c.sequential = 1;
   else if (filekind != 0)  /* special treatment hook for devices */
     fs->c.analyze = analyze_file;
+  fs->c.name = "file";
   fs->c.read_bytes = read_file;
+#ifdef USE_PREADV
+  if (!fs->c.sequential)
+    fs->c.read_scatter = read_file_scatter;
+#endif
   fs->c.close = close_file;
   fs->fd = fd;
 
   if (!fs->c.sequential)
     determine_file_size(fs, filekind);
 
+#ifdef USE_DIRECT_IO
+  /* bypass the page cache for block devices if asked to */
+  if (use_direct && filekind == 1)
+    enable_direct(fs);
+#endif
+
+#ifdef USE_MMAP
+  /* regular files are mapped and read without copies if asked to;
+     devices never are, a read error on a mapping would kill us with
+     SIGBUS, and so would a file that shrinks while we look at it */
+  if (use_mmap && filekind == 0)
+    map_file(fs);
+#endif
+
+#ifdef USE_IO_URING
+  /* batched reads through io_uring, falls back if the kernel says no */
+  if (use_uring && !fs->c.sequential) {
+    fs->ring = uring_setup(URING_ENTRIES);
+    if (fs->ring != NULL)
+      fs->c.read_batch = read_file_batch;
+  }
+#endif
+
   return (SOURCE *)fs;
 }
 
@@ -260,15 +406,32 @@ static int analyze_file(SOURCE *s, int level)
  */
 
 static u8 read_file(SOURCE *s, u8 pos, u8 len, void *buf)
+{
+#ifdef USE_DIRECT_IO
+  u4 align = ((FILE_SOURCE *)s)->align;
+
+  /* direct I/O needs aligned positions, lengths and buffers */
+  if (align && ((pos | len | (unsigned long)buf) & (align - 1)))
+    return read_file_bounce(s, pos, len, buf);
+#endif
+
+  return read_file_raw(s, pos, len, buf);
+}
+
+static u8 read_file_raw(SOURCE *s, u8 pos, u8 len, void *buf)
+{
+  return read_fd(((FILE_SOURCE *)s)->fd, !s->sequential, pos, len, buf);
+}
+
+static u8 read_fd(int fd, int seek, u8 pos, u8 len, void *buf)
 {
   off_t result_seek;
   ssize_t result_read;
   char *p;
   u8 got;
-  int fd = ((FILE_SOURCE *)s)->fd;
 
   /* seek to the requested position (unless we're a pipe) */
-  if (!s->sequential) {
+  if (seek) {
     result_seek = lseek(fd, pos, SEEK_SET);
     if (result_seek != pos) {
       errore("Seek to %llu failed", pos);
@@ -299,6 +462,314 @@ static u8 read_file(SOURCE *s, u8 pos, u8 len, void *buf)
   return got;
 }
 
+/*
+ * direct I/O on block devices
+ */
+
+#ifdef USE_DIRECT_IO
+static void enable_direct(FILE_SOURCE *fs)
+{
+  int flags, logical;
+  unsigned int physical;
+
+  /* find out the sector sizes */
+  if (ioctl(fs->fd, BLKSSZGET, &logical) < 0 || logical <= 0)
+    logical = 512;
+  physical = logical;
+#ifdef BLKPBSZGET
+  if (ioctl(fs->fd, BLKPBSZGET, &physical) < 0 ||
+      physical < (unsigned int)logical)
+    physical = logical;
+#endif
+  if ((logical & (logical - 1)) != 0 || (physical & (physical - 1)) != 0)
+    return;  /* odd sizes, don't risk it */
+
+  flags = fcntl(fs->fd, F_GETFL);
+  if (flags < 0 || fcntl(fs->fd, F_SETFL, flags | O_DIRECT) < 0) {
+    errore("Can't enable direct I/O, using normal reads");
+    return;
+  }
+  fs->align = logical;
+  fs->blocksize = physical;
+}
+
+static u8 read_file_bounce(SOURCE *s, u8 pos, u8 len, void *buf)
+{
+  FILE_SOURCE *fs = (FILE_SOURCE *)s;
+  u8 start, end, got;
+  char *mem, *bounce;
+
+  /* read whole physical sectors into an aligned buffer */
+  start = pos & ~(u8)(fs->blocksize - 1);
+  end = (pos + len + fs->blocksize - 1) & ~(u8)(fs->blocksize - 1);
+  mem = (char *)malloc((size_t)(end - start) + fs->blocksize);
+  if (mem == NULL) {
+    error("Out of memory, still going");
+    return 0;
+  }
+  bounce = mem +
+    ((fs->blocksize - ((unsigned long)mem & (fs->blocksize - 1))) &
+     (fs->blocksize - 1));
+
+  got = read_file_raw(s, start, end - start, bounce);
+  if (got > pos - start) {
+    got = got - (pos - start);
+    if (got > len)
+      got = len;
+    memcpy(buf, bounce + (pos - start), got);
+  } else {
+    got = 0;
+  }
+
+  free(mem);
+  return got;
+}
+#endif
+
+/*
+ * vectored read into several buffers of bufsize bytes each
+ */
+
+#ifdef USE_PREADV
+static u8 read_file_scatter(SOURCE *s, u8 pos, u8 len,
+                            void **bufs, int bufsize)
+{
+  struct iovec iov[MAXIOV];
+  ssize_t result_read;
+  u8 got, want;
+  int i, first, count;
+  int fd = ((FILE_SOURCE *)s)->fd;
+
+#ifdef USE_DIRECT_IO
+  if (((FILE_SOURCE *)s)->align &&
+      ((pos | len | bufsize) & (((FILE_SOURCE *)s)->align - 1))) {
+    /* unaligned, let read_file() sort it out buffer by buffer */
+    for (got = 0, i = 0; got < len; got += want, i++) {
+      want = (len - got < bufsize) ? len - got : bufsize;
+      if (read_file(s, pos + got, want, bufs[i]) < want)
+        return got;
+    }
+    return got;
+  }
+#endif
+
+  got = 0;
+  while (got < len) {
+    /* set up the buffers for the next batch, got is buffer-aligned here */
+    first = got / bufsize;
+    want = 0;
+    for (count = 0; count < MAXIOV && got + want < len; count++) {
+      iov[count].iov_base = bufs[first + count];
+      iov[count].iov_len = (len - got - want < bufsize) ?
+        len - got - want : bufsize;
+      want += iov[count].iov_len;
+    }
+
+    /* read until the batch is full */
+    i = 0;
+    while (i < count) {
+      result_read = preadv(fd, iov + i, count - i, pos + got);
+      if (result_read < 0) {
+        if (errno == EINTR || errno == EAGAIN)
+          continue;
+        errore("Data read failed at position %llu", pos + got);
+        return got;
+      } else if (result_read == 0) {
+        /* simple EOF, no message */
+        return got;
+      }
+      got += result_read;
+      /* skip the buffers that were filled */
+      while (result_read > 0) {
+        if ((size_t)result_read >= iov[i].iov_len) {
+          result_read -= iov[i].iov_len;
+          i++;
+        } else {
+          iov[i].iov_base = (char *)iov[i].iov_base + result_read;
+          iov[i].iov_len -= result_read;
+          result_read = 0;
+        }
+      }
+    }
+  }
+
+  return got;
+}
+#endif
+
+/*
+ * memory-mapped access for regular files
+ */
+
+#ifdef USE_MMAP
+static void map_file(FILE_SOURCE *fs)
+{
+  void *map;
+
+  if (!fs->c.size_known || fs->c.size == 0 ||
+      fs->c.size != (u8)(size_t)fs->c.size)
+    return;  /* nothing to map, or too large for the address space */
+
+  map = mmap(NULL, (size_t)fs->c.size, PROT_READ, MAP_SHARED, fs->fd, 0);
+  if (map == MAP_FAILED)
+    return;  /* not supported here, use read() */
+
+  /* detectors jump around, prefetching is driven by the probe plan */
+  madvise(map, (size_t)fs->c.size, MADV_RANDOM);
+  fs->c.map = map;
+  fs->c.prefetch = prefetch_mapped;
+}
+
+static void prefetch_mapped(SOURCE *s, u8 pos, u8 len)
+{
+  u8 start, pagemask;
+
+  if (pos >= s->size)
+    return;
+  if (len > s->size - pos)
+    len = s->size - pos;
+
+  /* madvise() wants page-aligned addresses */
+  pagemask = (u8)sysconf(_SC_PAGESIZE) - 1;
+  start = pos & ~pagemask;
+  madvise((char *)s->map + start, (size_t)(pos + len - start),
+          MADV_WILLNEED);
+}
+#endif
+
+/*
+ * batched reads through io_uring: all requests are in flight at once
+ */
+
+#ifdef USE_IO_URING
+static void read_file_batch(SOURCE *s, IOREQ *reqs, int count)
+{
+  URING *ring = ((FILE_SOURCE *)s)->ring;
+  struct io_uring_sqe *sqe;
+  struct io_uring_cqe *cqe;
+  unsigned tail, head;
+  int i, done, submitted, pending, result;
+  IOREQ *req;
+
+  for (done = 0; done < count; done += submitted) {
+    /* fill the submission queue */
+    tail = *ring->sq_tail;
+    for (submitted = 0;
+         submitted < (int)ring->entries && done + submitted < count;
+         submitted++, tail++) {
+      req = &reqs[done + submitted];
+      sqe = &ring->sqes[tail & *ring->sq_mask];
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = IORING_OP_READ;
+      sqe->fd = ((FILE_SOURCE *)s)->fd;
+      sqe->addr = (unsigned long)req->buf;
+      sqe->len = (unsigned)req->len;
+      sqe->off = req->pos;
+      sqe->user_data = done + submitted;
+      ring->sq_array[tail & *ring->sq_mask] = tail & *ring->sq_mask;
+      req->got = 0;
+    }
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+    /* submit and wait for all of them */
+    for (pending = submitted; pending > 0; ) {
+      result = syscall(__NR_io_uring_enter, ring->fd,
+                       (pending == submitted) ? submitted : 0,
+                       pending, IORING_ENTER_GETEVENTS, NULL, 0);
+      if (result < 0 && errno != EINTR && errno != EAGAIN) {
+        errore("io_uring submission failed");
+        break;
+      }
+
+      head = *ring->cq_head;
+      while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        cqe = &ring->cqes[head & *ring->cq_mask];
+        i = (int)cqe->user_data;
+        if (cqe->res > 0)
+          reqs[i].got = cqe->res;
+        head++;
+        pending--;
+      }
+      __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    if (pending > 0) {
+      /* the ring is unusable, stop using it for this source */
+      s->read_batch = NULL;
+      break;
+    }
+  }
+
+  /* finish short or failed reads the normal way, that also reports
+     errors and tells EOF apart */
+  for (i = 0; i < count; i++) {
+    req = &reqs[i];
+    if (req->got < req->len)
+      req->got += read_file(s, req->pos + req->got, req->len - req->got,
+                            (char *)req->buf + req->got);
+  }
+}
+
+static URING * uring_setup(unsigned entries)
+{
+  struct io_uring_params p;
+  URING *ring;
+
+  ring = (URING *)malloc(sizeof(URING));
+  if (ring == NULL)
+    bailout("Out of memory");
+  memset(ring, 0, sizeof(URING));
+
+  memset(&p, 0, sizeof(p));
+  ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (ring->fd < 0) {
+    free(ring);
+    return NULL;  /* not supported or not allowed */
+  }
+  ring->entries = p.sq_entries;
+
+  /* map the rings */
+  ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd,
+                      IORING_OFF_SQ_RING);
+  ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd,
+                      IORING_OFF_CQ_RING);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sq_ptr == MAP_FAILED || ring->cq_ptr == MAP_FAILED ||
+      ring->sqes == MAP_FAILED) {
+    uring_close(ring);
+    return NULL;
+  }
+
+  ring->sq_head = (unsigned *)((char *)ring->sq_ptr + p.sq_off.head);
+  ring->sq_tail = (unsigned *)((char *)ring->sq_ptr + p.sq_off.tail);
+  ring->sq_mask = (unsigned *)((char *)ring->sq_ptr + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)((char *)ring->sq_ptr + p.sq_off.array);
+  ring->cq_head = (unsigned *)((char *)ring->cq_ptr + p.cq_off.head);
+  ring->cq_tail = (unsigned *)((char *)ring->cq_ptr + p.cq_off.tail);
+  ring->cq_mask = (unsigned *)((char *)ring->cq_ptr + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ptr + p.cq_off.cqes);
+
+  return ring;
+}
+
+static void uring_close(URING *ring)
+{
+  if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+    munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ptr != NULL && ring->cq_ptr != MAP_FAILED)
+    munmap(ring->cq_ptr, ring->cq_size);
+  if (ring->sq_ptr != NULL && ring->sq_ptr != MAP_FAILED)
+    munmap(ring->sq_ptr, ring->sq_size);
+  close(ring->fd);
+  free(ring);
+}
+#endif
+
 /*
  * dispose of everything
  */
@@ -307,10 +778,134 @@ static void close_file(SOURCE *s)
 {
   int fd = ((FILE_SOURCE *)s)->fd;
 
+#ifdef USE_MMAP
+  if (s->map != NULL)
+    munmap(s->map, (size_t)s->size);
+#endif
+
+#ifdef USE_IO_URING
+  if (((FILE_SOURCE *)s)->ring != NULL)
+    uring_close(((FILE_SOURCE *)s)->ring);
+#endif
+
   if (fd > 2)  /* don't close stdin/out/err */
     close(fd);
 }
 
+/*
+ * open a file whose name came from inside an image (parent, backing
+ * file, extent); only regular files are accepted, so a name chosen by
+ * the image can't make us read a device or wait on a FIFO forever
+ */
+
+int open_related_file(const char *path)
+{
+  struct stat sb;
+  int fd, flags;
+
+  fd = open(path, O_RDONLY | O_NONBLOCK);
+  if (fd < 0)
+    return -1;
+  if (fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode)) {
+    close(fd);
+    return -1;
+  }
+  if ((flags = fcntl(fd, F_GETFL, 0)) >= 0)
+    fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+  return fd;
+}
+
+/*
+ * split images: regular files read one after the other, as one disk
+ */
+
+SOURCE *init_split_source(int *fds, int count)
+{
+  SPLIT_SOURCE *ss;
+  struct stat sb;
+  int i;
+
+  ss = (SPLIT_SOURCE *)malloc(sizeof(SPLIT_SOURCE));
+  if (ss == NULL)
+    bailout("Out of memory");
+  memset(ss, 0, sizeof(SPLIT_SOURCE));
+
+  ss->c.name = "split";
+  ss->c.read_bytes = read_split;
+  ss->c.close = close_split;
+
+  ss->count = count;
+  ss->fds = (int *)malloc(count * sizeof(int));
+  ss->starts = (u8 *)malloc((count + 1) * sizeof(u8));
+  if (ss->fds == NULL || ss->starts == NULL)
+    bailout("Out of memory");
+
+  /* prefix sums of the segment sizes */
+  ss->starts[0] = 0;
+  for (i = 0; i < count; i++) {
+    ss->fds[i] = fds[i];
+    if (fstat(fds[i], &sb) < 0)
+      sb.st_size = 0;
+    ss->starts[i + 1] = ss->starts[i] + sb.st_size;
+  }
+  ss->c.size_known = 1;
+  ss->c.size = ss->starts[count];
+
+  return (SOURCE *)ss;
+}
+
+/*
+ * raw read: find the segment by binary search, and read one piece per
+ * segment the request touches
+ */
+
+static u8 read_split(SOURCE *s, u8 pos, u8 len, void *buf)
+{
+  SPLIT_SOURCE *ss = (SPLIT_SOURCE *)s;
+  u8 got, cur, n, result;
+  int lo, hi, mid;
+
+  got = 0;
+  while (got < len) {
+    cur = pos + got;
+    if (cur >= ss->c.size)
+      break;
+
+    /* the last segment starting at or before cur */
+    lo = 0;
+    hi = ss->count - 1;
+    while (lo < hi) {
+      mid = (lo + hi + 1) / 2;
+      if (ss->starts[mid] <= cur)
+        lo = mid;
+      else
+        hi = mid - 1;
+    }
+
+    n = ss->starts[lo + 1] - cur;
+    if (n > len - got)
+      n = len - got;
+    result = read_fd(ss->fds[lo], 1, cur - ss->starts[lo], n,
+                     (char *)buf + got);
+    got += result;
+    if (result < n)
+      break;
+  }
+
+  return got;
+}
+
+static void close_split(SOURCE *s)
+{
+  SPLIT_SOURCE *ss = (SPLIT_SOURCE *)s;
+  int i;
+
+  for (i = 0; i < ss->count; i++)
+    close(ss->fds[i]);
+  free(ss->fds);
+  free(ss->starts);
+}
+
 /*
  * check if the given position is inside the file's size
  */
@@ -57,18 +57,40 @@ typedef unsigned long int u4;
 typedef long long int s8;
 typedef unsigned long long int u8;
 
+typedef struct ioreq {
+  u8 pos, len;
+  void *buf;
+  u8 got;
+} IOREQ;
+
 typedef struct source {
+  const char *name;
   u8 size;
   int size_known;
+  /* a decompression budget ran out, here or in a layer below; reads
+     from cutoff on came back short, there is more data than was read */
+  int truncated;
+  u8 cutoff;
   void *cache_head;
 
   int sequential;
   u8 seq_pos;
   int blocksize;
   struct source *foundation;
+  /* file name of a file source, for finding related files */
+  const char *path;
+  /* the whole source mapped into memory, bypasses the cache */
+  void *map;
 
   int (*analyze)(struct source *s, int level);
   u8 (*read_bytes)(struct source *s, u8 pos, u8 len, void *buf);
+  u8 (*read_scatter)(struct source *s, u8 pos, u8 len,
+                     void **bufs, int bufsize);
+  void (*read_batch)(struct source *s, IOREQ *reqs, int count);
+  void (*prefetch)(struct source *s, u8 pos, u8 len);
+  /* for data kept unchanged in the foundation: how much of it from pos
+     on lies there in one piece, and where */
+  u8 (*locate)(struct source *s, u8 pos, u8 len, u8 *found_pos);
   int (*read_block)(struct source *s, u8 pos, void *buf);
   void (*close)(struct source *s);
 
@@ -95,15 +117,61 @@ void stop_detect(void);
 /* file source functions */
 
 SOURCE *init_file_source(int fd, int filekind);
+SOURCE *init_split_source(int *fds, int count);
+int open_related_file(const char *path);
+void set_file_uring(int enable);
+void set_file_mmap(int enable);
+void set_file_direct(int enable);
 
 int analyze_cdaccess(int fd, SOURCE *s, int level);
 
+/* compressed data functions */
+
+void set_gzip_index(const char *dir);
+void set_decompress_budget(u8 bytes, int seconds);
+int over_budget(SOURCE *s, u8 decoded, time_t started);
+SOURCE *init_bzip2_source(SOURCE *foundation, u8 offset, u8 size);
+SOURCE *init_xz_source(SOURCE *foundation, u8 offset, u8 size);
+
+/* block allocation table sources */
+
+#define BAT_ABSENT (0)   /* block markers, data positions are never */
+#define BAT_ZERO (1)     /* this low in any supported format */
+
+typedef struct bat_source {
+  SOURCE c;
+  u4 block_size;
+  u4 block_count;
+  /* per block, the data position in the foundation or a marker */
+  u8 *blocks;
+  /* for formats that map below block granularity: the length of the
+     piece at rel and where it comes from (from == NULL for zeros) */
+  u8 (*map)(struct bat_source *bs, u4 block, u4 rel, u8 len,
+            SOURCE **from, u8 *from_pos);
+  void (*cleanup)(struct bat_source *bs);
+
+  /* format data may follow */
+} BAT_SOURCE;
+
+BAT_SOURCE *init_bat_source(SOURCE *foundation, const char *name,
+                            size_t struct_size, u8 size,
+                            u4 block_size, u4 block_count);
+
 /* buffer functions */
 
 u8 get_buffer(SECTION *section, u8 pos, u8 len, void **buf);
 u8 get_buffer_real(SOURCE *s, u8 pos, u8 len, void *inbuf, void **outbuf);
+void prefetch_buffer(SOURCE *s, u8 pos, u8 len);
+int beyond_budget(SECTION *section, u8 pos, u8 len);
+void note_budget_refusal(void);
 void close_source(SOURCE *s);
 
+void set_cache_limit(u8 bytes);
+void cache_enter_scope(void);
+void cache_leave_scope(void);
+void set_cache_stats(int enable);
+void print_cache_stats(void);
+
 /* output functions */
 
 void print_line(int level, const char *fmt, ...);
@@ -151,6 +219,11 @@ void get_padded_string(void *from, int len, char pad, char *to);
 int find_memory(void *haystack, int haystack_len,
                 void *needle, int needle_len);
 
+/* related files */
+
+const char * get_source_path(SOURCE *s);
+char * get_related_path(const char *path, const char *name);
+
 /* name table lookups */
 
 char * get_name_for_mbrtype(int type);
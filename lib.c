@@ -505,6 +505,36 @@ int find_memory(void *haystack, int haystack_len,
   return -1;
 }
 
+/*
+ * related files, e.g. parents of disk images
+ */
+
+const char * get_source_path(SOURCE *s)
+{
+  /* the bottom layer is the file we were given */
+  while (s->foundation != NULL)
+    s = s->foundation;
+  return s->path;
+}
+
+char * get_related_path(const char *path, const char *name)
+{
+  const char *slash;
+  char *full;
+
+  full = (char *)malloc(strlen(path) + strlen(name) + 2);
+  if (full == NULL)
+    bailout("Out of memory");
+
+  /* relative names are resolved against the directory of path */
+  slash = strrchr(path, '/');
+  if (name[0] == '/' || slash == NULL)
+    strcpy(full, name);
+  else
+    sprintf(full, "%.*s/%s", (int)(slash - path), path, name);
+  return full;
+}
+
 /*
  * error functions
  */
@@ -271,8 +271,12 @@ void detect_linux_raid(SECTION *section, int level)
 
   /* get RAID superblock from the end of the device */
   pos = (section->size & ~65535) - 65536;
-  if (get_buffer(section, pos, 4096, (void **)&buf) < 4096)
+  if (get_buffer(section, pos, 4096, (void **)&buf) < 4096) {
+    if (beyond_budget(section, pos, 4096))
+      print_line(level, "Linux RAID superblock not checked, beyond "
+                 "decompression budget");
     return;
+  }
 
   /* signature */
   if (get_le_long(buf) != 0xa92b4efc)
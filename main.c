@@ -38,25 +38,64 @@
 static void analyze_file(const char *filename);
 static void analyze_stdin(void);
 static int analyze_stat(struct stat *sb, const char *filename);
-static void analyze_fd(int fd, int filekind, const char *filename);
+static void analyze_fd(int fd, int filekind, const char *filename,
+                       const char *path);
+static int find_segments(const char *filename, char ***names);
+static int next_segment_name(char *name, size_t ext);
+static void analyze_split(const char *filename, char **names, int count);
+static void note_segments(char **names, int count);
+static int is_noted_segment(struct stat *sb);
 static void print_kind(int filekind, u8 size, int size_known);
+static int parse_option(const char *opt);
+static int match_option(const char *opt, const char *name,
+                        const char **value);
+static int parse_number(const char *value, u8 *result);
+static void usage(void);
 
 #ifdef USE_MACOS_TYPE
 static void show_macos_type(const char *filename);
 #endif
 
+/* the most segments of a split image we look for */
+#define MAXSEGMENTS (10000)
+
+/* segments already analyzed as part of a split image, so they aren't
+   analyzed again when they're named on the command line as well */
+typedef struct segment_id {
+  dev_t dev;
+  ino_t ino;
+} SEGMENT_ID;
+
+static SEGMENT_ID *noted_segments = NULL;
+static int noted_count = 0, noted_alloc = 0;
+
 /*
  * entry point
  */
 
 int main(int argc, char *argv[])
 {
-  int i;
+  int i, first;
+
+  /* options come first, "--" ends them */
+  for (first = 1; first < argc; first++) {
+    if (strcmp(argv[first], "--") == 0) {
+      first++;
+      break;
+    }
+    if (strncmp(argv[first], "--", 2) != 0)
+      break;
+    if (!parse_option(argv[first] + 2)) {
+      error("Invalid option %.300s", argv[first]);
+      usage();
+      return 1;
+    }
+  }
 
   /* argument check */
-  if (argc < 2) {
+  if (first >= argc) {
     if (isatty(0)) {
-      fprintf(stderr, "Usage: %s <device/file>...\n", PROGNAME);
+      usage();
       return 1;
     } else {
       print_line(0, "");
@@ -66,22 +105,132 @@ int main(int argc, char *argv[])
 
   /* loop over filenames */
   print_line(0, "");
-  for (i = 1; i < argc; i++) {
+  for (i = first; i < argc; i++) {
     analyze_file(argv[i]);
     print_line(0, "");
   }
 
+  print_cache_stats();
   return 0;
 }
 
+/*
+ * Command line options
+ */
+
+static int parse_option(const char *opt)
+{
+  const char *value;
+  u8 number;
+
+  if (match_option(opt, "cache-mb", &value)) {
+    if (!parse_number(value, &number))
+      return 0;
+    set_cache_limit(number * 1024 * 1024);
+    return 1;
+  }
+  if (match_option(opt, "decompress-mb", &value)) {
+    if (!parse_number(value, &number) || number == 0)
+      return 0;
+    set_decompress_budget(number * 1024 * 1024, 0);
+    return 1;
+  }
+  if (match_option(opt, "decompress-seconds", &value)) {
+    if (!parse_number(value, &number) || number == 0)
+      return 0;
+    set_decompress_budget(0, (int)number);
+    return 1;
+  }
+  if (match_option(opt, "direct", &value)) {
+    if (value != NULL)
+      return 0;
+    set_file_direct(1);
+    return 1;
+  }
+  if (match_option(opt, "gzip-index", &value)) {
+    if (value == NULL || *value == 0)
+      return 0;
+    set_gzip_index(value);
+    return 1;
+  }
+  if (match_option(opt, "io-uring", &value)) {
+    if (value != NULL)
+      return 0;
+    set_file_uring(1);
+    return 1;
+  }
+  if (match_option(opt, "mmap", &value)) {
+    if (value != NULL)
+      return 0;
+    set_file_mmap(1);
+    return 1;
+  }
+  if (match_option(opt, "stats", &value)) {
+    if (value != NULL)
+      return 0;
+    set_cache_stats(1);
+    return 1;
+  }
+
+  return 0;
+}
+
+static int match_option(const char *opt, const char *name,
+                        const char **value)
+{
+  size_t len = strlen(name);
+
+  if (strncmp(opt, name, len) != 0)
+    return 0;
+  if (opt[len] == '=') {
+    *value = opt + len + 1;
+    return 1;
+  }
+  if (opt[len] == 0) {
+    *value = NULL;
+    return 1;
+  }
+  return 0;
+}
+
+static int parse_number(const char *value, u8 *result)
+{
+  char *end;
+
+  if (value == NULL || *value == 0)
+    return 0;
+  *result = strtoull(value, &end, 10);
+  return (*end == 0);
+}
+
+static void usage(void)
+{
+  fprintf(stderr,
+          "Usage: %s [options] <device/file>...\n"
+          "Options:\n"
+          "  --cache-mb=N   limit the data cache to N MiB\n"
+          "  --decompress-mb=N\n"
+          "                 decompress at most N MiB per compressed layer\n"
+          "  --decompress-seconds=N\n"
+          "                 spend at most N seconds per compressed layer\n"
+          "  --direct       bypass the page cache for block devices (Linux)\n"
+          "  --gzip-index=DIR\n"
+          "                 keep gzip seek indexes in DIR for later runs\n"
+          "  --io-uring     read files through io_uring (Linux)\n"
+          "  --mmap         map regular files instead of reading them\n"
+          "  --stats        report cache statistics at the end\n",
+          PROGNAME);
+}
+
 /*
  * Analyze one file
  */
 
 static void analyze_file(const char *filename)
 {
-  int fd, filekind;
+  int fd, filekind, count, i;
   struct stat sb;
+  char **names;
 
   /* accept '-' as an alias for stdin */
   if (strcmp(filename, "-") == 0) {
@@ -96,6 +245,10 @@ static void analyze_file(const char *filename)
     errore("Can't stat %.300s", filename);
     return;
   }
+  if (S_ISREG(sb.st_mode) && is_noted_segment(&sb)) {
+    print_line(0, "Segment of the split image above, not analyzed again");
+    return;
+  }
   filekind = analyze_stat(&sb, filename);
   if (filekind < 0)
     return;
@@ -106,6 +259,21 @@ static void analyze_file(const char *filename)
     show_macos_type(filename);
 #endif
 
+  /* first segment of a split image? */
+  if (filekind == 0) {
+    count = find_segments(filename, &names);
+    if (count > 1) {
+      analyze_split(filename, names, count);
+      note_segments(names + 1, count - 1);
+    }
+    for (i = 0; i < count; i++)
+      free(names[i]);
+    if (count > 0)
+      free(names);
+    if (count > 1)
+      return;
+  }
+
   /* open for reading */
   fd = open(filename, O_RDONLY);
   if (fd < 0) {
@@ -114,7 +282,162 @@ static void analyze_file(const char *filename)
   }
 
   /* go for it */
-  analyze_fd(fd, filekind, filename);
+  analyze_fd(fd, filekind, filename, filename);
+}
+
+/*
+ * Split images: given the first segment of a set named like "disk.001"
+ * or "disk.aa", collect the regular files following it; returns the
+ * number of segments found
+ */
+
+static int find_segments(const char *filename, char ***names)
+{
+  const char *ext, *p;
+  char *name;
+  size_t ext_off;
+  int count, alloc;
+  struct stat sb;
+
+  ext = strrchr(filename, '.');
+  if (ext == NULL || strchr(ext, '/') != NULL || strlen(ext + 1) < 2)
+    return 0;
+  ext++;
+
+  /* the first of a set: "000" or "001", or all "a" */
+  if (ext[0] >= '0' && ext[0] <= '9') {
+    for (p = ext; *p == '0'; p++) ;
+    if (!(p[0] == 0 || (p[0] == '1' && p[1] == 0)) || p - ext < 2)
+      return 0;
+  } else {
+    for (p = ext; *p == 'a'; p++) ;
+    if (*p != 0)
+      return 0;
+  }
+
+  ext_off = ext - filename;
+  alloc = 16;
+  *names = (char **)malloc(alloc * sizeof(char *));
+  if (*names == NULL)
+    bailout("Out of memory");
+  (*names)[0] = strdup(filename);
+  if ((*names)[0] == NULL)
+    bailout("Out of memory");
+  count = 1;
+
+  for (;;) {
+    name = strdup((*names)[count - 1]);
+    if (name == NULL)
+      bailout("Out of memory");
+    if (count >= MAXSEGMENTS || !next_segment_name(name, ext_off) ||
+        stat(name, &sb) < 0 || !S_ISREG(sb.st_mode)) {
+      free(name);
+      break;
+    }
+    if (count >= alloc) {
+      alloc *= 2;
+      *names = (char **)realloc(*names, alloc * sizeof(char *));
+      if (*names == NULL)
+        bailout("Out of memory");
+    }
+    (*names)[count++] = name;
+  }
+
+  return count;
+}
+
+/*
+ * advance a segment name's extension ("009" to "010", "az" to "ba");
+ * returns zero when it runs out of places
+ */
+
+static int next_segment_name(char *name, size_t ext)
+{
+  size_t i;
+
+  for (i = strlen(name); i > ext; i--) {
+    if (name[i - 1] == '9') {
+      name[i - 1] = '0';
+    } else if (name[i - 1] == 'z') {
+      name[i - 1] = 'a';
+    } else {
+      name[i - 1]++;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void analyze_split(const char *filename, char **names, int count)
+{
+  SOURCE *s;
+  int *fds, i;
+  char buf[256];
+
+  fds = (int *)malloc(count * sizeof(int));
+  if (fds == NULL)
+    bailout("Out of memory");
+  for (i = 0; i < count; i++) {
+    fds[i] = open(names[i], O_RDONLY);
+    if (fds[i] < 0) {
+      errore("Can't open %.300s", names[i]);
+      while (--i >= 0)
+        close(fds[i]);
+      free(fds);
+      return;
+    }
+  }
+
+  /* create a source over all segments */
+  s = init_split_source(fds, count);
+  s->path = filename;
+  free(fds);
+
+  format_size_verbose(buf, s->size);
+  print_line(0, "Split image, %d segments, total size %s", count, buf);
+
+  /* now analyze it */
+  analyze_source(s, 0);
+
+  /* finish it up */
+  close_source(s);
+}
+
+/*
+ * remember the segments after the first one of a split image, by device
+ * and inode so any name for them matches
+ */
+
+static void note_segments(char **names, int count)
+{
+  struct stat sb;
+  int i;
+
+  for (i = 0; i < count; i++) {
+    if (stat(names[i], &sb) < 0)
+      continue;
+    if (noted_count >= noted_alloc) {
+      noted_alloc = noted_alloc ? noted_alloc * 2 : 16;
+      noted_segments = (SEGMENT_ID *)realloc(noted_segments,
+                                             noted_alloc * sizeof(SEGMENT_ID));
+      if (noted_segments == NULL)
+        bailout("Out of memory");
+    }
+    noted_segments[noted_count].dev = sb.st_dev;
+    noted_segments[noted_count].ino = sb.st_ino;
+    noted_count++;
+  }
+}
+
+static int is_noted_segment(struct stat *sb)
+{
+  int i;
+
+  for (i = 0; i < noted_count; i++)
+    if (noted_segments[i].dev == sb->st_dev &&
+        noted_segments[i].ino == sb->st_ino)
+      return 1;
+  return 0;
 }
 
 static void analyze_stdin(void)
@@ -136,7 +459,7 @@ static void analyze_stdin(void)
     return;
 
   /* go for it */
-  analyze_fd(fd, filekind, filename);
+  analyze_fd(fd, filekind, filename, NULL);
 }
 
 static int analyze_stat(struct stat *sb, const char *filename)
@@ -172,7 +495,8 @@ static int analyze_stat(struct stat *sb, const char *filename)
   return filekind;
 }
 
-static void analyze_fd(int fd, int filekind, const char *filename)
+static void analyze_fd(int fd, int filekind, const char *filename,
+                       const char *path)
 {
   SOURCE *s;
 
@@ -186,6 +510,7 @@ static void analyze_fd(int fd, int filekind, const char *filename)
 
   /* create a source */
   s = init_file_source(fd, filekind);
+  s->path = path;
 
   /* tell the user what it is */
   if (filekind != 0)
@@ -0,0 +1,548 @@
+/*
+ * qcow.c
+ * Layered data source for QEMU QCOW2 disk images.
+ *
+ * Copyright (c) 2026 The disktype contributors
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE. 
+ */
+
+#include "global.h"
+
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
+
+/* number of L2 tables kept in memory */
+#define L2_CACHE_SIZE (16)
+/* longest backing file chain we follow */
+#define MAXCHAIN (32)
+
+/* L1 and L2 table entries */
+#define QCOW_OFLAG_COMPRESSED (1ULL << 62)
+#define QCOW_OFLAG_ZERO       (1ULL)
+#define QCOW_OFFSET_MASK      (0x00fffffffffffe00ULL)
+
+/* incompatible features */
+#define QCOW_INCOMPAT_DIRTY       (1 << 0)
+#define QCOW_INCOMPAT_CORRUPT     (1 << 1)
+#define QCOW_INCOMPAT_DATA_FILE   (1 << 2)
+#define QCOW_INCOMPAT_COMPRESSION (1 << 3)
+#define QCOW_INCOMPAT_EXTL2       (1 << 4)
+
+/* what a guest cluster maps to */
+#define CLUSTER_DATA       (0)
+#define CLUSTER_ZERO       (1)
+#define CLUSTER_BACKING    (2)
+#define CLUSTER_COMPRESSED (3)
+
+/*
+ * types
+ */
+
+typedef struct l2_table {
+  u8 off;            /* in the image, 0 if the slot is free */
+  u4 used;           /* for LRU replacement */
+  unsigned char *data;
+} L2_TABLE;
+
+typedef struct qcow_source {
+  SOURCE c;
+  u8 off;
+  u4 cluster_bits;
+  u4 cluster_size;
+  u4 l2_bits;        /* log2 of the entries per L2 table */
+  u4 l1_size;
+  u8 *l1_table;
+  L2_TABLE l2_cache[L2_CACHE_SIZE];
+  u4 l2_clock;
+  SOURCE *backing;       /* NULL if there is none */
+  SOURCE *backing_file;  /* the file opened for it */
+  /* the last decompressed cluster */
+  u8 z_entry;
+  unsigned char *z_in, *z_out;
+#ifdef USE_ZLIB
+  z_stream zs;
+  int zs_init;
+#endif
+} QCOW_SOURCE;
+
+/*
+ * helper functions
+ */
+
+static SOURCE *init_qcow_source(SOURCE *fs, u8 off, int level,
+                                const char *path, int depth);
+static int open_qcow_backing(QCOW_SOURCE *qs, int level,
+                             const char *path, char *name, int depth);
+static u8 read_qcow(SOURCE *s, u8 pos, u8 len, void *buf);
+static int map_cluster(QCOW_SOURCE *qs, u8 cluster, u8 *host);
+static unsigned char *get_l2_table(QCOW_SOURCE *qs, u8 l2_off);
+static unsigned char *get_compressed_cluster(QCOW_SOURCE *qs, u8 entry);
+static void close_qcow(SOURCE *s);
+
+/*
+ * QCOW2 image detection
+ */
+
+void detect_qcow(SECTION *section, int level)
+{
+  unsigned char *buf;
+  int version;
+  char s[256];
+  SOURCE *src;
+
+  if (get_buffer(section, 0, 72, (void **)&buf) < 72)
+    return;
+  if (memcmp(buf, "QFI\xfb", 4) != 0)
+    return;
+
+  version = (int)get_be_long(buf + 4);
+  if (version < 2) {
+    print_line(level, "QEMU QCOW disk image, version %d", version);
+    format_size_verbose(s, get_be_quad(buf + 16));
+    print_line(level + 1, "Disk size %s", s);
+    return;
+  }
+
+  print_line(level, "QEMU QCOW2 disk image, version %d", version);
+  format_size_verbose(s, get_be_quad(buf + 24));
+  print_line(level + 1, "Disk size %s", s);
+
+  src = init_qcow_source(section->source, section->pos, level,
+                         get_source_path(section->source), 0);
+  if (src != NULL) {
+    analyze_source(src, level);
+    close_source(src);
+  }
+
+  stop_detect();
+}
+
+/*
+ * initialize the mapping source, including the backing files below it
+ */
+
+static SOURCE *init_qcow_source(SOURCE *fs, u8 off, int level,
+                                const char *path, int depth)
+{
+  QCOW_SOURCE *qs;
+  unsigned char buf[112];
+  u8 backing_offset, l1_offset, l1_needed, incompat, got;
+  u4 backing_size, header_length, snapshots, i;
+  int version;
+  char s[256], name[1024];
+
+  /* version 3 headers have a length field, the compression type byte
+     is only there if it says so */
+  got = get_buffer_real(fs, off, sizeof(buf), buf, NULL);
+  if (got < 72)
+    return NULL;
+  version = (int)get_be_long(buf + 4);
+
+  /* allocate and init source structure */
+  qs = (QCOW_SOURCE *)malloc(sizeof(QCOW_SOURCE));
+  if (qs == NULL)
+    bailout("Out of memory");
+  memset(qs, 0, sizeof(QCOW_SOURCE));
+
+  qs->c.size_known = 1;
+  qs->c.size = get_be_quad(buf + 24);
+  qs->c.name = "qcow2";
+  qs->c.foundation = fs;
+  qs->c.read_bytes = read_qcow;
+  qs->c.close = close_qcow;
+  qs->off = off;
+
+  backing_offset = get_be_quad(buf + 8);
+  backing_size = get_be_long(buf + 16);
+  qs->cluster_bits = get_be_long(buf + 20);
+  qs->l1_size = get_be_long(buf + 36);
+  l1_offset = get_be_quad(buf + 40);
+  snapshots = get_be_long(buf + 60);
+  incompat = 0;
+  header_length = 72;
+  if (version >= 3 && got >= 104) {
+    incompat = get_be_quad(buf + 72);
+    header_length = get_be_long(buf + 100);
+  }
+
+  if (depth == 0) {
+    if (qs->cluster_bits >= 9 && qs->cluster_bits <= 21) {
+      format_size(s, 1 << qs->cluster_bits);
+      print_line(level + 1, "Cluster size %s", s);
+    }
+    if (snapshots > 0)
+      print_line(level + 1, "Contains %lu snapshots", snapshots);
+    if (incompat & QCOW_INCOMPAT_DIRTY)
+      print_line(level + 1, "Not closed cleanly");
+    if (incompat & QCOW_INCOMPAT_CORRUPT)
+      print_line(level + 1, "Marked as corrupt");
+  }
+
+  /* check what we can handle */
+  if (version > 3 || (version == 3 && header_length < 104)) {
+    print_line(level + 1, "Error: Unknown version or header layout");
+    goto errorexit;
+  }
+  if (qs->cluster_bits < 9 || qs->cluster_bits > 21) {
+    print_line(level + 1, "Error: Invalid cluster size");
+    goto errorexit;
+  }
+  if (get_be_long(buf + 32) != 0) {
+    print_line(level + 1, "Encrypted, contents not analyzed");
+    goto errorexit;
+  }
+  if (incompat & (QCOW_INCOMPAT_DATA_FILE | QCOW_INCOMPAT_EXTL2)) {
+    print_line(level + 1, "Error: Unsupported features (external data "
+               "file or extended L2 entries)");
+    goto errorexit;
+  }
+  if ((incompat & QCOW_INCOMPAT_COMPRESSION) &&
+      (header_length <= 104 || got <= 104)) {
+    print_line(level + 1, "Error: Compression type missing from the header");
+    goto errorexit;
+  }
+  if ((incompat & QCOW_INCOMPAT_COMPRESSION) && buf[104] != 0) {
+    print_line(level + 1, "Error: Unsupported compression type %d",
+               (int)buf[104]);
+    goto errorexit;
+  }
+
+  qs->cluster_size = 1 << qs->cluster_bits;
+  qs->l2_bits = qs->cluster_bits - 3;
+  l1_needed = (qs->c.size + ((u8)1 << (qs->cluster_bits + qs->l2_bits)) - 1)
+    >> (qs->cluster_bits + qs->l2_bits);
+  if (qs->l1_size < l1_needed || qs->l1_size > 0x2000000) {
+    print_line(level + 1, "Error: L1 table doesn't match the disk size");
+    goto errorexit;
+  }
+
+  /* read the L1 table and decode it once */
+  qs->l1_table = (u8 *)malloc((qs->l1_size + 1) * sizeof(u8));
+  if (qs->l1_table == NULL)
+    bailout("Out of memory");
+  if (get_buffer_real(fs, off + l1_offset, (u8)qs->l1_size * 8,
+                      (void *)qs->l1_table, NULL) < (u8)qs->l1_size * 8) {
+    print_line(level + 1, "Error reading the L1 table");
+    goto errorexit;
+  }
+  for (i = 0; i < qs->l1_size; i++)
+    qs->l1_table[i] = get_be_quad(qs->l1_table + i) & QCOW_OFFSET_MASK;
+
+  /* the backing file takes care of unallocated clusters */
+  if (backing_offset != 0 && backing_size > 0) {
+    if (backing_size > sizeof(name) - 1 ||
+        get_buffer_real(fs, off + backing_offset, backing_size,
+                        (void *)name, NULL) < backing_size) {
+      print_line(level + 1, "Error reading the backing file name");
+      goto errorexit;
+    }
+    name[backing_size] = 0;
+    if (!open_qcow_backing(qs, level, path, name, depth))
+      goto errorexit;
+  }
+
+  return (SOURCE *)qs;
+
+errorexit:
+  close_qcow((SOURCE *)qs);
+  free(qs);
+  return NULL;
+}
+
+/*
+ * open the backing file, relative to the image's path; it may be
+ * another QCOW2 image or a raw one
+ */
+
+static int open_qcow_backing(QCOW_SOURCE *qs, int level,
+                             const char *path, char *name, int depth)
+{
+  char *full;
+  unsigned char *buf;
+  int fd;
+
+  if (depth + 1 >= MAXCHAIN) {
+    print_line(level + 1, "Error: Backing file chain too long");
+    return 0;
+  }
+  if (path == NULL) {
+    print_line(level + 1, "Error: Can't look for the backing file "
+               "without a file name");
+    return 0;
+  }
+
+  full = get_related_path(path, name);
+  fd = open_related_file(full);
+  if (fd < 0) {
+    print_line(level + 1, "Error: Backing file %s not found or not "
+               "a regular file", full);
+    free(full);
+    return 0;
+  }
+  qs->backing_file = init_file_source(fd, 0);
+
+  if (get_buffer_real(qs->backing_file, 0, 4, NULL, (void **)&buf) == 4 &&
+      memcmp(buf, "QFI\xfb", 4) == 0) {
+    print_line(level + 1, "Backing file %s, QCOW2", full);
+    qs->backing = init_qcow_source(qs->backing_file, 0, level, full,
+                                   depth + 1);
+    if (qs->backing == NULL) {
+      free(full);
+      return 0;
+    }
+  } else {
+    print_line(level + 1, "Backing file %s, raw", full);
+    qs->backing = qs->backing_file;
+  }
+
+  free(full);
+  return 1;
+}
+
+/*
+ * mapping read: consecutive clusters that map the same way are served
+ * together, allocated ones with one read if they are contiguous in the
+ * image as well
+ */
+
+static u8 read_qcow(SOURCE *s, u8 pos, u8 len, void *buf)
+{
+  QCOW_SOURCE *qs = (QCOW_SOURCE *)s;
+  unsigned char *p, *data;
+  u8 got, cluster, rel, n, host, next_host, result;
+  int type;
+
+  p = (unsigned char *)buf;
+  got = 0;
+  while (got < len) {
+    cluster = (pos + got) >> qs->cluster_bits;
+    rel = (pos + got) & (qs->cluster_size - 1);
+    type = map_cluster(qs, cluster, &host);
+    if (type < 0)
+      break;
+
+    /* extend the run over the following clusters */
+    n = qs->cluster_size - rel;
+    if (type != CLUSTER_COMPRESSED) {
+      while (n < len - got &&
+             map_cluster(qs, cluster + 1, &next_host) == type &&
+             (type != CLUSTER_DATA ||
+              next_host == host + rel + n)) {
+        cluster++;
+        n += qs->cluster_size;
+      }
+    }
+    if (n > len - got)
+      n = len - got;
+
+    if (type == CLUSTER_DATA) {
+      result = get_buffer_real(s->foundation, qs->off + host + rel, n,
+                               p + got, NULL);
+      got += result;
+      if (result < n)
+        break;
+    } else if (type == CLUSTER_COMPRESSED) {
+      data = get_compressed_cluster(qs, host);
+      if (data == NULL)
+        break;
+      memcpy(p + got, data + rel, n);
+      got += n;
+    } else if (type == CLUSTER_BACKING && qs->backing != NULL) {
+      /* the backing file may be smaller, the rest reads as zeros */
+      result = get_buffer_real(qs->backing, pos + got, n, p + got, NULL);
+      if (result < n)
+        memset(p + got + result, 0, n - result);
+      got += n;
+    } else {
+      memset(p + got, 0, n);
+      got += n;
+    }
+  }
+
+  return got;
+}
+
+/*
+ * look up a guest cluster; host is set to the cluster's position in
+ * the image, or the raw L2 entry for compressed clusters
+ */
+
+static int map_cluster(QCOW_SOURCE *qs, u8 cluster, u8 *host)
+{
+  unsigned char *table;
+  u8 l1_index, entry;
+
+  l1_index = cluster >> qs->l2_bits;
+  if (l1_index >= qs->l1_size || qs->l1_table[l1_index] == 0)
+    return CLUSTER_BACKING;
+
+  table = get_l2_table(qs, qs->l1_table[l1_index]);
+  if (table == NULL)
+    return -1;
+  entry = get_be_quad(table +
+                      (cluster & (((u8)1 << qs->l2_bits) - 1)) * 8);
+
+  if (entry & QCOW_OFLAG_COMPRESSED) {
+    *host = entry;
+    return CLUSTER_COMPRESSED;
+  }
+  if (entry & QCOW_OFLAG_ZERO)
+    return CLUSTER_ZERO;
+  *host = entry & QCOW_OFFSET_MASK;
+  if (*host == 0)
+    return CLUSTER_BACKING;
+  return CLUSTER_DATA;
+}
+
+/*
+ * get an L2 table through the LRU cache
+ */
+
+static unsigned char *get_l2_table(QCOW_SOURCE *qs, u8 l2_off)
+{
+  L2_TABLE *t, *victim;
+  int i;
+
+  victim = &qs->l2_cache[0];
+  for (i = 0; i < L2_CACHE_SIZE; i++) {
+    t = &qs->l2_cache[i];
+    if (t->off == l2_off) {
+      t->used = ++qs->l2_clock;
+      return t->data;
+    }
+    if (t->off == 0 || (victim->off != 0 && t->used < victim->used))
+      victim = t;
+  }
+
+  /* not there, load it into the least recently used slot */
+  if (victim->data == NULL) {
+    victim->data = (unsigned char *)malloc(qs->cluster_size);
+    if (victim->data == NULL)
+      bailout("Out of memory");
+  }
+  victim->off = 0;
+  if (get_buffer_real(qs->c.foundation, qs->off + l2_off, qs->cluster_size,
+                      victim->data, NULL) < qs->cluster_size)
+    return NULL;
+  victim->off = l2_off;
+  victim->used = ++qs->l2_clock;
+  return victim->data;
+}
+
+/*
+ * decompress a compressed cluster, the last one is kept
+ */
+
+static unsigned char *get_compressed_cluster(QCOW_SOURCE *qs, u8 entry)
+{
+#ifdef USE_ZLIB
+  u4 x, sectors;
+  u8 coff, csize, got;
+  int result;
+
+  if (qs->z_out != NULL && qs->z_entry == entry)
+    return qs->z_out;
+
+  /* offset and size share the entry, the split depends on the
+     cluster size */
+  x = 62 - (qs->cluster_bits - 8);
+  coff = entry & (((u8)1 << x) - 1);
+  sectors = (u4)((entry >> x) & (((u8)1 << (qs->cluster_bits - 8)) - 1)) + 1;
+  csize = (u8)sectors * 512 - (coff & 511);
+
+  if (qs->z_out == NULL) {
+    qs->z_out = (unsigned char *)malloc(qs->cluster_size);
+    qs->z_in = (unsigned char *)malloc(2 * qs->cluster_size);
+    if (qs->z_out == NULL || qs->z_in == NULL)
+      bailout("Out of memory");
+  }
+  if (csize > 2 * qs->cluster_size)
+    return NULL;
+
+  /* the last cluster may end before its last sector does */
+  got = get_buffer_real(qs->c.foundation, qs->off + coff, csize,
+                        qs->z_in, NULL);
+  if (got == 0)
+    return NULL;
+
+  /* raw deflate data */
+  if (!qs->zs_init) {
+    memset(&qs->zs, 0, sizeof(qs->zs));
+    if (inflateInit2(&qs->zs, -12) != Z_OK)
+      return NULL;
+    qs->zs_init = 1;
+  } else {
+    inflateReset(&qs->zs);
+  }
+  qs->zs.next_in = qs->z_in;
+  qs->zs.avail_in = (uInt)got;
+  qs->zs.next_out = qs->z_out;
+  qs->zs.avail_out = qs->cluster_size;
+  result = inflate(&qs->zs, Z_FINISH);
+  if ((result != Z_STREAM_END && result != Z_BUF_ERROR) ||
+      qs->zs.avail_out != 0) {
+    qs->z_entry = 0;
+    return NULL;
+  }
+
+  qs->z_entry = entry;
+  return qs->z_out;
+#else
+  /* no zlib, no compressed clusters */
+  return NULL;
+#endif
+}
+
+/*
+ * cleanup
+ */
+
+static void close_qcow(SOURCE *s)
+{
+  QCOW_SOURCE *qs = (QCOW_SOURCE *)s;
+  int i;
+
+  if (qs->l1_table != NULL)
+    free(qs->l1_table);
+  for (i = 0; i < L2_CACHE_SIZE; i++) {
+    if (qs->l2_cache[i].data != NULL)
+      free(qs->l2_cache[i].data);
+  }
+
+  if (qs->z_out != NULL)
+    free(qs->z_out);
+  if (qs->z_in != NULL)
+    free(qs->z_in);
+#ifdef USE_ZLIB
+  if (qs->zs_init)
+    inflateEnd(&qs->zs);
+#endif
+
+  /* the backing image, then the file below it */
+  if (qs->backing != NULL && qs->backing != qs->backing_file)
+    close_source(qs->backing);
+  if (qs->backing_file != NULL)
+    close_source(qs->backing_file);
+}
+
+/* EOF */
@@ -0,0 +1,160 @@
+/*
+ * vdi.c
+ * Layered data source for VirtualBox VDI disk images.
+ *
+ * Copyright (c) 2026 The disktype contributors
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE. 
+ */
+
+#include "global.h"
+
+/* block map entries that don't point to data */
+#define VDI_BLOCK_FREE (0xffffffff)
+#define VDI_BLOCK_ZERO (0xfffffffe)
+
+/*
+ * helper functions
+ */
+
+static SOURCE *init_vdi_source(SECTION *section, int level,
+                               unsigned char *header);
+
+/*
+ * VDI image detection
+ */
+
+void detect_vdi(SECTION *section, int level)
+{
+  unsigned char *buf;
+  u4 version, type;
+  char s[256];
+  SOURCE *src;
+
+  if (get_buffer(section, 0, 512, (void **)&buf) < 512)
+    return;
+  if (get_le_long(buf + 0x40) != 0xbeda107f)
+    return;
+
+  version = get_le_long(buf + 0x44);
+  type = get_le_long(buf + 0x4c);
+  if ((version >> 16) != 1) {
+    print_line(level, "VirtualBox VDI disk image, version %lu.%lu",
+               version >> 16, version & 0xffff);
+    return;
+  }
+
+  if (type == 1) {
+    print_line(level, "VirtualBox VDI disk image, dynamic size");
+  } else if (type == 2) {
+    print_line(level, "VirtualBox VDI disk image, fixed size");
+  } else if (type == 4) {
+    print_line(level, "VirtualBox VDI disk image, differential");
+  } else {
+    print_line(level, "VirtualBox VDI disk image, unknown type %lu", type);
+  }
+  format_size_verbose(s, get_le_quad(buf + 0x170));
+  print_line(level + 1, "Disk size %s", s);
+
+  if (type == 4) {
+    /* unallocated blocks come from a parent we can't identify by name */
+    print_line(level + 1, "Error: Differential images are not supported");
+  } else if (type == 1 || type == 2) {
+    src = init_vdi_source(section, level, buf);
+    if (src != NULL) {
+      analyze_source(src, level);
+      close_source(src);
+    }
+  }
+
+  stop_detect();
+}
+
+/*
+ * initialize the mapping source from the block map
+ */
+
+static SOURCE *init_vdi_source(SECTION *section, int level,
+                               unsigned char *header)
+{
+  BAT_SOURCE *bs;
+  unsigned char *raw_map;
+  u8 size, data_off, stride;
+  u4 map_off, block_size, extra, block_count, allocated, block, entry;
+  char s[256];
+
+  map_off = get_le_long(header + 0x154);
+  data_off = get_le_long(header + 0x158);
+  size = get_le_quad(header + 0x170);
+  block_size = get_le_long(header + 0x178);
+  extra = get_le_long(header + 0x17c);
+  block_count = get_le_long(header + 0x180);
+  allocated = get_le_long(header + 0x184);
+
+  if (block_size < 512 || block_size > 256*1024*1024 ||
+      extra > 1024*1024) {
+    print_line(level + 1, "Error: Invalid block size (%lu bytes)",
+               block_size);
+    return NULL;
+  }
+  format_size(s, block_size);
+  print_line(level + 1, "Uses %lu blocks of %s, %lu allocated",
+             block_count, s, allocated);
+  if ((u8)block_count != (size + block_size - 1) / block_size) {
+    print_line(level + 1, "Error: Block map doesn't match the disk size");
+    return NULL;
+  }
+  if (section->size > 0 && (map_off > section->size ||
+                            (u8)block_count * 4 > section->size - map_off)) {
+    print_line(level + 1, "Error: Block map extends past the end of the file");
+    return NULL;
+  }
+
+  /* read the block map and decode it once */
+  raw_map = (unsigned char *)malloc(block_count ? block_count * 4 : 1);
+  if (raw_map == NULL)
+    bailout("Out of memory");
+  if (get_buffer_real(section->source, section->pos + map_off,
+                      (u8)block_count * 4, raw_map, NULL) <
+      (u8)block_count * 4) {
+    print_line(level + 1, "Error reading the block map");
+    free(raw_map);
+    return NULL;
+  }
+
+  bs = init_bat_source(section->source, "vdi", sizeof(BAT_SOURCE),
+                       size, block_size, block_count);
+  stride = (u8)block_size + extra;
+  for (block = 0; block < block_count; block++) {
+    entry = get_le_long(raw_map + block * 4);
+    if (entry == VDI_BLOCK_FREE)
+      bs->blocks[block] = BAT_ABSENT;
+    else if (entry == VDI_BLOCK_ZERO)
+      bs->blocks[block] = BAT_ZERO;
+    else
+      bs->blocks[block] = section->pos + data_off + entry * stride + extra;
+  }
+  free(raw_map);
+
+  return (SOURCE *)bs;
+}
+
+/* EOF */
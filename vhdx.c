@@ -0,0 +1,318 @@
+/*
+ * vhdx.c
+ * Layered data source for Hyper-V VHDX disk images.
+ *
+ * Copyright (c) 2026 The disktype contributors
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE. 
+ */
+
+#include "global.h"
+
+/* BAT entry states */
+#define PAYLOAD_BLOCK_NOT_PRESENT       (0)
+#define PAYLOAD_BLOCK_UNDEFINED         (1)
+#define PAYLOAD_BLOCK_ZERO              (2)
+#define PAYLOAD_BLOCK_UNMAPPED          (3)
+#define PAYLOAD_BLOCK_FULLY_PRESENT     (6)
+#define PAYLOAD_BLOCK_PARTIALLY_PRESENT (7)
+
+/* file parameter flags */
+#define VHDX_HAS_PARENT (2)
+
+/* region and metadata item GUIDs, in on-disk byte order */
+static const unsigned char bat_guid[16] = {
+  0x66, 0x77, 0xc2, 0x2d, 0x23, 0xf6, 0x00, 0x42,
+  0x9d, 0x64, 0x11, 0x5e, 0x9b, 0xfd, 0x4a, 0x08 };
+static const unsigned char metadata_guid[16] = {
+  0x06, 0xa2, 0x7c, 0x8b, 0x90, 0x47, 0x9a, 0x4b,
+  0xb8, 0xfe, 0x57, 0x5f, 0x05, 0x0f, 0x88, 0x6e };
+static const unsigned char file_params_guid[16] = {
+  0x37, 0x67, 0xa1, 0xca, 0x36, 0xfa, 0x43, 0x4d,
+  0xb3, 0xb6, 0x33, 0xf0, 0xaa, 0x44, 0xe7, 0x6b };
+static const unsigned char disk_size_guid[16] = {
+  0x24, 0x42, 0xa5, 0x2f, 0x1b, 0xcd, 0x76, 0x48,
+  0xb2, 0x11, 0x5d, 0xbe, 0xd8, 0x3b, 0xf4, 0xb8 };
+static const unsigned char sector_size_guid[16] = {
+  0x1d, 0xbf, 0x41, 0x81, 0x6f, 0xa9, 0x09, 0x47,
+  0xba, 0x47, 0xf2, 0x33, 0xa8, 0xfa, 0xab, 0x5f };
+
+/*
+ * helper functions
+ */
+
+static int find_region(SECTION *section, const unsigned char *guid,
+                       u8 *off, u4 *len);
+static unsigned char *find_metadata(SECTION *section, u8 meta_off,
+                                    u4 meta_len, const unsigned char *guid,
+                                    u4 len);
+static SOURCE *init_vhdx_source(SECTION *section, int level,
+                                u8 bat_off, u4 bat_len, u8 size,
+                                u4 block_size, u4 sector_size);
+
+/*
+ * VHDX image detection
+ */
+
+void detect_vhdx(SECTION *section, int level)
+{
+  unsigned char *buf, *item;
+  u8 seq, best_seq, meta_off, bat_off, size;
+  u4 meta_len, bat_len, block_size, flags, sector_size;
+  int i, best;
+  char s[256];
+  SOURCE *src;
+
+  if (get_buffer(section, 0, 8, (void **)&buf) < 8)
+    return;
+  if (memcmp(buf, "vhdxfile", 8) != 0)
+    return;
+
+  print_line(level, "Hyper-V VHDX disk image");
+
+  /* the current header is the one with the higher sequence number */
+  best = -1;
+  best_seq = 0;
+  for (i = 0; i < 2; i++) {
+    if (get_buffer(section, (u8)(i + 1) * 65536, 64, (void **)&buf) < 64)
+      continue;
+    if (memcmp(buf, "head", 4) != 0)
+      continue;
+    seq = get_le_quad(buf + 8);
+    if (best < 0 || seq > best_seq) {
+      best = i;
+      best_seq = seq;
+    }
+  }
+  if (best < 0) {
+    print_line(level + 1, "Error: No valid header found");
+    stop_detect();
+    return;
+  }
+  get_buffer(section, (u8)(best + 1) * 65536, 64, (void **)&buf);
+  for (i = 0; i < 16; i++) {
+    if (buf[48 + i] != 0)
+      break;
+  }
+  if (i < 16)
+    print_line(level + 1, "Log not replayed, contents may be stale");
+
+  /* the regions and the metadata items we need */
+  if (!find_region(section, bat_guid, &bat_off, &bat_len) ||
+      !find_region(section, metadata_guid, &meta_off, &meta_len)) {
+    print_line(level + 1, "Error: No valid region table found");
+    stop_detect();
+    return;
+  }
+  item = find_metadata(section, meta_off, meta_len, file_params_guid, 8);
+  if (item == NULL) {
+    print_line(level + 1, "Error: File parameters missing");
+    stop_detect();
+    return;
+  }
+  block_size = get_le_long(item);
+  flags = get_le_long(item + 4);
+  item = find_metadata(section, meta_off, meta_len, disk_size_guid, 8);
+  if (item == NULL) {
+    print_line(level + 1, "Error: Disk size missing");
+    stop_detect();
+    return;
+  }
+  size = get_le_quad(item);
+  item = find_metadata(section, meta_off, meta_len, sector_size_guid, 4);
+  sector_size = (item != NULL) ? get_le_long(item) : 512;
+
+  format_size_verbose(s, size);
+  print_line(level + 1, "Disk size %s", s);
+  if (sector_size != 512)
+    print_line(level + 1, "Logical sector size %lu bytes", sector_size);
+
+  if (flags & VHDX_HAS_PARENT) {
+    /* partially present blocks need the parent's data */
+    print_line(level + 1, "Error: Differencing images are not supported");
+  } else {
+    src = init_vhdx_source(section, level, bat_off, bat_len, size,
+                           block_size, sector_size);
+    if (src != NULL) {
+      analyze_source(src, level);
+      close_source(src);
+    }
+  }
+
+  stop_detect();
+}
+
+/*
+ * look up a region in the region table, falling back to its copy
+ */
+
+static int find_region(SECTION *section, const unsigned char *guid,
+                       u8 *off, u4 *len)
+{
+  unsigned char *buf;
+  u4 count, i;
+  int table;
+
+  for (table = 0; table < 2; table++) {
+    if (get_buffer(section, 196608 + (u8)table * 65536, 65536,
+                   (void **)&buf) < 65536)
+      continue;
+    if (memcmp(buf, "regi", 4) != 0)
+      continue;
+    count = get_le_long(buf + 8);
+    if (count > 2047)
+      continue;
+    for (i = 0; i < count; i++) {
+      if (memcmp(buf + 16 + i * 32, guid, 16) == 0) {
+        *off = get_le_quad(buf + 16 + i * 32 + 16);
+        *len = get_le_long(buf + 16 + i * 32 + 24);
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+/*
+ * look up a metadata item, returns NULL if missing or too short
+ */
+
+static unsigned char *find_metadata(SECTION *section, u8 meta_off,
+                                    u4 meta_len, const unsigned char *guid,
+                                    u4 len)
+{
+  unsigned char *buf;
+  u4 count, i, item_off, item_len;
+
+  /* the table fills the first 64 KiB of the region */
+  if (meta_len < 65536 ||
+      get_buffer(section, meta_off, 65536, (void **)&buf) < 65536)
+    return NULL;
+  if (memcmp(buf, "metadata", 8) != 0)
+    return NULL;
+  count = get_le_short(buf + 10);
+  if (count > 2047)
+    return NULL;
+  for (i = 0; i < count; i++) {
+    if (memcmp(buf + 32 + i * 32, guid, 16) != 0)
+      continue;
+    item_off = get_le_long(buf + 32 + i * 32 + 16);
+    item_len = get_le_long(buf + 32 + i * 32 + 20);
+    if (item_len < len || item_off > meta_len ||
+        meta_len - item_off < item_len)
+      return NULL;
+    if (get_buffer(section, meta_off + item_off, len,
+                   (void **)&buf) < len)
+      return NULL;
+    return buf;
+  }
+  return NULL;
+}
+
+/*
+ * initialize the mapping source from the BAT; a sector bitmap entry
+ * follows every chunk_ratio payload entries
+ */
+
+static SOURCE *init_vhdx_source(SECTION *section, int level,
+                                u8 bat_off, u4 bat_len, u8 size,
+                                u4 block_size, u4 sector_size)
+{
+  BAT_SOURCE *bs;
+  unsigned char *raw_bat;
+  u4 block_count, chunk_ratio, entries, block, allocated;
+  u8 entry, data_off;
+  char s[256];
+
+  if (block_size < 1024*1024 || block_size > 256*1024*1024 ||
+      (block_size & (block_size - 1)) != 0) {
+    print_line(level + 1, "Error: Invalid block size (%lu bytes)",
+               block_size);
+    return NULL;
+  }
+  if (sector_size != 512 && sector_size != 4096) {
+    print_line(level + 1, "Error: Invalid logical sector size");
+    return NULL;
+  }
+  if (size == 0 || size > ((u8)64 << 40)) {
+    print_line(level + 1, "Error: Invalid disk size");
+    return NULL;
+  }
+
+  block_count = (u4)((size + block_size - 1) / block_size);
+  chunk_ratio = (u4)(((u8)1 << 23) * sector_size / block_size);
+  entries = block_count + (block_count - 1) / chunk_ratio;
+  if ((u8)entries * 8 > bat_len) {
+    print_line(level + 1, "Error: BAT doesn't match the disk size");
+    return NULL;
+  }
+  if (section->size > 0 && (bat_off > section->size ||
+                            (u8)entries * 8 > section->size - bat_off)) {
+    print_line(level + 1, "Error: BAT extends past the end of the file");
+    return NULL;
+  }
+
+  /* read the BAT and decode it once */
+  raw_bat = (unsigned char *)malloc((size_t)entries * 8);
+  if (raw_bat == NULL)
+    bailout("Out of memory");
+  if (get_buffer_real(section->source, section->pos + bat_off,
+                      (u8)entries * 8, raw_bat, NULL) < (u8)entries * 8) {
+    print_line(level + 1, "Error reading the BAT");
+    free(raw_bat);
+    return NULL;
+  }
+
+  bs = init_bat_source(section->source, "vhdx", sizeof(BAT_SOURCE),
+                       size, block_size, block_count);
+  allocated = 0;
+  for (block = 0; block < block_count; block++) {
+    entry = get_le_quad(raw_bat + (u8)(block + block / chunk_ratio) * 8);
+    data_off = (entry >> 20) << 20;
+    switch ((int)(entry & 7)) {
+    case PAYLOAD_BLOCK_FULLY_PRESENT:
+    case PAYLOAD_BLOCK_PARTIALLY_PRESENT:
+      if (data_off == 0) {
+        bs->blocks[block] = BAT_ABSENT;
+      } else {
+        bs->blocks[block] = section->pos + data_off;
+        allocated++;
+      }
+      break;
+    case PAYLOAD_BLOCK_ZERO:
+      bs->blocks[block] = BAT_ZERO;
+      break;
+    default:
+      /* not present, undefined or unmapped read as zeros */
+      bs->blocks[block] = BAT_ABSENT;
+      break;
+    }
+  }
+  free(raw_bat);
+
+  format_size(s, block_size);
+  print_line(level + 1, "Uses %lu blocks of %s, %lu allocated",
+             block_count, s, allocated);
+
+  return (SOURCE *)bs;
+}
+
+/* EOF */
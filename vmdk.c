@@ -0,0 +1,747 @@
+/*
+ * vmdk.c
+ * Layered data source for VMware VMDK disk images.
+ *
+ * Copyright (c) 2026 The disktype contributors
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE. 
+ */
+
+#include "global.h"
+
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
+
+/* number of grain tables kept in memory */
+#define GT_CACHE_SIZE (32)
+/* longest descriptor we read */
+#define MAXDESCRIPTOR (65536)
+
+/* sparse extent header flags */
+#define VMDK_FLAG_COMPRESSED (1 << 16)
+#define VMDK_FLAG_MARKERS    (1 << 17)
+/* grain directory is at the end, see the footer */
+#define VMDK_GD_AT_END       (0xffffffffffffffffULL)
+
+/* extent types */
+#define EXTENT_FLAT   (0)
+#define EXTENT_SPARSE (1)
+#define EXTENT_ZERO   (2)
+
+/*
+ * types
+ */
+
+typedef struct vmdk_extent {
+  u8 start, len;     /* in the virtual disk */
+  int type;
+  SOURCE *fs;
+  SOURCE *file;      /* opened for this extent, NULL for the image itself */
+  u8 off;            /* flat: data position, sparse: extent start */
+  /* sparse extents */
+  u4 grain_size;     /* in bytes */
+  u4 gt_entries;
+  u4 gd_count;
+  u4 *gd;            /* grain table positions in sectors */
+  int compressed;
+} VMDK_EXTENT;
+
+typedef struct gt_table {
+  VMDK_EXTENT *extent;  /* NULL if the slot is free */
+  u4 sector;
+  u4 used;              /* for LRU replacement */
+  u4 *entries;
+} GT_TABLE;
+
+typedef struct vmdk_source {
+  SOURCE c;
+  int extent_count;
+  VMDK_EXTENT *extents;
+  int last;          /* extent of the previous lookup */
+  GT_TABLE gt_cache[GT_CACHE_SIZE];
+  u4 gt_clock;
+  /* the last decompressed grain */
+  VMDK_EXTENT *z_extent;
+  u4 z_sector;
+  unsigned char *z_in, *z_out;
+  u4 z_in_size, z_out_size;
+#ifdef USE_ZLIB
+  z_stream zs;
+  int zs_init;
+#endif
+} VMDK_SOURCE;
+
+/*
+ * helper functions
+ */
+
+static VMDK_SOURCE *init_vmdk_source(SOURCE *foundation, int max_extents);
+static int init_sparse_extent(VMDK_EXTENT *e, SOURCE *fs, u8 off,
+                              int level);
+static int parse_descriptor(VMDK_SOURCE *vs, char *text, int level,
+                            const char *path);
+static char *get_descriptor_value(char *text, const char *key, char *to,
+                                  size_t to_size);
+static u8 read_vmdk(SOURCE *s, u8 pos, u8 len, void *buf);
+static u8 read_sparse_extent(VMDK_SOURCE *vs, VMDK_EXTENT *e,
+                             u8 rel, u8 len, unsigned char *p);
+static u4 map_grain(VMDK_SOURCE *vs, VMDK_EXTENT *e, u8 grain, int *error);
+static u4 *get_grain_table(VMDK_SOURCE *vs, VMDK_EXTENT *e, u4 sector);
+static unsigned char *get_compressed_grain(VMDK_SOURCE *vs,
+                                           VMDK_EXTENT *e, u4 sector);
+static void close_vmdk(SOURCE *s);
+
+/*
+ * VMDK detection: sparse extents and descriptor files
+ */
+
+void detect_vmdk(SECTION *section, int level)
+{
+  unsigned char *buf;
+  VMDK_SOURCE *vs;
+  VMDK_EXTENT *e;
+  char *text, s[256];
+  u8 fill, desc_off, desc_size;
+
+  /* descriptor files may be shorter than a sector */
+  fill = get_buffer(section, 0, 512, (void **)&buf);
+
+  if (fill == 512 && get_le_long(buf) == 0x564d444b) {  /* "KDMV" */
+    /* a sparse extent, usually with its descriptor embedded */
+    desc_off = get_le_quad(buf + 28) * 512;
+    desc_size = get_le_quad(buf + 36) * 512;
+    s[0] = 0;
+    if (desc_off > 0 && desc_size > 0 && desc_size <= MAXDESCRIPTOR &&
+        get_buffer(section, desc_off, desc_size, (void **)&buf) == desc_size) {
+      text = (char *)malloc(desc_size + 1);
+      if (text == NULL)
+        bailout("Out of memory");
+      memcpy(text, buf, desc_size);
+      text[desc_size] = 0;
+      get_descriptor_value(text, "createType", s, sizeof(s));
+      free(text);
+    }
+    if (s[0])
+      print_line(level, "VMware VMDK disk image, %s", s);
+    else
+      print_line(level, "VMware VMDK disk image, sparse extent");
+
+    vs = init_vmdk_source(section->source, 1);
+    e = &vs->extents[vs->extent_count++];
+    if (!init_sparse_extent(e, section->source, section->pos, level)) {
+      close_source((SOURCE *)vs);
+      stop_detect();
+      return;
+    }
+    vs->c.size = e->len;
+
+  } else if (fill >= 21 && memcmp(buf, "# Disk DescriptorFile", 21) == 0) {
+    /* a descriptor file listing the extents */
+    desc_size = get_buffer(section, 0, MAXDESCRIPTOR, (void **)&buf);
+    text = (char *)malloc(desc_size + 1);
+    if (text == NULL)
+      bailout("Out of memory");
+    memcpy(text, buf, desc_size);
+    text[desc_size] = 0;
+
+    if (get_descriptor_value(text, "createType", s, sizeof(s)) == NULL)
+      strcpy(s, "unknown type");
+    print_line(level, "VMware VMDK disk descriptor, %s", s);
+
+    vs = init_vmdk_source(section->source, 0);
+    if (!parse_descriptor(vs, text, level,
+                          get_source_path(section->source))) {
+      free(text);
+      close_source((SOURCE *)vs);
+      stop_detect();
+      return;
+    }
+    free(text);
+
+  } else {
+    return;
+  }
+
+  format_size_verbose(s, vs->c.size);
+  print_line(level + 1, "Disk size %s", s);
+  e = &vs->extents[0];
+  if (e->type == EXTENT_SPARSE) {
+    format_size(s, e->grain_size);
+    print_line(level + 1, "Grain size %s%s", s,
+               e->compressed ? ", compressed grains" : "");
+  }
+
+  analyze_source((SOURCE *)vs, level);
+  close_source((SOURCE *)vs);
+
+  stop_detect();
+}
+
+/*
+ * allocate the mapping source
+ */
+
+static VMDK_SOURCE *init_vmdk_source(SOURCE *foundation, int max_extents)
+{
+  VMDK_SOURCE *vs;
+
+  /* allocate and init source structure */
+  vs = (VMDK_SOURCE *)malloc(sizeof(VMDK_SOURCE));
+  if (vs == NULL)
+    bailout("Out of memory");
+  memset(vs, 0, sizeof(VMDK_SOURCE));
+
+  vs->c.size_known = 1;
+  vs->c.name = "vmdk";
+  vs->c.foundation = foundation;
+  vs->c.read_bytes = read_vmdk;
+  vs->c.close = close_vmdk;
+
+  if (max_extents > 0) {
+    vs->extents = (VMDK_EXTENT *)malloc(max_extents * sizeof(VMDK_EXTENT));
+    if (vs->extents == NULL)
+      bailout("Out of memory");
+    memset(vs->extents, 0, max_extents * sizeof(VMDK_EXTENT));
+  }
+
+  return vs;
+}
+
+/*
+ * read a sparse extent's header and its grain directory
+ */
+
+static int init_sparse_extent(VMDK_EXTENT *e, SOURCE *fs, u8 off,
+                              int level)
+{
+  unsigned char *buf, *raw;
+  u8 capacity, grain_sectors, gd_offset;
+  u4 flags, i;
+
+  if (get_buffer_real(fs, off, 512, NULL, (void **)&buf) < 512 ||
+      get_le_long(buf) != 0x564d444b) {
+    print_line(level + 1, "Error: Invalid sparse extent header");
+    return 0;
+  }
+  gd_offset = get_le_quad(buf + 56);
+
+  if (gd_offset == VMDK_GD_AT_END) {
+    /* stream-optimized: the real header is in the footer, which is
+       only there in extents written with markers */
+    if (!(get_le_long(buf + 8) & VMDK_FLAG_MARKERS)) {
+      print_line(level + 1, "Error: Grain directory at the end, "
+                 "but no markers");
+      return 0;
+    }
+    if (!fs->size_known || fs->size < off + 1536 ||
+        get_buffer_real(fs, fs->size - 1024, 512, NULL,
+                        (void **)&buf) < 512 ||
+        get_le_long(buf) != 0x564d444b) {
+      print_line(level + 1, "Error: Can't find the stream-optimized footer");
+      return 0;
+    }
+    gd_offset = get_le_quad(buf + 56);
+  }
+
+  flags = get_le_long(buf + 8);
+  capacity = get_le_quad(buf + 12);
+  grain_sectors = get_le_quad(buf + 20);
+  e->gt_entries = get_le_long(buf + 44);
+  e->compressed = (flags & VMDK_FLAG_COMPRESSED) ? 1 : 0;
+  if (e->compressed && get_le_short(buf + 77) != 1) {
+    print_line(level + 1, "Error: Unknown compression algorithm %d",
+               (int)get_le_short(buf + 77));
+    return 0;
+  }
+
+  if (grain_sectors < 1 || grain_sectors > 2048 ||
+      (grain_sectors & (grain_sectors - 1)) != 0 ||
+      e->gt_entries < 1 || e->gt_entries > 65536) {
+    print_line(level + 1, "Error: Invalid grain size or table size");
+    return 0;
+  }
+  e->type = EXTENT_SPARSE;
+  e->fs = fs;
+  e->off = off;
+  e->len = capacity * 512;
+  e->grain_size = (u4)grain_sectors * 512;
+  e->gd_count = (u4)((capacity + grain_sectors * e->gt_entries - 1) /
+                     (grain_sectors * e->gt_entries));
+
+  /* read the grain directory and decode it once */
+  e->gd = (u4 *)malloc((e->gd_count + 1) * sizeof(u4));
+  raw = (unsigned char *)malloc((e->gd_count + 1) * 4);
+  if (e->gd == NULL || raw == NULL)
+    bailout("Out of memory");
+  if (get_buffer_real(fs, off + gd_offset * 512, (u8)e->gd_count * 4,
+                      raw, NULL) < (u8)e->gd_count * 4) {
+    print_line(level + 1, "Error reading the grain directory");
+    free(raw);
+    return 0;
+  }
+  for (i = 0; i < e->gd_count; i++)
+    e->gd[i] = get_le_long(raw + i * 4);
+  free(raw);
+
+  return 1;
+}
+
+/*
+ * parse a descriptor file, opening the extents relative to its path
+ */
+
+static int parse_descriptor(VMDK_SOURCE *vs, char *text, int level,
+                            const char *path)
+{
+  VMDK_EXTENT *e;
+  char *line, *next, *p, *q, type[32], *full;
+  u8 sectors, offset, pos;
+  int fd, count;
+
+  /* the extent table can't be longer than the number of lines */
+  count = 1;
+  for (p = text; *p; p++)
+    if (*p == '\n')
+      count++;
+  vs->extents = (VMDK_EXTENT *)malloc(count * sizeof(VMDK_EXTENT));
+  if (vs->extents == NULL)
+    bailout("Out of memory");
+  memset(vs->extents, 0, count * sizeof(VMDK_EXTENT));
+
+  if (get_descriptor_value(text, "parentFileNameHint", type,
+                           sizeof(type)) != NULL)
+    print_line(level + 1, "Delta disk, its parent is not read");
+
+  pos = 0;
+  for (line = text; line != NULL && *line; line = next) {
+    next = strchr(line, '\n');
+    if (next != NULL)
+      *next++ = 0;
+
+    /* access, size in sectors, type, "file name", offset */
+    if (strncmp(line, "RW ", 3) != 0 && strncmp(line, "RDONLY ", 7) != 0 &&
+        strncmp(line, "NOACCESS ", 9) != 0)
+      continue;
+    p = strchr(line, ' ') + 1;
+    sectors = strtoull(p, &p, 10);
+    while (*p == ' ')
+      p++;
+    for (q = type; *p && *p != ' ' && *p != '\r' &&
+           q < type + sizeof(type) - 1; )
+      *q++ = *p++;
+    *q = 0;
+
+    e = &vs->extents[vs->extent_count];
+    e->start = pos;
+    e->len = sectors * 512;
+    if (strcmp(type, "ZERO") == 0) {
+      e->type = EXTENT_ZERO;
+      vs->extent_count++;
+      pos += e->len;
+      continue;
+    }
+    if (strcmp(type, "FLAT") != 0 && strcmp(type, "VMFS") != 0 &&
+        strcmp(type, "SPARSE") != 0) {
+      print_line(level + 1, "Error: Unsupported extent type %s", type);
+      return 0;
+    }
+
+    /* the file name is quoted */
+    p = strchr(p, '"');
+    q = (p != NULL) ? strchr(p + 1, '"') : NULL;
+    if (q == NULL) {
+      print_line(level + 1, "Error: Extent without a file name");
+      return 0;
+    }
+    *q = 0;
+    offset = strtoull(q + 1, NULL, 10);
+    if (path == NULL) {
+      print_line(level + 1, "Error: Can't look for the extent files "
+                 "without a file name");
+      return 0;
+    }
+    full = get_related_path(path, p + 1);
+    fd = open_related_file(full);
+    if (fd < 0) {
+      print_line(level + 1, "Error: Extent file %s not found or not "
+                 "a regular file", full);
+      free(full);
+      return 0;
+    }
+    free(full);
+    e->file = init_file_source(fd, 0);
+    vs->extent_count++;
+
+    if (strcmp(type, "SPARSE") == 0) {
+      if (!init_sparse_extent(e, e->file, 0, level))
+        return 0;
+      if (e->len != sectors * 512) {
+        print_line(level + 1, "Error: Extent size doesn't match its header");
+        return 0;
+      }
+      e->start = pos;
+    } else {
+      e->type = EXTENT_FLAT;
+      e->fs = e->file;
+      e->off = offset * 512;
+    }
+    pos += e->len;
+  }
+
+  if (vs->extent_count == 0) {
+    print_line(level + 1, "Error: No extents in the descriptor");
+    return 0;
+  }
+  if (vs->extent_count > 1)
+    print_line(level + 1, "%d extents", vs->extent_count);
+  vs->c.size = pos;
+  return 1;
+}
+
+/*
+ * find a key="value" line in a descriptor, truncating the value to
+ * fit into to_size bytes
+ */
+
+static char *get_descriptor_value(char *text, const char *key, char *to,
+                                  size_t to_size)
+{
+  char *p, *q;
+  size_t len = strlen(key);
+  size_t i;
+
+  for (p = text; p != NULL; p = strchr(p, '\n')) {
+    if (*p == '\n')
+      p++;
+    if (strncmp(p, key, len) != 0)
+      continue;
+    q = p + len;
+    while (*q == ' ')
+      q++;
+    if (*q++ != '=')
+      continue;
+    while (*q == ' ' || *q == '"')
+      q++;
+    for (i = 0; i + 1 < to_size && q[i] && q[i] != '"' && q[i] != '\n' &&
+           q[i] != '\r'; i++)
+      to[i] = q[i];
+    to[i] = 0;
+    return to;
+  }
+  return NULL;
+}
+
+/*
+ * mapping read: find the extent by binary search, then let it serve
+ * what it can
+ */
+
+static u8 read_vmdk(SOURCE *s, u8 pos, u8 len, void *buf)
+{
+  VMDK_SOURCE *vs = (VMDK_SOURCE *)s;
+  VMDK_EXTENT *e;
+  unsigned char *p;
+  u8 got, rel, n, result;
+  int lo, hi, mid;
+
+  p = (unsigned char *)buf;
+  got = 0;
+
+  /* reads tend to follow each other, so try the last extent first */
+  e = &vs->extents[vs->last];
+  if (pos < e->start || pos >= e->start + e->len) {
+    lo = 0;
+    hi = vs->extent_count - 1;
+    while (lo < hi) {
+      mid = lo + (hi - lo + 1) / 2;
+      if (vs->extents[mid].start <= pos)
+        lo = mid;
+      else
+        hi = mid - 1;
+    }
+    vs->last = lo;
+  }
+
+  for (; got < len && vs->last < vs->extent_count; vs->last++) {
+    e = &vs->extents[vs->last];
+    rel = pos + got - e->start;
+    if (rel >= e->len)
+      continue;
+    n = e->len - rel;
+    if (n > len - got)
+      n = len - got;
+
+    if (e->type == EXTENT_FLAT) {
+      result = get_buffer_real(e->fs, e->off + rel, n, p + got, NULL);
+    } else if (e->type == EXTENT_SPARSE) {
+      result = read_sparse_extent(vs, e, rel, n, p + got);
+    } else {
+      memset(p + got, 0, n);
+      result = n;
+    }
+    got += result;
+    if (result < n)
+      break;
+  }
+
+  if (vs->last >= vs->extent_count)
+    vs->last = vs->extent_count - 1;
+  return got;
+}
+
+/*
+ * read from a sparse extent; grains that are contiguous in the file
+ * are read together, unallocated ones are zero-filled
+ */
+
+static u8 read_sparse_extent(VMDK_SOURCE *vs, VMDK_EXTENT *e,
+                             u8 rel, u8 len, unsigned char *p)
+{
+  unsigned char *data;
+  u8 got, grain, in_grain, n, result;
+  u4 sector, next;
+  int error;
+
+  got = 0;
+  while (got < len) {
+    grain = (rel + got) / e->grain_size;
+    in_grain = (rel + got) % e->grain_size;
+    sector = map_grain(vs, e, grain, &error);
+    if (error)
+      break;
+
+    n = e->grain_size - in_grain;
+    if (sector > 1 && !e->compressed) {
+      /* extend over grains that follow in the file */
+      while (n < len - got) {
+        next = map_grain(vs, e, grain + 1, &error);
+        if (error || next != sector + (u4)((in_grain + n) >> 9))
+          break;
+        grain++;
+        n += e->grain_size;
+      }
+    }
+    if (n > len - got)
+      n = len - got;
+
+    if (sector <= 1) {
+      /* unallocated (0) or zero grain (1) */
+      memset(p + got, 0, n);
+      got += n;
+    } else if (e->compressed) {
+      data = get_compressed_grain(vs, e, sector);
+      if (data == NULL)
+        break;
+      memcpy(p + got, data + in_grain, n);
+      got += n;
+    } else {
+      result = get_buffer_real(e->fs, e->off + (u8)sector * 512 + in_grain,
+                               n, p + got, NULL);
+      got += result;
+      if (result < n)
+        break;
+    }
+  }
+
+  return got;
+}
+
+/*
+ * look up where a grain is stored, in sectors; 0 and 1 mean it reads
+ * as zeros
+ */
+
+static u4 map_grain(VMDK_SOURCE *vs, VMDK_EXTENT *e, u8 grain, int *error)
+{
+  u4 *table;
+  u8 gd_index;
+
+  *error = 0;
+  gd_index = grain / e->gt_entries;
+  if (gd_index >= e->gd_count || e->gd[gd_index] == 0)
+    return 0;
+
+  table = get_grain_table(vs, e, e->gd[gd_index]);
+  if (table == NULL) {
+    *error = 1;
+    return 0;
+  }
+  return table[grain % e->gt_entries];
+}
+
+/*
+ * get a grain table through the LRU cache
+ */
+
+static u4 *get_grain_table(VMDK_SOURCE *vs, VMDK_EXTENT *e, u4 sector)
+{
+  GT_TABLE *t, *victim;
+  unsigned char *buf;
+  u8 size;
+  u4 i;
+
+  victim = &vs->gt_cache[0];
+  for (i = 0; i < GT_CACHE_SIZE; i++) {
+    t = &vs->gt_cache[i];
+    if (t->extent == e && t->sector == sector) {
+      t->used = ++vs->gt_clock;
+      return t->entries;
+    }
+    if (t->extent == NULL ||
+        (victim->extent != NULL && t->used < victim->used))
+      victim = t;
+  }
+
+  /* not there, load it into the least recently used slot; tables of
+     different extents may differ in size */
+  if (victim->entries != NULL)
+    free(victim->entries);
+  victim->entries = (u4 *)malloc(e->gt_entries * sizeof(u4));
+  if (victim->entries == NULL)
+    bailout("Out of memory");
+  victim->extent = NULL;
+  size = (u8)e->gt_entries * 4;
+  if (get_buffer_real(e->fs, e->off + (u8)sector * 512, size,
+                      NULL, (void **)&buf) < size)
+    return NULL;
+  for (i = 0; i < e->gt_entries; i++)
+    victim->entries[i] = get_le_long(buf + i * 4);
+  victim->extent = e;
+  victim->sector = sector;
+  victim->used = ++vs->gt_clock;
+  return victim->entries;
+}
+
+/*
+ * decompress a grain of a stream-optimized extent, the last one is kept
+ */
+
+static unsigned char *get_compressed_grain(VMDK_SOURCE *vs,
+                                           VMDK_EXTENT *e, u4 sector)
+{
+#ifdef USE_ZLIB
+  unsigned char *buf;
+  u4 size;
+  int result;
+
+  if (vs->z_out != NULL && vs->z_extent == e && vs->z_sector == sector)
+    return vs->z_out;
+
+  /* grain marker: guest sector and size of the compressed data */
+  if (get_buffer_real(e->fs, e->off + (u8)sector * 512, 12, NULL,
+                      (void **)&buf) < 12)
+    return NULL;
+  size = get_le_long(buf + 8);
+  if (size == 0 || size > 2 * e->grain_size + 4096)
+    return NULL;
+
+  if (vs->z_in_size < size) {
+    if (vs->z_in != NULL)
+      free(vs->z_in);
+    vs->z_in = (unsigned char *)malloc(size);
+    if (vs->z_in == NULL)
+      bailout("Out of memory");
+    vs->z_in_size = size;
+  }
+  /* all extents of a disk share the grain size in practice, but
+     don't count on it */
+  if (vs->z_out_size < e->grain_size) {
+    if (vs->z_out != NULL)
+      free(vs->z_out);
+    vs->z_out = (unsigned char *)malloc(e->grain_size);
+    if (vs->z_out == NULL)
+      bailout("Out of memory");
+    vs->z_out_size = e->grain_size;
+  }
+  vs->z_extent = NULL;
+
+  if (get_buffer_real(e->fs, e->off + (u8)sector * 512 + 12, size,
+                      vs->z_in, NULL) < size)
+    return NULL;
+
+  /* deflate data with a zlib header */
+  if (!vs->zs_init) {
+    memset(&vs->zs, 0, sizeof(vs->zs));
+    if (inflateInit(&vs->zs) != Z_OK)
+      return NULL;
+    vs->zs_init = 1;
+  } else {
+    inflateReset(&vs->zs);
+  }
+  vs->zs.next_in = vs->z_in;
+  vs->zs.avail_in = size;
+  vs->zs.next_out = vs->z_out;
+  vs->zs.avail_out = e->grain_size;
+  result = inflate(&vs->zs, Z_FINISH);
+  if (result != Z_STREAM_END && !(result == Z_BUF_ERROR &&
+                                  vs->zs.avail_out == 0))
+    return NULL;
+  /* the last grain of the disk may be short */
+  if (vs->zs.avail_out > 0)
+    memset(vs->zs.next_out, 0, vs->zs.avail_out);
+
+  vs->z_extent = e;
+  vs->z_sector = sector;
+  return vs->z_out;
+#else
+  /* no zlib, no compressed grains */
+  return NULL;
+#endif
+}
+
+/*
+ * cleanup
+ */
+
+static void close_vmdk(SOURCE *s)
+{
+  VMDK_SOURCE *vs = (VMDK_SOURCE *)s;
+  VMDK_EXTENT *e;
+  int i;
+
+  for (i = 0; i < GT_CACHE_SIZE; i++) {
+    if (vs->gt_cache[i].entries != NULL)
+      free(vs->gt_cache[i].entries);
+  }
+
+  if (vs->extents != NULL) {
+    for (i = 0; i < vs->extent_count; i++) {
+      e = &vs->extents[i];
+      if (e->gd != NULL)
+        free(e->gd);
+      if (e->file != NULL)
+        close_source(e->file);
+    }
+    free(vs->extents);
+  }
+
+  if (vs->z_out != NULL)
+    free(vs->z_out);
+  if (vs->z_in != NULL)
+    free(vs->z_in);
+#ifdef USE_ZLIB
+  if (vs->zs_init)
+    inflateEnd(&vs->zs);
+#endif
+}
+
+/* EOF */
@@ -1,6 +1,7 @@
 /*
  * vpc.c
- * Layered data source for Virtual PC hard disk images.
+ * Layered data source for Virtual PC hard disk images, on top of the
+ * block allocation table engine in bat.c.
  *
  * Copyright (c) 2003 Christoph Pfisterer
  *
@@ -27,23 +28,36 @@
 
 #include "global.h"
 
+/* test a sector's bit in a chunk bitmap */
+#define SECTOR_PRESENT(bitmap, sector) \
+  (((bitmap)[(sector) >> 3] & (128 >> ((sector) & 7))) != 0)
+
+/* longest parent chain we follow */
+#define MAXCHAIN (32)
+/* owner entry for sectors no layer has written to */
+#define NO_OWNER (0xff)
+
 /*
  * types
  */
 
-typedef struct vhd_chunk {
-  int present;
-  u8 off;
-  u1 bitmap[1];
-} VHD_CHUNK;
+typedef struct vhd_layer {
+  SOURCE *foundation;
+  SOURCE *file;      /* opened for this layer, NULL for the image itself */
+  u8 off;            /* fixed size images: start of the data */
+  u8 size;
+  u4 chunk_count;
+  u8 *chunk_map;     /* bitmap position in the foundation or BAT_ABSENT;
+                        NULL for fixed size images; the image's own
+                        map is the block table of the BAT source */
+  u1 **bitmaps;      /* loaded on first use */
+} VHD_LAYER;
 
 typedef struct vhd_source {
-  SOURCE c;
-  u8 off;
-  u4 chunk_size;
-  u4 chunk_count;
-  u4 *raw_map;
-  VHD_CHUNK **chunks;
+  BAT_SOURCE b;      /* chunks are the blocks */
+  int layer_count;
+  VHD_LAYER layers[MAXCHAIN];
+  u1 **owners;       /* per chunk, the layer owning each sector */
 } VHD_SOURCE;
 
 /*
@@ -51,9 +65,29 @@ typedef struct vhd_source {
  */
 
 static SOURCE *init_vhd_source(SECTION *section, int level,
-                               u8 total_size, u8 sparse_offset);
-static int read_block_vhd(SOURCE *s, u8 pos, void *buf);
-static void close_vhd(SOURCE *s);
+                               u8 total_size, u8 sparse_offset, int type);
+static int check_vhd_map(int level, SOURCE *fs, u8 off, u8 size,
+                         unsigned char *header, u4 *count);
+static int load_vhd_map(VHD_SOURCE *vs, VHD_LAYER *layer, int level,
+                        SOURCE *fs, u8 off, unsigned char *header);
+static int open_vhd_parent(VHD_SOURCE *vs, int level, const char *path,
+                           SOURCE *fs, u8 off, unsigned char *header,
+                           char **parent_path, unsigned char *parent_header,
+                           int *parent_type);
+static char *try_vhd_parent(VHD_SOURCE *vs, int level, const char *path,
+                            const char *name, unsigned char *uuid,
+                            unsigned char *parent_header, int *parent_type);
+static void free_vhd_layer(VHD_LAYER *layer);
+static void utf16_to_path(unsigned char *from, u4 len, int big_endian,
+                          char *to);
+static u8 map_vhd(BAT_SOURCE *bs, u4 chunk, u4 rel, u8 len,
+                  SOURCE **from, u8 *from_pos);
+static int find_owner_run(VHD_SOURCE *vs, u4 chunk, u4 sector, u4 last,
+                          u4 *run_end);
+static u1 *get_vhd_owners(VHD_SOURCE *vs, u4 chunk);
+static u1 *get_vhd_bitmap(VHD_LAYER *layer, u4 chunk);
+static u4 find_run_end(u1 *bitmap, u4 sector, u4 last, int present);
+static void close_vhd(BAT_SOURCE *bs);
 
 /*
  * cd image detection
@@ -78,8 +112,12 @@ void detect_vhd(SECTION *section, int level)
 
   /* check for info block at the end if possible */
   if (!found && section->size > 1024 && !section->source->sequential) {
-    if (get_buffer(section, section->size - 511, 511, (void **)&buf) < 511)
+    if (get_buffer(section, section->size - 511, 511, (void **)&buf) < 511) {
+      if (beyond_budget(section, section->size - 511, 511))
+        print_line(level, "Virtual PC footer not checked, beyond "
+                   "decompression budget");
       return;
+    }
     if (memcmp(buf, "conectix", 8) == 0) {
       found = 1;
     }
@@ -105,11 +143,12 @@ void detect_vhd(SECTION *section, int level)
   format_size_verbose(s, total_size);
   print_line(level + 1, "Disk size %s", s);
 
-  if (type == 3) {
-    /* dynamically sized, set up a mapping data source */
+  if (type == 3 || type == 4) {
+    /* dynamically sized, set up a mapping data source; differential
+       images get their parents stacked underneath */
     sparse_offset = get_be_quad(buf + 16);
 
-    src = init_vhd_source(section, level, total_size, sparse_offset);
+    src = init_vhd_source(section, level, total_size, sparse_offset, type);
 
     if (src != NULL) {
       /* analyze it */
@@ -127,170 +166,593 @@ void detect_vhd(SECTION *section, int level)
  */
 
 static SOURCE *init_vhd_source(SECTION *section, int level,
-                               u8 total_size, u8 sparse_offset)
+                               u8 total_size, u8 sparse_offset, int type)
 {
   VHD_SOURCE *vs;
-  unsigned char *buf;
-  u8 map_offset;
-  u4 map_size;
-  char s[256];
-
-  /* allocate and init source structure */
-  vs = (VHD_SOURCE *)malloc(sizeof(VHD_SOURCE));
-  if (vs == NULL)
-    bailout("Out of memory");
-  memset(vs, 0, sizeof(VHD_SOURCE));
-
-  vs->c.size_known = 1;
-  vs->c.size = total_size;
-  vs->c.blocksize = 512;
-  vs->c.foundation = section->source;
-  vs->c.read_block = read_block_vhd;
-  vs->c.close = close_vhd;
-  vs->off = section->pos;
+  VHD_LAYER *layer;
+  unsigned char *buf, header[1024], parent_header[1024];
+  const char *root_path;
+  char *path, *parent_path, s[256];
+  int parent_type;
+  u4 chunk_count;
 
   /* read sparse information block */
-  if (get_buffer(section, sparse_offset, 512, (void **)&buf) < 512) {
+  if (get_buffer(section, sparse_offset, 1024, (void **)&buf) < 1024) {
     print_line(level + 1, "Error reading the sparse image info block");
-    goto errorexit;
+    return NULL;
   }
-  map_offset = get_be_quad(buf + 16);
-  vs->chunk_count = get_be_long(buf + 28);
-  vs->chunk_size = get_be_long(buf + 32);
+  memcpy(header, buf, 1024);
 
-  format_size(s, vs->chunk_size);
+  format_size(s, get_be_long(header + 32));
   print_line(level + 1, "Dynamic sizing uses %lu chunks of %s",
-             vs->chunk_count, s);
+             get_be_long(header + 28), s);
+  if (!check_vhd_map(level, section->source, section->pos, total_size,
+                     header, &chunk_count))
+    return NULL;
 
-  if ((u8)vs->chunk_count * vs->chunk_size < total_size) {
-    print_line(level + 1, "Error: Sparse parameters don't match total size");
+  /* allocate and init source structure */
+  vs = (VHD_SOURCE *)init_bat_source(section->source, "vhd",
+                                     sizeof(VHD_SOURCE), total_size,
+                                     get_be_long(header + 32), chunk_count);
+  vs->b.map = map_vhd;
+  vs->b.cleanup = close_vhd;
+
+  layer = &vs->layers[vs->layer_count++];
+  layer->foundation = section->source;
+  layer->size = total_size;
+  layer->chunk_map = vs->b.blocks;
+  if (!load_vhd_map(vs, layer, level, section->source, section->pos, header))
     goto errorexit;
+
+  /* parents are looked for next to the file we were given */
+  root_path = get_source_path(section->source);
+  path = (char *)root_path;
+  parent_path = NULL;
+
+  while (type == 4) {
+    if (vs->layer_count >= MAXCHAIN) {
+      print_line(level + 1, "Error: Parent chain too long");
+      goto errorexit;
+    }
+    if (path == NULL) {
+      print_line(level + 1, "Error: Can't look for the parent image "
+                 "without a file name");
+      goto errorexit;
+    }
+    layer = &vs->layers[vs->layer_count - 1];
+    if (!open_vhd_parent(vs, level, path, layer->foundation,
+                         layer->file != NULL ? 0 : section->pos, header,
+                         &parent_path, parent_header, &parent_type))
+      goto errorexit;
+    if (path != root_path)
+      free(path);
+    path = parent_path;
+    type = parent_type;
+    memcpy(header, parent_header, 1024);
+  }
+  if (path != root_path)
+    free(path);
+
+  if (vs->layer_count > 1) {
+    vs->owners = (u1 **)malloc(vs->b.block_count * sizeof(u1 *));
+    if (vs->owners == NULL)
+      bailout("Out of memory");
+    memset(vs->owners, 0, vs->b.block_count * sizeof(u1 *));
   }
-  if (vs->chunk_size < 4096) {
+
+  return (SOURCE *)vs;
+
+errorexit:
+  close_source((SOURCE *)vs);
+  return NULL;
+}
+
+/*
+ * check a layer's chunk map parameters against the disk and the file;
+ * count is set to the number of map entries that cover the disk
+ */
+
+static int check_vhd_map(int level, SOURCE *fs, u8 off, u8 size,
+                         unsigned char *header, u4 *count)
+{
+  u8 map_offset, needed;
+  u4 chunk_count, chunk_size;
+
+  map_offset = get_be_quad(header + 16);
+  chunk_count = get_be_long(header + 28);
+  chunk_size = get_be_long(header + 32);
+
+  if (chunk_size < 4096) {
     print_line(level + 1, "Error: Sparse chunk size too small (%lu bytes)",
-               vs->chunk_size);
-    goto errorexit;
+               chunk_size);
+    return 0;
   }
-  if (vs->chunk_size > 2*1024*1024) {
+  if (chunk_size > 2*1024*1024) {
     /* written-to bitmap wouldn't fit in one sector */
     print_line(level + 1, "Error: Sparse chunk size too large (%lu bytes)",
-               vs->chunk_size);
-    goto errorexit;
+               chunk_size);
+    return 0;
+  }
+  /* entries past the end of the disk are never used */
+  needed = (size + chunk_size - 1) / chunk_size;
+  if (chunk_count < needed) {
+    print_line(level + 1, "Error: Sparse parameters don't match total size");
+    return 0;
+  }
+  if (fs->size_known && (off + map_offset > fs->size ||
+                         needed * 4 > fs->size - off - map_offset)) {
+    print_line(level + 1, "Error: Sparse image map extends past the end "
+               "of the file");
+    return 0;
+  }
+
+  *count = (u4)needed;
+  return 1;
+}
+
+/*
+ * read the chunk map of one layer and decode it once
+ */
+
+static int load_vhd_map(VHD_SOURCE *vs, VHD_LAYER *layer, int level,
+                        SOURCE *fs, u8 off, unsigned char *header)
+{
+  unsigned char *raw_map;
+  u8 map_offset;
+  u4 map_size, chunk, start, chunk_size;
+
+  map_offset = get_be_quad(header + 16);
+  chunk_size = get_be_long(header + 32);
+
+  if (!check_vhd_map(level, fs, off, layer->size, header,
+                     &layer->chunk_count))
+    return 0;
+  if (chunk_size != vs->b.block_size) {
+    print_line(level + 1, "Error: Parent uses a different chunk size");
+    return 0;
   }
 
   /* allocate further data structures */
-  map_size = vs->chunk_count * 4;
-  vs->raw_map = (u4 *)malloc(map_size);
-  if (vs->raw_map == NULL)
+  map_size = layer->chunk_count * 4;
+  raw_map = (unsigned char *)malloc(map_size ? map_size : 1);
+  if (raw_map == NULL)
     bailout("Out of memory");
-  vs->chunks = (VHD_CHUNK **)malloc(vs->chunk_count * sizeof(VHD_CHUNK *));
-  if (vs->chunks == NULL)
+  if (layer->chunk_map == NULL) {
+    layer->chunk_map = (u8 *)malloc(layer->chunk_count * sizeof(u8));
+    if (layer->chunk_map == NULL)
+      bailout("Out of memory");
+  }
+  layer->bitmaps = (u1 **)malloc(layer->chunk_count * sizeof(u1 *));
+  if (layer->bitmaps == NULL)
     bailout("Out of memory");
-  memset(vs->chunks, 0, vs->chunk_count * sizeof(VHD_CHUNK *));
+  memset(layer->bitmaps, 0, layer->chunk_count * sizeof(u1 *));
 
-  /* read the chunk map */
-  if (get_buffer_real(section->source, vs->off + map_offset, map_size,
-                      (void *)vs->raw_map, NULL) < map_size) {
+  /* read the chunk map and decode it once */
+  if (get_buffer_real(fs, off + map_offset, map_size,
+                      (void *)raw_map, NULL) < map_size) {
     print_line(level + 1, "Error reading the sparse image map");
-    goto errorexit;
+    free(raw_map);
+    return 0;
+  }
+  for (chunk = 0; chunk < layer->chunk_count; chunk++) {
+    start = get_be_long(raw_map + chunk * 4);
+    if (start == 0xffffffff)
+      layer->chunk_map[chunk] = BAT_ABSENT;
+    else
+      layer->chunk_map[chunk] = off + (u8)start * 512;
   }
+  free(raw_map);
 
-  return (SOURCE *)vs;
+  return 1;
+}
 
-errorexit:
-  close_vhd((SOURCE *)vs);
-  free(vs);
-  return NULL;
+/*
+ * find and open the parent of a differential image, using the parent
+ * locators and then the parent's name, relative to the child's path
+ */
+
+static int open_vhd_parent(VHD_SOURCE *vs, int level, const char *path,
+                           SOURCE *fs, u8 off, unsigned char *header,
+                           char **parent_path, unsigned char *parent_header,
+                           int *parent_type)
+{
+  unsigned char *loc, *buf;
+  char name[1024], *p;
+  u4 code, len, i;
+  u8 data_off;
+
+  for (i = 0; i < 9; i++) {
+    if (i < 8) {
+      /* parent locator entries */
+      loc = header + 576 + i * 24;
+      code = get_be_long(loc);
+      len = get_be_long(loc + 8);
+      data_off = get_be_quad(loc + 16);
+      if (len == 0 || len > 512)
+        continue;
+      if (code != 0x57327275 && code != 0x57326B75 &&  /* W2ru, W2ku */
+          code != 0x4D616358)                          /* MacX */
+        continue;
+      if (get_buffer_real(fs, off + data_off, len, NULL,
+                          (void **)&buf) < len)
+        continue;
+      if (code == 0x4D616358) {
+        memcpy(name, buf, len);
+        name[len] = 0;
+        /* file://localhost/path or file:///path */
+        if (strncmp(name, "file://", 7) == 0) {
+          p = strchr(name + 7, '/');
+          if (p == NULL)
+            continue;
+          memmove(name, p, strlen(p) + 1);
+        }
+      } else {
+        utf16_to_path(buf, len, 0, name);
+      }
+    } else {
+      /* last resort: the parent's name from the header */
+      utf16_to_path(header + 64, 512, 1, name);
+      if (name[0] == 0)
+        break;
+    }
+
+    *parent_path = try_vhd_parent(vs, level, path, name, header + 40,
+                                  parent_header, parent_type);
+    if (*parent_path != NULL)
+      return 1;
+  }
+
+  utf16_to_path(header + 64, 512, 1, name);
+  print_line(level + 1, "Error: No matching parent image \"%s\" found", name);
+  return 0;
 }
 
 /*
- * mapping read
+ * try to open one parent candidate and stack it as the next layer
  */
 
-static int read_block_vhd(SOURCE *s, u8 pos, void *buf)
+static char *try_vhd_parent(VHD_SOURCE *vs, int level, const char *path,
+                            const char *name, unsigned char *uuid,
+                            unsigned char *parent_header, int *parent_type)
 {
-  VHD_SOURCE *vs = (VHD_SOURCE *)s;
-  SOURCE *fs = s->foundation;
-  u4 chunk, chunk_start_sector, sector;
-  u8 chunk_disk_off, sector_pos;
-  unsigned char *filebuf;
-  int present;
+  VHD_LAYER *layer;
+  SOURCE *fs;
+  SECTION section;
+  unsigned char *buf;
+  char *full;
+  const char *base;
+  int fd, type;
+  u8 size;
+
+  /* windows-style relative paths */
+  if (strncmp(name, "./", 2) == 0)
+    name += 2;
+
+  /* relative names are resolved against the child's directory */
+  full = get_related_path(path, name);
+  fd = open_related_file(full);
+  if (fd < 0 && (name[0] == '/' || (name[0] != 0 && name[1] == ':'))) {
+    /* absolute path from another machine, try the name alone */
+    base = strrchr(name, '/');
+    base = (base != NULL) ? base + 1 : name + 2;
+    free(full);
+    full = get_related_path(path, base);
+    fd = open_related_file(full);
+  }
+  if (fd < 0) {
+    free(full);
+    return NULL;
+  }
 
-  chunk = (u4)(pos / vs->chunk_size);
-  if (chunk >= vs->chunk_count)
-    return 0;
+  fs = init_file_source(fd, 0);
+  section.source = fs;
+  section.pos = 0;
+  section.size = fs->size;
+  section.flags = 0;
+
+  /* the parent's footer, with the copy at the start for sparse types */
+  if (get_buffer(&section, 0, 512, (void **)&buf) < 512 ||
+      memcmp(buf, "conectix", 8) != 0) {
+    if (fs->size < 1024 ||
+        get_buffer(&section, fs->size - 512, 512, (void **)&buf) < 512 ||
+        memcmp(buf, "conectix", 8) != 0) {
+      close_source(fs);
+      free(full);
+      return NULL;
+    }
+  }
+  if (memcmp(buf + 68, uuid, 16) != 0) {
+    /* some other image of the same name */
+    close_source(fs);
+    free(full);
+    return NULL;
+  }
+  type = get_be_long(buf + 0x3c);
+  size = get_be_quad(buf + 0x28);
+  if (type == 3 || type == 4) {
+    if (get_buffer(&section, get_be_quad(buf + 16), 1024,
+                   (void **)&buf) < 1024) {
+      close_source(fs);
+      free(full);
+      return NULL;
+    }
+    memcpy(parent_header, buf, 1024);
+  } else if (type != 2) {
+    close_source(fs);
+    free(full);
+    return NULL;
+  }
 
-  if (vs->chunks[chunk] == NULL) {
-    /* create data structure for the chunk */
+  print_line(level + 1, "Parent image %s, %s", full,
+             type == 2 ? "fixed size" :
+             type == 3 ? "dynamic size" : "differential");
 
-    chunk_start_sector = get_be_long(vs->raw_map + chunk);
-    /* NOTE: raw_map is a u4*, so C does the arithmetics for us */
+  layer = &vs->layers[vs->layer_count++];
+  layer->foundation = fs;
+  layer->file = fs;
+  layer->size = size;
+  if (type == 2) {
+    layer->chunk_count = (u4)((size + vs->b.block_size - 1) /
+                              vs->b.block_size);
+  } else if (!load_vhd_map(vs, layer, level, fs, 0, parent_header)) {
+    free_vhd_layer(layer);
+    vs->layer_count--;
+    free(full);
+    return NULL;
+  }
 
-    if (chunk_start_sector == 0xffffffff) {
-      present = 0;
-    } else {
-      chunk_disk_off = vs->off + (u8)chunk_start_sector * 512;
-      if (get_buffer_real(fs, chunk_disk_off, 512,
-                          NULL, (void **)&filebuf) < 512)
-        present = 0;
-      else
-        present = 1;
+  *parent_type = type;
+  return full;
+}
+
+/*
+ * free what one layer of the chain holds
+ */
+
+static void free_vhd_layer(VHD_LAYER *layer)
+{
+  u4 chunk;
+
+  /* free decoded chunk map, unless it belongs to the BAT source */
+  if (layer->chunk_map != NULL && layer->file != NULL)
+    free(layer->chunk_map);
+
+  /* free chunk bitmaps */
+  if (layer->bitmaps != NULL) {
+    for (chunk = 0; chunk < layer->chunk_count; chunk++) {
+      if (layer->bitmaps[chunk] != NULL)
+        free(layer->bitmaps[chunk]);
     }
+    free(layer->bitmaps);
+  }
+
+  /* parent image files we opened */
+  if (layer->file != NULL)
+    close_source(layer->file);
+  memset(layer, 0, sizeof(VHD_LAYER));
+}
+
+/*
+ * convert a UTF-16 path from a parent locator, with backslashes
+ * turned into slashes; non-ASCII characters are encoded as UTF-8
+ */
 
-    if (!present) {
-      vs->chunks[chunk] = (VHD_CHUNK *)malloc(sizeof(VHD_CHUNK));
-      if (vs->chunks[chunk] == NULL)
-        bailout("Out of memory");
-      vs->chunks[chunk]->present = 0;
+static void utf16_to_path(unsigned char *from, u4 len, int big_endian,
+                          char *to)
+{
+  u4 i;
+  u2 c;
+  char *q = to;
+
+  for (i = 0; i + 1 < len; i += 2) {
+    c = big_endian ? get_be_short(from + i) : get_le_short(from + i);
+    if (c == 0)
+      break;
+    if (c == '\\')
+      c = '/';
+    if (c < 0x80) {
+      *q++ = (char)c;
+    } else if (c < 0x800) {
+      *q++ = (char)(0xc0 | (c >> 6));
+      *q++ = (char)(0x80 | (c & 0x3f));
     } else {
-      vs->chunks[chunk] = (VHD_CHUNK *)malloc(sizeof(VHD_CHUNK) + 512);
-      if (vs->chunks[chunk] == NULL)
-        bailout("Out of memory");
-      vs->chunks[chunk]->present = 1;
-      vs->chunks[chunk]->off = chunk_disk_off + 512;
-      memcpy(vs->chunks[chunk]->bitmap, filebuf, 512);
+      *q++ = (char)(0xe0 | (c >> 12));
+      *q++ = (char)(0x80 | ((c >> 6) & 0x3f));
+      *q++ = (char)(0x80 | (c & 0x3f));
     }
   }
+  *q = 0;
+}
+
+/*
+ * map hook for the BAT engine: the run of sectors at rel that comes
+ * from the same layer (or from none); the engine merges runs across
+ * chunks
+ */
 
-  if (!vs->chunks[chunk]->present) {
-    /* whole chunk is missing */
-    memset(buf, 0, 512);
-    return 1;
+static u8 map_vhd(BAT_SOURCE *bs, u4 chunk, u4 rel, u8 len,
+                  SOURCE **from, u8 *from_pos)
+{
+  VHD_SOURCE *vs = (VHD_SOURCE *)bs;
+  VHD_LAYER *layer;
+  u4 sector, last, run_end;
+  u8 n, end;
+  int owner;
+
+  end = rel + len;
+  sector = rel >> 9;
+  last = (u4)((end + 511) >> 9);
+  owner = find_owner_run(vs, chunk, sector, last, &run_end);
+  n = (u8)run_end << 9;
+  if (n > end)
+    n = end;
+  n -= rel;
+
+  if (owner < 0) {
+    /* not written to (although it may be present on disk) */
+    *from = NULL;
+    return n;
   }
 
-  sector = (u4)((pos - (u8)chunk * vs->chunk_size) / 512);
-  if (vs->chunks[chunk]->bitmap[sector >> 3] & (128 >> (sector & 7))) {
-    /* sector is present and in use */
-    sector_pos = vs->chunks[chunk]->off + (u8)sector * 512;
-    if (get_buffer_real(fs, sector_pos, 512, buf, NULL) < 512)
-      return 0;
-  } else {
-    /* sector has not been written to (although it's present on disk) */
-    memset(buf, 0, 512);
+  layer = &vs->layers[owner];
+  *from = layer->foundation;
+  if (layer->chunk_map == NULL)  /* fixed size */
+    *from_pos = layer->off + (u8)chunk * bs->block_size + rel;
+  else  /* the data follows the bitmap sector */
+    *from_pos = layer->chunk_map[chunk] + 512 + rel;
+  return n;
+}
+
+/*
+ * find the layer holding a sector and how far that goes; -1 means no
+ * layer has it
+ */
+
+static int find_owner_run(VHD_SOURCE *vs, u4 chunk, u4 sector, u4 last,
+                          u4 *run_end)
+{
+  u1 *bitmap, *owners;
+  int present;
+
+  if (vs->layer_count == 1) {
+    /* plain dynamic image, the bitmap says it all */
+    bitmap = get_vhd_bitmap(&vs->layers[0], chunk);
+    if (bitmap == NULL) {
+      /* whole chunk is missing */
+      *run_end = last;
+      return -1;
+    }
+    present = SECTOR_PRESENT(bitmap, sector);
+    *run_end = find_run_end(bitmap, sector, last, present);
+    return present ? 0 : -1;
   }
-  return 1;
+
+  owners = get_vhd_owners(vs, chunk);
+  for (*run_end = sector + 1; *run_end < last; (*run_end)++) {
+    if (owners[*run_end] != owners[sector])
+      break;
+  }
+  return owners[sector] == NO_OWNER ? -1 : owners[sector];
+}
+
+/*
+ * get the owner table of a chunk in a parent chain, built on first use
+ * by walking the layers from the top
+ */
+
+static u1 *get_vhd_owners(VHD_SOURCE *vs, u4 chunk)
+{
+  VHD_LAYER *layer;
+  u1 *owners, *bitmap;
+  u4 sectors, sector, layer_sectors;
+  u8 chunk_pos;
+  int i;
+
+  if (vs->owners[chunk] != NULL)
+    return vs->owners[chunk];
+
+  sectors = vs->b.block_size >> 9;
+  owners = (u1 *)malloc(sectors);
+  if (owners == NULL)
+    bailout("Out of memory");
+  memset(owners, NO_OWNER, sectors);
+
+  chunk_pos = (u8)chunk * vs->b.block_size;
+  for (i = 0; i < vs->layer_count; i++) {
+    layer = &vs->layers[i];
+    if (layer->chunk_map == NULL) {
+      /* fixed size, has everything up to its end */
+      if (chunk_pos >= layer->size)
+        continue;
+      layer_sectors = sectors;
+      if (layer->size - chunk_pos < vs->b.block_size)
+        layer_sectors = (u4)((layer->size - chunk_pos) >> 9);
+      for (sector = 0; sector < layer_sectors; sector++) {
+        if (owners[sector] == NO_OWNER)
+          owners[sector] = (u1)i;
+      }
+      continue;
+    }
+    bitmap = get_vhd_bitmap(layer, chunk);
+    if (bitmap == NULL)
+      continue;
+    for (sector = 0; sector < sectors; sector++) {
+      if (owners[sector] == NO_OWNER && SECTOR_PRESENT(bitmap, sector))
+        owners[sector] = (u1)i;
+    }
+  }
+
+  vs->owners[chunk] = owners;
+  return owners;
+}
+
+/*
+ * get a chunk's sector bitmap, NULL if the chunk is not allocated
+ */
+
+static u1 *get_vhd_bitmap(VHD_LAYER *layer, u4 chunk)
+{
+  if (chunk >= layer->chunk_count || layer->chunk_map[chunk] == BAT_ABSENT)
+    return NULL;
+
+  if (layer->bitmaps[chunk] == NULL) {
+    layer->bitmaps[chunk] = (u1 *)malloc(512);
+    if (layer->bitmaps[chunk] == NULL)
+      bailout("Out of memory");
+    if (get_buffer_real(layer->foundation, layer->chunk_map[chunk], 512,
+                        layer->bitmaps[chunk], NULL) < 512) {
+      /* treat it as missing from now on */
+      free(layer->bitmaps[chunk]);
+      layer->bitmaps[chunk] = NULL;
+      layer->chunk_map[chunk] = BAT_ABSENT;
+      return NULL;
+    }
+  }
+  return layer->bitmaps[chunk];
+}
+
+/*
+ * find where a run of present (or absent) sectors ends; whole bytes
+ * are skipped at once
+ */
+
+static u4 find_run_end(u1 *bitmap, u4 sector, u4 last, int present)
+{
+  u1 same = present ? 0xff : 0x00;
+
+  while (sector < last) {
+    if ((sector & 7) == 0 && sector + 8 <= last &&
+        bitmap[sector >> 3] == same) {
+      sector += 8;
+      continue;
+    }
+    if (SECTOR_PRESENT(bitmap, sector) != present)
+      break;
+    sector++;
+  }
+  return sector;
 }
 
 /*
  * cleanup
  */
 
-static void close_vhd(SOURCE *s)
+static void close_vhd(BAT_SOURCE *bs)
 {
-  VHD_SOURCE *vs = (VHD_SOURCE *)s;
+  VHD_SOURCE *vs = (VHD_SOURCE *)bs;
   u4 chunk;
+  int i;
 
-  /* free raw chunk map */
-  if (vs->raw_map != NULL)
-    free(vs->raw_map);
+  for (i = 0; i < vs->layer_count; i++)
+    free_vhd_layer(&vs->layers[i]);
 
-  /* free chunk info data */
-  if (vs->chunks != NULL) {
-    for (chunk = 0; chunk < vs->chunk_count; chunk++) {
-      if (vs->chunks[chunk] != NULL)
-        free(vs->chunks[chunk]);
+  /* free owner tables */
+  if (vs->owners != NULL) {
+    for (chunk = 0; chunk < vs->b.block_count; chunk++) {
+      if (vs->owners[chunk] != NULL)
+        free(vs->owners[chunk]);
     }
-    free(vs->chunks);
+    free(vs->owners);
   }
 }
 
@@ -0,0 +1,444 @@
+/*
+ * xz.c
+ * Layered data source for xz data, decoded block by block.
+ *
+ * Copyright (c) 2026 The disktype contributors
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "global.h"
+
+#ifdef USE_LZMA
+
+#include <lzma.h>
+#include <pthread.h>
+#include <time.h>
+
+/* the file info decoder is there from 5.4 on */
+#if LZMA_VERSION < 50040002
+#undef USE_LZMA
+#endif
+
+#endif
+
+#ifdef USE_LZMA
+
+/*
+ * An xz file ends in an index listing where each block's compressed
+ * data is and how much it decodes to. Blocks don't depend on each
+ * other, so once the index is read each one can be decoded on a
+ * separate thread, and any place in the data is reached by decoding
+ * just the block holding it.
+ */
+
+/* the most blocks decoded at once */
+#define MAXWORKERS (8)
+
+/* blocks larger than this aren't worth random access: reaching the end
+   of one would mean decoding all of it, so such data is left to the
+   streaming decoder in compressed.c */
+#define MAXBLOCK (64*1024*1024)
+
+/* decoded data held by the job slots at most */
+#define JOBMEMORY (256*1024*1024)
+
+/*
+ * types
+ */
+
+typedef struct xz_block {
+  u8 in_start, in_len;     /* relative to the source's offset */
+  u8 unpadded;
+  u8 out_start, out_len;
+  lzma_check check;
+} XZ_BLOCK;
+
+typedef struct xz_job {
+  int block;               /* -1 if the slot holds nothing */
+  unsigned char *raw, *out;
+  u8 raw_alloc, out_alloc;
+  XZ_BLOCK b;
+  int ok;
+} XZ_JOB;
+
+typedef struct xz_source {
+  SOURCE c;
+  u8 offset;
+  XZ_BLOCK *blocks;
+  int block_count;
+  /* the blocks of the last batch */
+  XZ_JOB jobs[MAXWORKERS];
+  int workers, failed;
+  /* for the decompression budget */
+  u8 decoded;
+  time_t started;
+} XZ_SOURCE;
+
+/*
+ * helper functions
+ */
+
+static u8 read_xz(SOURCE *s, u8 pos, u8 len, void *buf);
+static void close_xz(SOURCE *s);
+static lzma_index *read_index(SOURCE *foundation, u8 offset, u8 size);
+static int find_block(XZ_SOURCE *xs, u8 pos);
+static void run_batch(XZ_SOURCE *xs, int first, int count);
+static int gather_job(XZ_SOURCE *xs, XZ_JOB *job, int block);
+static void *decode_job(void *arg);
+
+/*
+ * initialize the block decoding source, returns NULL if the data must be
+ * streamed instead
+ */
+
+SOURCE *init_xz_source(SOURCE *foundation, u8 offset, u8 size)
+{
+  XZ_SOURCE *xs;
+  XZ_BLOCK *b;
+  lzma_index *index;
+  lzma_index_iter iter;
+  u8 count, largest;
+  long cpus;
+  int i;
+
+  /* the index is found from the end, and blocks are revisited */
+  if (foundation->sequential || size == 0)
+    return NULL;
+
+  index = read_index(foundation, offset, size);
+  if (index == NULL)
+    return NULL;
+
+  /* a single block gains nothing over streaming it */
+  count = lzma_index_block_count(index);
+  largest = 0;
+  lzma_index_iter_init(&iter, index);
+  while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_NONEMPTY_BLOCK))
+    if (iter.block.uncompressed_size > largest)
+      largest = iter.block.uncompressed_size;
+  if (count < 2 || count > 0x1000000 || largest > MAXBLOCK) {
+    lzma_index_end(index, NULL);
+    return NULL;
+  }
+
+  xs = (XZ_SOURCE *)malloc(sizeof(XZ_SOURCE));
+  if (xs == NULL)
+    bailout("Out of memory");
+  memset(xs, 0, sizeof(XZ_SOURCE));
+  xs->blocks = (XZ_BLOCK *)malloc(count * sizeof(XZ_BLOCK));
+  if (xs->blocks == NULL)
+    bailout("Out of memory");
+
+  lzma_index_iter_init(&iter, index);
+  while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_NONEMPTY_BLOCK)) {
+    b = &xs->blocks[xs->block_count++];
+    b->in_start = iter.block.compressed_file_offset;
+    b->in_len = iter.block.total_size;
+    b->unpadded = iter.block.unpadded_size;
+    b->out_start = iter.block.uncompressed_file_offset;
+    b->out_len = iter.block.uncompressed_size;
+    b->check = iter.stream.flags->check;
+  }
+
+  xs->c.name = "xz";
+  xs->c.foundation = foundation;
+  xs->c.read_bytes = read_xz;
+  xs->c.close = close_xz;
+  xs->c.size_known = 1;
+  xs->c.size = lzma_index_uncompressed_size(index);
+  lzma_index_end(index, NULL);
+
+  xs->offset = offset;
+  xs->started = time(NULL);
+  for (i = 0; i < MAXWORKERS; i++)
+    xs->jobs[i].block = -1;
+
+  cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  xs->workers = (cpus < 1) ? 1 : (cpus > MAXWORKERS) ? MAXWORKERS : cpus;
+  if (largest > 0 && (u8)xs->workers * largest > JOBMEMORY)
+    xs->workers = (int)(JOBMEMORY / largest);
+  if (xs->workers < 1)
+    xs->workers = 1;
+
+  return (SOURCE *)xs;
+}
+
+/*
+ * raw read: copy from the decoded blocks, decoding them as needed
+ */
+
+static u8 read_xz(SOURCE *s, u8 pos, u8 len, void *buf)
+{
+  XZ_SOURCE *xs = (XZ_SOURCE *)s;
+  XZ_BLOCK *b;
+  XZ_JOB *job;
+  int block, i;
+  u8 got, rel, avail;
+
+  got = 0;
+  while (got < len) {
+    block = find_block(xs, pos + got);
+    if (block < 0)
+      break;  /* past the end */
+
+    /* is it still around from the last batch? */
+    job = NULL;
+    for (i = 0; i < xs->workers; i++) {
+      if (xs->jobs[i].block == block && xs->jobs[i].ok) {
+        job = &xs->jobs[i];
+        break;
+      }
+    }
+    if (job == NULL) {
+      if (xs->failed)
+        break;
+      run_batch(xs, block, xs->workers);
+      if (xs->jobs[0].block != block || !xs->jobs[0].ok)
+        break;
+      job = &xs->jobs[0];
+    }
+
+    b = &xs->blocks[block];
+    rel = pos + got - b->out_start;
+    avail = b->out_len - rel;
+    if (avail > len - got)
+      avail = len - got;
+    memcpy((char *)buf + got, job->out + rel, avail);
+    got += avail;
+  }
+
+  return got;
+}
+
+/*
+ * close cleanup
+ */
+
+static void close_xz(SOURCE *s)
+{
+  XZ_SOURCE *xs = (XZ_SOURCE *)s;
+  int i;
+
+  for (i = 0; i < MAXWORKERS; i++) {
+    free(xs->jobs[i].raw);
+    free(xs->jobs[i].out);
+  }
+  free(xs->blocks);
+}
+
+/*
+ * read the index at the end of the stream(s), returns NULL if there is
+ * none to be had
+ */
+
+static lzma_index *read_index(SOURCE *foundation, u8 offset, u8 size)
+{
+  lzma_stream strm = LZMA_STREAM_INIT;
+  lzma_index *index;
+  lzma_ret result;
+  unsigned char *inbuf;
+  u8 pos, fill;
+
+  index = NULL;
+  if (lzma_file_info_decoder(&strm, &index, UINT64_MAX, size) != LZMA_OK)
+    return NULL;
+
+  /* the decoder reads the stream headers and footers and asks to be
+     taken to the indexes, so it doesn't see much of the data */
+  result = LZMA_OK;
+  pos = 0;
+  for (;;) {
+    fill = 65536;
+    if (pos + fill > size)
+      fill = size - pos;
+    fill = get_buffer_real(foundation, offset + pos, fill, NULL,
+                           (void **)&inbuf);
+    strm.next_in = inbuf;
+    strm.avail_in = (size_t)fill;
+    result = lzma_code(&strm, fill ? LZMA_RUN : LZMA_FINISH);
+    if (result == LZMA_SEEK_NEEDED) {
+      pos = strm.seek_pos;
+      continue;
+    }
+    if (result != LZMA_OK || fill == 0)
+      break;
+    pos += fill - strm.avail_in;
+  }
+  lzma_end(&strm);
+
+  if (result != LZMA_STREAM_END) {
+    if (index != NULL)
+      lzma_index_end(index, NULL);
+    return NULL;
+  }
+  return index;
+}
+
+/*
+ * find the block holding pos
+ */
+
+static int find_block(XZ_SOURCE *xs, u8 pos)
+{
+  int lo, hi, mid;
+
+  if (pos >= xs->c.size)
+    return -1;
+
+  lo = 0;
+  hi = xs->block_count - 1;
+  while (lo < hi) {
+    mid = (lo + hi + 1) / 2;
+    if (xs->blocks[mid].out_start <= pos)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo;
+}
+
+/*
+ * decode up to count blocks starting at first, in parallel
+ */
+
+static void run_batch(XZ_SOURCE *xs, int first, int count)
+{
+  XZ_JOB *job;
+  pthread_t threads[MAXWORKERS];
+  int started[MAXWORKERS];
+  int i;
+
+  if (count > xs->block_count - first)
+    count = xs->block_count - first;
+  if (over_budget(&xs->c, xs->decoded, xs->started))
+    count = 0;
+
+  /* the compressed data is gathered here, the layers below aren't
+     thread-safe */
+  for (i = 0; i < xs->workers; i++) {
+    job = &xs->jobs[i];
+    job->block = -1;
+    job->ok = 0;
+    if (i < count && !gather_job(xs, job, first + i))
+      count = i;
+  }
+
+  /* decode; the first one on this thread */
+  for (i = 1; i < count; i++)
+    started[i] = (pthread_create(&threads[i], NULL, decode_job,
+                                 &xs->jobs[i]) == 0);
+  if (count > 0)
+    decode_job(&xs->jobs[0]);
+  for (i = 1; i < count; i++) {
+    if (started[i])
+      pthread_join(threads[i], NULL);
+    else
+      decode_job(&xs->jobs[i]);
+  }
+
+  for (i = 0; i < count; i++) {
+    job = &xs->jobs[i];
+    if (!job->ok) {
+      if (!xs->failed)
+        error("xz data error in block %d", job->block);
+      xs->failed = 1;
+      break;
+    }
+    xs->decoded += job->b.out_len;
+  }
+}
+
+/*
+ * copy a block's compressed data into a job slot
+ */
+
+static int gather_job(XZ_SOURCE *xs, XZ_JOB *job, int block)
+{
+  XZ_BLOCK *b = &xs->blocks[block];
+
+  if (job->raw_alloc < b->in_len) {
+    free(job->raw);
+    job->raw_alloc = b->in_len;
+    job->raw = (unsigned char *)malloc(job->raw_alloc);
+    if (job->raw == NULL)
+      bailout("Out of memory");
+  }
+  if (job->out_alloc < b->out_len) {
+    free(job->out);
+    job->out_alloc = b->out_len;
+    job->out = (unsigned char *)malloc(job->out_alloc);
+    if (job->out == NULL)
+      bailout("Out of memory");
+  }
+  if (get_buffer_real(xs->c.foundation, xs->offset + b->in_start, b->in_len,
+                      job->raw, NULL) < b->in_len)
+    return 0;
+
+  job->block = block;
+  job->b = *b;
+  job->ok = 0;
+  return 1;
+}
+
+/*
+ * decode one block from its header on; runs on worker threads
+ */
+
+static void *decode_job(void *arg)
+{
+  XZ_JOB *job = (XZ_JOB *)arg;
+  lzma_filter filters[LZMA_FILTERS_MAX + 1];
+  lzma_block block;
+  size_t in_pos, out_pos;
+  lzma_ret result;
+  int i;
+
+  memset(&block, 0, sizeof(block));
+  block.version = 1;
+  block.check = job->b.check;
+  block.filters = filters;
+  block.header_size = lzma_block_header_size_decode(job->raw[0]);
+  if (block.header_size > job->b.in_len)
+    return NULL;
+  if (lzma_block_header_decode(&block, NULL, job->raw) != LZMA_OK)
+    return NULL;
+
+  result = lzma_block_compressed_size(&block, job->b.unpadded);
+  if (result == LZMA_OK) {
+    in_pos = block.header_size;
+    out_pos = 0;
+    result = lzma_block_buffer_decode(&block, NULL,
+                                      job->raw, &in_pos, job->b.in_len,
+                                      job->out, &out_pos, job->b.out_len);
+    if (result == LZMA_OK && out_pos != job->b.out_len)
+      result = LZMA_DATA_ERROR;
+  }
+  for (i = 0; filters[i].id != LZMA_VLI_UNKNOWN; i++)
+    free(filters[i].options);
+
+  job->ok = (result == LZMA_OK);
+  return NULL;
+}
+
+#endif /* USE_LZMA */
+
+/* EOF */